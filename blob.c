@@ -18,6 +18,7 @@
 #include <libubox/blobmsg.h>
 #include "uci.h"
 #include "uci_blob.h"
+#include "uci_internal.h"
 
 static bool
 uci_attr_to_blob(struct blob_buf *b, const char *str,
@@ -163,6 +164,227 @@ uci_to_blob(struct blob_buf *b, struct uci_section *s,
 	return ret;
 }
 
+/*
+ * compiled parameter lists: all params of a list and its next[] lists are
+ * flattened into one name hash, so a section is matched in a single pass
+ * over its options. the output is the same as the one of uci_to_blob
+ */
+struct uci_blob_param {
+	const struct blobmsg_policy *attr;
+	enum blobmsg_type element_type;
+	unsigned int hash;
+	int level;
+	int next;	/* next param in the same hash slot */
+	int event;	/* next matched param of the same level */
+	struct uci_option *o;
+};
+
+struct uci_blob_state {
+	int n_params;
+	int n_levels;
+	unsigned int mask;
+	struct uci_blob_param *params;
+	int *slots;
+	int *head;
+	int *tail;
+
+	/* scratch space for splitting string options into arrays */
+	char *buf;
+	size_t buf_size;
+};
+
+static void
+uci_blob_count(const struct uci_blob_param_list *p, int *n_params, int *n_levels)
+{
+	int i;
+
+	*n_params += p->n_params;
+	(*n_levels)++;
+	for (i = 0; i < p->n_next; i++)
+		uci_blob_count(p->next[i], n_params, n_levels);
+}
+
+/* same rules as __uci_element_to_blob: skip invalid and shadowed params */
+static bool
+uci_blob_param_used(const struct uci_blob_param_list *p, int i)
+{
+	const struct blobmsg_policy *attr = &p->params[i];
+	int j;
+
+	if (attr->type > BLOBMSG_TYPE_LAST)
+		return false;
+
+	for (j = 0; j < i; j++) {
+		if ((p->params[j].type == attr->type) &&
+		    !strcmp(p->params[j].name, attr->name))
+			return false;
+	}
+
+	return true;
+}
+
+static void
+uci_blob_flatten(struct uci_blob_state *st, const struct uci_blob_param_list *p,
+		 int *level)
+{
+	int cur = (*level)++;
+	int i, *tail;
+
+	for (i = 0; i < p->n_params; i++) {
+		struct uci_blob_param *par = &st->params[st->n_params];
+
+		if (!uci_blob_param_used(p, i))
+			continue;
+
+		par->attr = &p->params[i];
+		par->element_type = BLOBMSG_TYPE_STRING;
+		if (p->info && p->info[i].type)
+			par->element_type = p->info[i].type;
+		par->hash = djbhash(~0U, par->attr->name);
+		par->level = cur;
+		par->next = -1;
+
+		/* keep the slot chains in flattening order */
+		for (tail = &st->slots[par->hash & st->mask]; *tail >= 0;
+		     tail = &st->params[*tail].next);
+		*tail = st->n_params++;
+	}
+
+	for (i = 0; i < p->n_next; i++)
+		uci_blob_flatten(st, p->next[i], level);
+}
+
+struct uci_blob_state *
+uci_blob_param_compile(const struct uci_blob_param_list *p)
+{
+	struct uci_blob_state *st;
+	int n_params = 0, n_levels = 0;
+	unsigned int size = 8;
+	int i;
+
+	uci_blob_count(p, &n_params, &n_levels);
+	while (size < (unsigned int) n_params * 2)
+		size *= 2;
+
+	st = calloc(1, sizeof(*st) + n_params * sizeof(st->params[0]) +
+		    (size + 2 * n_levels) * sizeof(int));
+	if (!st)
+		return NULL;
+
+	st->params = (struct uci_blob_param *) (st + 1);
+	st->slots = (int *) &st->params[n_params];
+	st->head = &st->slots[size];
+	st->tail = &st->head[n_levels];
+	st->n_levels = n_levels;
+	st->mask = size - 1;
+	for (i = 0; i < (int) size; i++)
+		st->slots[i] = -1;
+
+	n_levels = 0;
+	uci_blob_flatten(st, p, &n_levels);
+
+	return st;
+}
+
+void
+uci_blob_state_free(struct uci_blob_state *st)
+{
+	if (!st)
+		return;
+
+	free(st->buf);
+	free(st);
+}
+
+static void
+uci_array_to_blob_state(struct blob_buf *b, struct uci_blob_state *st,
+			struct uci_option *o, enum blobmsg_type type)
+{
+	struct uci_element *e;
+	char *next, *word;
+	size_t len;
+
+	if (o->type == UCI_TYPE_LIST) {
+		uci_foreach_element(&o->v.list, e) {
+			uci_attr_to_blob(b, e->name, NULL, type);
+		}
+		return;
+	}
+
+	len = strlen(o->v.string) + 1;
+	if (len > st->buf_size) {
+		next = realloc(st->buf, len);
+		if (!next)
+			return;
+
+		st->buf = next;
+		st->buf_size = len;
+	}
+	next = memcpy(st->buf, o->v.string, len);
+
+	while ((word = strsep(&next, " \t")) != NULL) {
+		if (!*word)
+			continue;
+
+		uci_attr_to_blob(b, word, NULL, type);
+	}
+}
+
+int
+uci_to_blob_compiled(struct blob_buf *b, struct uci_section *s,
+		     struct uci_blob_state *st)
+{
+	struct uci_element *e;
+	void *array;
+	int ret = 0;
+	int i, l;
+
+	for (l = 0; l < st->n_levels; l++)
+		st->head[l] = st->tail[l] = -1;
+
+	/* option names are unique, so every param matches at most once */
+	uci_foreach_element(&s->options, e) {
+		unsigned int hash = djbhash(~0U, e->name);
+
+		for (i = st->slots[hash & st->mask]; i >= 0; i = st->params[i].next) {
+			struct uci_blob_param *par = &st->params[i];
+
+			if ((par->hash != hash) || strcmp(par->attr->name, e->name))
+				continue;
+
+			par->o = uci_to_option(e);
+			par->event = -1;
+			if (st->tail[par->level] < 0)
+				st->head[par->level] = i;
+			else
+				st->params[st->tail[par->level]].event = i;
+			st->tail[par->level] = i;
+		}
+	}
+
+	for (l = 0; l < st->n_levels; l++) {
+		for (i = st->head[l]; i >= 0; i = st->params[i].event) {
+			struct uci_blob_param *par = &st->params[i];
+
+			if (par->attr->type == BLOBMSG_TYPE_ARRAY) {
+				array = blobmsg_open_array(b, par->attr->name);
+				uci_array_to_blob_state(b, st, par->o, par->element_type);
+				blobmsg_close_array(b, array);
+				ret++;
+				continue;
+			}
+
+			if (par->o->type == UCI_TYPE_LIST)
+				continue;
+
+			ret += uci_attr_to_blob(b, par->o->v.string,
+						par->attr->name, par->attr->type);
+		}
+	}
+
+	return ret;
+}
+
 bool
 uci_blob_diff(struct blob_attr **tb1, struct blob_attr **tb2,
 	      const struct uci_blob_param_list *config, unsigned long *diff)
@@ -236,3 +458,53 @@ uci_blob_check_equal(struct blob_attr *c1, struct blob_attr *c2,
 
 	return true;
 }
+
+static uint32_t
+__uci_blob_fingerprint(uint32_t h, struct blob_attr *c,
+		       const struct uci_blob_param_list *config)
+{
+	struct blob_attr **tb;
+	int i;
+
+	tb = alloca(config->n_params * sizeof(struct blob_attr *));
+	blobmsg_parse(config->params, config->n_params, tb,
+		blob_data(c), blob_len(c));
+
+	/* covers exactly the data compared by uci_blob_diff */
+	for (i = 0; i < config->n_params; i++) {
+		bool present = !!tb[i];
+
+		h = hash_murmur2(h, &present, sizeof(present));
+		if (present)
+			h = hash_murmur2(h, tb[i], blob_raw_len(tb[i]));
+	}
+
+	return h;
+}
+
+uint32_t
+uci_blob_fingerprint(struct blob_attr *c, const struct uci_blob_param_list *config)
+{
+	uint32_t h = 0xdeadc0de;
+	int i;
+
+	if (!c)
+		return 0;
+
+	h = __uci_blob_fingerprint(h, c, config);
+	for (i = 0; i < config->n_next; i++)
+		h = __uci_blob_fingerprint(h, c, config->next[i]);
+
+	return h;
+}
+
+bool
+uci_blob_check_equal_fingerprint(struct blob_attr *c1, uint32_t fp1,
+				 struct blob_attr *c2, uint32_t fp2,
+				 const struct uci_blob_param_list *config)
+{
+	if (fp1 != fp2)
+		return false;
+
+	return uci_blob_check_equal(c1, c2, config);
+}
@@ -17,9 +17,11 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <unistd.h>
+#include <inttypes.h>
 #include "uci.h"
 
 #define MAX_ARGS	4 /* max command line arguments for batch mode */
+#define CLI_OUTBUF	(64 * 1024) /* stdout buffer size when not on a terminal */
 
 static const char *delimiter = " ";
 static const char *appname;
@@ -32,6 +34,8 @@ static enum {
 } flags;
 
 static FILE *input;
+static int batch_interval = 1;
+static int batch_unsaved;
 
 static struct uci_context *ctx;
 enum {
@@ -47,7 +51,9 @@ enum {
 	/* package cmds */
 	CMD_SHOW,
 	CMD_CHANGES,
+	CMD_DIFF,
 	CMD_EXPORT,
+	CMD_EVAL,
 	CMD_COMMIT,
 	/* other cmds */
 	CMD_ADD,
@@ -144,8 +150,10 @@ static void uci_usage(void)
 		"Commands:\n"
 		"\tbatch\n"
 		"\texport     [<config>]\n"
+		"\teval       <config>\n"
 		"\timport     [<config>]\n"
 		"\tchanges    [<config>]\n"
+		"\tdiff       [<config>]\n"
 		"\tcommit     [<config>]\n"
 		"\tadd        <config> <section-type>\n"
 		"\tadd_list   <config>.<section>.<option>=<string>\n"
@@ -159,8 +167,12 @@ static void uci_usage(void)
 		"\treorder    <config>.<section>=<position>\n"
 		"\n"
 		"Options:\n"
+		"\t-b <count> in batch mode, save changes every <count> commands (default: 1,\n"
+		"\t           0: only before commit and on exit)\n"
 		"\t-c <path>  set the search path for config files (default: /etc/config)\n"
-		"\t-d <str>   set the delimiter for list values in uci show\n"
+		"\t-C <path>  cache parsed configs as snapshots in <path>\n"
+		"\t-M <path>  share parsed configs with other processes through <path>\n"
+		"\t-d <str>   set the delimiter for list values in uci show and eval\n"
 		"\t-f <file>  use <file> as input instead of stdin\n"
 		"\t-m         when importing, merge data into an existing package\n"
 		"\t-n         name unnamed sections on export (default)\n"
@@ -171,12 +183,23 @@ static void uci_usage(void)
 		"\t-q         quiet mode (don't print error messages)\n"
 		"\t-s         force strict mode (stop on parser errors, default)\n"
 		"\t-S         disable strict mode\n"
+		"\t-T         print parser, lookup and file operation statistics to stderr\n"
+		"\t-w <ms>    fail if a file lock can't be taken within <ms> milliseconds\n"
 		"\t-X         do not use extended syntax on 'show'\n"
 		"\n",
 		appname
 	);
 }
 
+/* in batch mode, saving may be deferred to save every batch_interval commands */
+static int cli_save(struct uci_package *p)
+{
+	if ((flags & CLI_FLAG_BATCH) && (batch_interval != 1))
+		return UCI_OK;
+
+	return uci_save(ctx, p);
+}
+
 static void cli_perror(void)
 {
 	if (flags & CLI_FLAG_QUIET)
@@ -198,17 +221,48 @@ static void cli_error(const char *fmt, ...)
 	va_end(ap);
 }
 
-static void uci_print_value(FILE *f, const char *v)
+static void uci_print_stats(void)
 {
-	fprintf(f, "'");
-	while (*v) {
-		if (*v != '\'')
-			fputc(*v, f);
-		else
-			fprintf(f, "'\\''");
-		v++;
+	struct uci_stats st;
+	struct uci_element *e;
+	int i = 0;
+
+	if (uci_get_stats(ctx, &st, false) != UCI_OK)
+		return;
+
+	fprintf(stderr, "stats: parse_bytes %" PRIu64 "\n", st.parse_bytes);
+	fprintf(stderr, "stats: parse_lines %" PRIu64 "\n", st.parse_lines);
+	fprintf(stderr, "stats: lookups %" PRIu64 "\n", st.lookups);
+	fprintf(stderr, "stats: compares %" PRIu64 "\n", st.compares);
+	uci_foreach_element(&ctx->delta_path, e) {
+		if (i == UCI_STATS_DELTA_PATHS)
+			break;
+		fprintf(stderr, "stats: delta_lines %s %" PRIu64 "\n", e->name, st.delta_lines[i++]);
 	}
-	fprintf(f, "'");
+	fprintf(stderr, "stats: delta_dropped %" PRIu64 "\n", st.delta_dropped);
+	fprintf(stderr, "stats: lock_wait_ns %" PRIu64 "\n", st.lock_wait);
+	fprintf(stderr, "stats: fsync_ns %" PRIu64 "\n", st.fsync_time);
+	fprintf(stderr, "stats: rename_ns %" PRIu64 "\n", st.rename_time);
+}
+
+static void uci_print_escaped(FILE *f, const char *v)
+{
+	const char *quote;
+
+	/* write the spans between single quotes as a whole */
+	while ((quote = strchr(v, '\'')) != NULL) {
+		fwrite(v, 1, quote - v, f);
+		fputs("'\\''", f);
+		v = quote + 1;
+	}
+	fputs(v, f);
+}
+
+static void uci_print_value(FILE *f, const char *v)
+{
+	fputc('\'', f);
+	uci_print_escaped(f, v);
+	fputc('\'', f);
 }
 
 static void uci_show_value(struct uci_option *o, bool quote)
@@ -222,8 +276,8 @@ static void uci_show_value(struct uci_option *o, bool quote)
 		if (quote)
 			uci_print_value(stdout, o->v.string);
 		else
-			printf("%s", o->v.string);
-		printf("\n");
+			fputs(o->v.string, stdout);
+		putchar('\n');
 		break;
 	case UCI_TYPE_LIST:
 		uci_foreach_element(&o->v.list, e) {
@@ -245,10 +299,12 @@ static void uci_show_value(struct uci_option *o, bool quote)
 
 static void uci_show_option(struct uci_option *o, bool quote)
 {
-	printf("%s.%s.%s=",
-		o->section->package->e.name,
-		(cur_section_ref ? cur_section_ref : o->section->e.name),
-		o->e.name);
+	fputs(o->section->package->e.name, stdout);
+	putchar('.');
+	fputs(cur_section_ref ? cur_section_ref : o->section->e.name, stdout);
+	putchar('.');
+	fputs(o->e.name, stdout);
+	putchar('=');
 	uci_show_value(o, quote);
 }
 
@@ -312,6 +368,132 @@ static void uci_show_changes(struct uci_package *p)
 	}
 }
 
+/* what committing the changes of a package would change in its config */
+static int uci_show_diff(struct uci_package *p)
+{
+	struct uci_element *e;
+	struct uci_list list;
+	int ret;
+
+	ret = uci_diff_delta(ctx, p, &list);
+	if (ret != UCI_OK) {
+		cli_perror();
+		uci_free_diff(&list);
+		return ret;
+	}
+
+	uci_foreach_element(&list, e) {
+		struct uci_diff *d = uci_to_diff(e);
+		const char *prefix = (d->type == UCI_DIFF_ADD) ? "+" : "";
+
+		if (d->type == UCI_DIFF_REMOVE) {
+			printf("-%s.%s", p->e.name, d->section);
+			if (e->name)
+				printf(".%s", e->name);
+			printf("\n");
+		} else if (e->name) {
+			fputs(prefix, stdout);
+			uci_show_option(uci_to_option(d->target), true);
+		} else {
+			printf("%s%s.%s=%s\n", prefix, p->e.name, d->section,
+			       uci_to_section(d->target)->type);
+		}
+	}
+	uci_free_diff(&list);
+
+	return ret;
+}
+
+/*
+ * name of a section as config_load in sh/uci.sh sees it, unnamed sections
+ * are numbered by their position if the export does not name them
+ */
+static const char *uci_eval_name(struct uci_section *s, int idx, char *buf, size_t len)
+{
+	if (!s->anonymous || (ctx->flags & UCI_FLAG_EXPORT_NAME))
+		return s->e.name;
+
+	snprintf(buf, len, "cfg%d", idx);
+	return buf;
+}
+
+static void uci_eval_list(const char *sname, struct uci_option *o)
+{
+	/* sh/uci.sh falls back to a space for an empty separator */
+	const char *sep = *delimiter ? delimiter : " ";
+	struct uci_element *e;
+	bool empty = true;
+	int len = 0;
+
+	uci_foreach_element(&o->v.list, e) {
+		printf("CONFIG_%s_%s_ITEM%d=", sname, o->e.name, ++len);
+		uci_print_value(stdout, e->name);
+		putchar('\n');
+	}
+	printf("CONFIG_%s_%s_LENGTH=%d\n", sname, o->e.name, len);
+
+	/* same as append(), which skips empty values */
+	printf("CONFIG_%s_%s='", sname, o->e.name);
+	uci_foreach_element(&o->v.list, e) {
+		if (!*e->name)
+			continue;
+		if (!empty)
+			uci_print_escaped(stdout, sep);
+		uci_print_escaped(stdout, e->name);
+		empty = false;
+	}
+	fputs("'\n", stdout);
+}
+
+/*
+ * print the variables that config_load in sh/uci.sh sets for a package,
+ * in the same order, so that a shell can load it with a single eval.
+ * the config, option and list callbacks are not run
+ */
+static void uci_eval_package(struct uci_package *p)
+{
+	struct uci_element *e, *o;
+	const char *sname = NULL;
+	char buf[16];
+	int n = 0;
+
+	uci_foreach_element(&p->sections, e) {
+		struct uci_section *s = uci_to_section(e);
+
+		sname = uci_eval_name(s, ++n, buf, sizeof(buf));
+		printf("CONFIG_%s_TYPE=", sname);
+		uci_print_value(stdout, s->type);
+		putchar('\n');
+		uci_foreach_element(&s->options, o) {
+			struct uci_option *opt = uci_to_option(o);
+
+			switch(opt->type) {
+			case UCI_TYPE_STRING:
+				printf("CONFIG_%s_%s=", sname, opt->e.name);
+				uci_print_value(stdout, opt->v.string);
+				putchar('\n');
+				break;
+			case UCI_TYPE_LIST:
+				uci_eval_list(sname, opt);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	fputs("CONFIG_SECTIONS='", stdout);
+	n = 0;
+	uci_foreach_element(&p->sections, e) {
+		if (n)
+			putchar(' ');
+		fputs(uci_eval_name(uci_to_section(e), ++n, buf, sizeof(buf)), stdout);
+	}
+	fputs("'\n", stdout);
+	printf("CONFIG_NUM_SECTIONS=%d\n", n);
+	printf("CONFIG_SECTION='%s'\n", sname ? sname : "");
+}
+
 static int package_cmd(int cmd, char *tuple)
 {
 	struct uci_element *e = NULL;
@@ -328,6 +510,10 @@ static int package_cmd(int cmd, char *tuple)
 	case CMD_CHANGES:
 		uci_show_changes(ptr.p);
 		break;
+	case CMD_DIFF:
+		if (uci_show_diff(ptr.p) != UCI_OK)
+			goto out;
+		break;
 	case CMD_COMMIT:
 		if (flags & CLI_FLAG_NOCOMMIT) {
 			ret = 0;
@@ -343,6 +529,9 @@ static int package_cmd(int cmd, char *tuple)
 			goto out;
 		}
 		break;
+	case CMD_EVAL:
+		uci_eval_package(ptr.p);
+		break;
 	case CMD_SHOW:
 		if (!(ptr.flags & UCI_LOOKUP_COMPLETE)) {
 			ctx->err = UCI_ERR_NOTFOUND;
@@ -418,6 +607,41 @@ static int uci_do_import(int argc, char **argv)
 	return 0;
 }
 
+/* commit all configs together, so that they hit the disk at once */
+static void uci_commit_all(char **configs)
+{
+	struct uci_package **packages;
+	struct uci_ptr ptr;
+	char **p;
+	int n = 0;
+
+	if (flags & CLI_FLAG_NOCOMMIT)
+		return;
+
+	for (p = configs; *p; p++)
+		n++;
+
+	packages = calloc(n + 1, sizeof(struct uci_package *));
+	if (!packages) {
+		ctx->err = UCI_ERR_MEM;
+		cli_perror();
+		return;
+	}
+
+	n = 0;
+	for (p = configs; *p; p++) {
+		if (uci_lookup_ptr(ctx, &ptr, *p, true) != UCI_OK) {
+			cli_perror();
+			continue;
+		}
+		packages[n++] = ptr.p;
+	}
+
+	if (uci_commit_many(ctx, packages, n, false) != UCI_OK)
+		cli_perror();
+	free(packages);
+}
+
 static int uci_do_package_cmd(int cmd, int argc, char **argv)
 {
 	char **configs = NULL;
@@ -430,13 +654,24 @@ static int uci_do_package_cmd(int cmd, int argc, char **argv)
 	if (argc == 2)
 		return package_cmd(cmd, argv[1]);
 
+	/* the shell variables of two packages would overwrite each other */
+	if (cmd == CMD_EVAL)
+		return 255;
+
 	if ((uci_list_configs(ctx, &configs) != UCI_OK) || !configs) {
 		cli_perror();
 		goto out;
 	}
 
-	for (p = configs; *p; p++) {
-		package_cmd(cmd, *p);
+	if (cmd == CMD_COMMIT) {
+		uci_commit_all(configs);
+	} else {
+		/* parse everything up front, failures are reported one by one below */
+		if ((cmd == CMD_SHOW) || (cmd == CMD_EXPORT))
+			uci_load_all(ctx, configs);
+		for (p = configs; *p; p++) {
+			package_cmd(cmd, *p);
+		}
 	}
 
 	ret = 0;
@@ -454,15 +689,19 @@ static int uci_do_add(int argc, char **argv)
 	if (argc != 3)
 		return 255;
 
-	ret = uci_load(ctx, argv[1], &p);
-	if (ret != UCI_OK)
-		goto done;
+	/* may still be loaded from a previous batch command */
+	p = uci_lookup_package(ctx, argv[1]);
+	if (!p) {
+		ret = uci_load(ctx, argv[1], &p);
+		if (ret != UCI_OK)
+			goto done;
+	}
 
 	ret = uci_add_section(ctx, p, argv[2], &s);
 	if (ret != UCI_OK)
 		goto done;
 
-	ret = uci_save(ctx, p);
+	ret = cli_save(p);
 
 done:
 	if (ret != UCI_OK)
@@ -549,7 +788,7 @@ static int uci_do_section_cmd(int cmd, int argc, char **argv)
 
 	/* save changes, but don't commit them yet */
 	if (ret == UCI_OK)
-		ret = uci_save(ctx, ptr.p);
+		ret = cli_save(ptr.p);
 
 	if (ret != UCI_OK) {
 		cli_perror();
@@ -601,25 +840,74 @@ static int uci_batch_cmd(void)
 	return ret;
 }
 
+/* save and unload loaded packages, only the stale ones if all is false */
+static void uci_batch_flush(bool all)
+{
+	struct uci_element *e, *tmp;
+	bool stale;
+
+	uci_foreach_element_safe(&ctx->root, tmp, e) {
+		struct uci_package *p = uci_to_package(e);
+
+		if (!all && (uci_package_stale(ctx, p, &stale) == UCI_OK) && !stale)
+			continue;
+
+		if (uci_save(ctx, p) != UCI_OK)
+			cli_perror();
+		uci_unload(ctx, p);
+	}
+}
+
+/*
+ * packages stay loaded between batch commands that only look at or change
+ * them, as long as nobody else modifies their files. all other commands
+ * start from the files again
+ */
+static void uci_batch_prepare(int cmd)
+{
+	switch(cmd) {
+	case CMD_ADD:
+	case CMD_ADD_LIST:
+	case CMD_DEL_LIST:
+	case CMD_GET:
+	case CMD_SET:
+	case CMD_DEL:
+	case CMD_RENAME:
+	case CMD_REORDER:
+	case CMD_SHOW:
+	case CMD_EXPORT:
+	case CMD_EVAL:
+		uci_batch_flush(false);
+		break;
+	default:
+		uci_batch_flush(true);
+		batch_unsaved = 0;
+		break;
+	}
+}
+
 static int uci_batch(void)
 {
+	struct uci_element *e;
 	int ret = 0;
 
 	flags |= CLI_FLAG_BATCH;
 	while (!feof(input)) {
-		struct uci_element *e, *tmp;
-
 		ret = uci_batch_cmd();
 		if (ret == 254)
-			return 0;
+			break;
 		else if (ret == 255)
 			cli_error("Unknown command\n");
 
-		/* clean up */
-		uci_foreach_element_safe(&ctx->root, tmp, e) {
-			uci_unload(ctx, uci_to_package(e));
+		if ((batch_interval > 1) && (++batch_unsaved >= batch_interval)) {
+			uci_foreach_element(&ctx->root, e) {
+				if (uci_save(ctx, uci_to_package(e)) != UCI_OK)
+					cli_perror();
+			}
+			batch_unsaved = 0;
 		}
 	}
+	uci_batch_flush(true);
 	flags &= ~CLI_FLAG_BATCH;
 
 	return 0;
@@ -635,8 +923,12 @@ static int uci_cmd(int argc, char **argv)
 		cmd = CMD_SHOW;
 	else if (!strcasecmp(argv[0], "changes"))
 		cmd = CMD_CHANGES;
+	else if (!strcasecmp(argv[0], "diff"))
+		cmd = CMD_DIFF;
 	else if (!strcasecmp(argv[0], "export"))
 		cmd = CMD_EXPORT;
+	else if (!strcasecmp(argv[0], "eval"))
+		cmd = CMD_EVAL;
 	else if (!strcasecmp(argv[0], "commit"))
 		cmd = CMD_COMMIT;
 	else if (!strcasecmp(argv[0], "get"))
@@ -666,6 +958,18 @@ static int uci_cmd(int argc, char **argv)
 	else
 		cmd = -1;
 
+	/*
+	 * read-only commands can parse configs straight from the file mapping,
+	 * unless the package stays loaded for further batch commands
+	 */
+	if (flags & CLI_FLAG_BATCH)
+		uci_batch_prepare(cmd);
+	else if ((cmd == CMD_SHOW) || (cmd == CMD_GET) || (cmd == CMD_EXPORT) ||
+		 (cmd == CMD_EVAL) || (cmd == CMD_CHANGES) || (cmd == CMD_DIFF))
+		ctx->flags |= UCI_FLAG_MMAP;
+	else
+		ctx->flags &= ~UCI_FLAG_MMAP;
+
 	switch(cmd) {
 		case CMD_ADD_LIST:
 		case CMD_DEL_LIST:
@@ -678,8 +982,10 @@ static int uci_cmd(int argc, char **argv)
 			return uci_do_section_cmd(cmd, argc, argv);
 		case CMD_SHOW:
 		case CMD_EXPORT:
+		case CMD_EVAL:
 		case CMD_COMMIT:
 		case CMD_CHANGES:
+		case CMD_DIFF:
 			return uci_do_package_cmd(cmd, argc, argv);
 		case CMD_IMPORT:
 			return uci_do_import(argc, argv);
@@ -706,12 +1012,24 @@ int main(int argc, char **argv)
 		cli_error("Out of memory\n");
 		return 1;
 	}
+	/* show and export output is mostly piped, write it in large blocks */
+	if (!isatty(STDOUT_FILENO))
+		setvbuf(stdout, NULL, _IOFBF, CLI_OUTBUF);
+	/* packages are only ever freed as a whole, batch keeps them until they go stale */
+	ctx->flags |= UCI_FLAG_ARENA;
 
-	while((c = getopt(argc, argv, "c:d:f:LmnNp:P:qsSt:X")) != -1) {
+	while((c = getopt(argc, argv, "b:c:C:d:f:LmM:nNp:P:qsSt:Tw:X")) != -1) {
 		switch(c) {
+			case 'b':
+				batch_interval = atoi(optarg);
+				break;
 			case 'c':
 				uci_set_confdir(ctx, optarg);
 				break;
+			case 'C':
+				uci_set_cachedir(ctx, optarg);
+				ctx->flags |= UCI_FLAG_CACHE;
+				break;
 			case 'd':
 				delimiter = optarg;
 				break;
@@ -731,6 +1049,10 @@ int main(int argc, char **argv)
 			case 'm':
 				flags |= CLI_FLAG_MERGE;
 				break;
+			case 'M':
+				uci_set_cachedir(ctx, optarg);
+				uci_set_backend(ctx, "shm");
+				break;
 			case 's':
 				ctx->flags |= UCI_FLAG_STRICT;
 				break;
@@ -757,6 +1079,12 @@ int main(int argc, char **argv)
 			case 't':
 				uci_set_savedir(ctx, optarg);
 				break;
+			case 'T':
+				ctx->flags |= UCI_FLAG_STATS;
+				break;
+			case 'w':
+				uci_set_lock_timeout(ctx, atoi(optarg));
+				break;
 			case 'X':
 				flags &= ~CLI_FLAG_SHOW_EXT;
 				break;
@@ -779,6 +1107,9 @@ int main(int argc, char **argv)
 	if (input != stdin)
 		fclose(input);
 
+	if (ctx->flags & UCI_FLAG_STATS)
+		uci_print_stats();
+
 	if (ret == 255)
 		uci_usage();
 
@@ -23,6 +23,7 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
@@ -66,34 +67,30 @@ uci_free_delta(struct uci_delta *h)
 	uci_free_element(&h->e);
 }
 
-static void uci_delta_save(struct uci_context *ctx, FILE *f,
+static void uci_delta_save(struct uci_context *ctx, struct uci_buf *buf,
 			const char *name, const struct uci_delta *h)
 {
 	const struct uci_element *e = &h->e;
-	char prefix[2] = {0, 0};
-
-	if (h->cmd <= __UCI_CMD_LAST)
-		prefix[0] = uci_command_char[h->cmd];
-
-	fprintf(f, "%s%s.%s", prefix, name, h->section);
-	if (e->name)
-		fprintf(f, ".%s", e->name);
-
-	if (h->cmd == UCI_CMD_REMOVE && !h->value)
-		fprintf(f, "\n");
-	else {
-		int i;
-
-		fprintf(f, "='");
-		for (i = 0; h->value[i]; i++) {
-			unsigned char c = h->value[i];
-			if (c != '\'')
-				fputc(c, f);
-			else
-				fprintf(f, "'\\''");
-		}
-		fprintf(f, "'\n");
+
+	if ((h->cmd <= __UCI_CMD_LAST) && uci_command_char[h->cmd])
+		uci_buf_putc(ctx, buf, uci_command_char[h->cmd]);
+
+	uci_buf_put(ctx, buf, name, strlen(name));
+	uci_buf_putc(ctx, buf, '.');
+	uci_buf_put(ctx, buf, h->section, strlen(h->section));
+	if (e->name) {
+		uci_buf_putc(ctx, buf, '.');
+		uci_buf_put(ctx, buf, e->name, strlen(e->name));
+	}
+
+	if (h->cmd == UCI_CMD_REMOVE && !h->value) {
+		uci_buf_putc(ctx, buf, '\n');
+		return;
 	}
+
+	uci_buf_put(ctx, buf, "='", 2);
+	uci_buf_put_escaped(ctx, buf, h->value);
+	uci_buf_put(ctx, buf, "'\n", 2);
 }
 
 int uci_set_savedir(struct uci_context *ctx, const char *dir)
@@ -211,53 +208,59 @@ error:
 	return 0;
 }
 
-static void uci_parse_delta_line(struct uci_context *ctx, struct uci_package *p)
+static void uci_apply_delta(struct uci_context *ctx, int cmd, struct uci_ptr *ptr)
 {
 	struct uci_element *e = NULL;
-	struct uci_ptr ptr;
-	int cmd;
-
-	cmd = uci_parse_delta_tuple(ctx, &ptr);
-	if (strcmp(ptr.package, p->e.name) != 0)
-		goto error;
-
-	if (ctx->flags & UCI_FLAG_SAVED_DELTA)
-		uci_add_delta(ctx, &p->saved_delta, cmd, ptr.section, ptr.option, ptr.value);
 
 	switch(cmd) {
 	case UCI_CMD_REORDER:
-		uci_expand_ptr(ctx, &ptr, true);
-		if (!ptr.s)
+		uci_expand_ptr(ctx, ptr, true);
+		if (!ptr->s)
 			UCI_THROW(ctx, UCI_ERR_NOTFOUND);
-		UCI_INTERNAL(uci_reorder_section, ctx, ptr.s, strtoul(ptr.value, NULL, 10));
+		UCI_INTERNAL(uci_reorder_section, ctx, ptr->s, strtoul(ptr->value, NULL, 10));
 		break;
 	case UCI_CMD_RENAME:
-		UCI_INTERNAL(uci_rename, ctx, &ptr);
+		UCI_INTERNAL(uci_rename, ctx, ptr);
 		break;
 	case UCI_CMD_REMOVE:
-		UCI_INTERNAL(uci_delete, ctx, &ptr);
+		UCI_INTERNAL(uci_delete, ctx, ptr);
 		break;
 	case UCI_CMD_LIST_ADD:
-		UCI_INTERNAL(uci_add_list, ctx, &ptr);
+		UCI_INTERNAL(uci_add_list, ctx, ptr);
 		break;
 	case UCI_CMD_LIST_DEL:
-		UCI_INTERNAL(uci_del_list, ctx, &ptr);
+		UCI_INTERNAL(uci_del_list, ctx, ptr);
 		break;
 	case UCI_CMD_ADD:
 	case UCI_CMD_CHANGE:
-		UCI_INTERNAL(uci_set, ctx, &ptr);
-		e = ptr.last;
-		if (!ptr.option && e && (cmd == UCI_CMD_ADD))
+		UCI_INTERNAL(uci_set, ctx, ptr);
+		e = ptr->last;
+		if (!ptr->option && e && (cmd == UCI_CMD_ADD))
 			uci_to_section(e)->anonymous = true;
 		break;
 	}
+}
+
+static void uci_parse_delta_line(struct uci_context *ctx, struct uci_package *p, struct uci_list *list)
+{
+	struct uci_ptr ptr;
+	int cmd;
+
+	cmd = uci_parse_delta_tuple(ctx, &ptr);
+	if (strcmp(ptr.package, p->e.name) != 0)
+		goto error;
+
+	uci_add_delta(ctx, list, cmd, ptr.section, ptr.option, ptr.value);
 	return;
 error:
 	UCI_THROW(ctx, UCI_ERR_PARSE);
 }
 
-/* returns the number of changes that were successfully parsed */
-static int uci_parse_delta(struct uci_context *ctx, FILE *stream, struct uci_package *p)
+/*
+ * collect the changes of a delta file in list, they are applied once all of
+ * the files were read. returns the number of lines that were parsed
+ */
+static int uci_parse_delta(struct uci_context *ctx, FILE *stream, struct uci_package *p, struct uci_list *list)
 {
 	struct uci_parse_context *pctx;
 	volatile int changes = 0;
@@ -280,7 +283,7 @@ static int uci_parse_delta(struct uci_context *ctx, FILE *stream, struct uci_pac
 		 * delta as possible
 		 */
 		UCI_TRAP_SAVE(ctx, error);
-		uci_parse_delta_line(ctx, p);
+		uci_parse_delta_line(ctx, p, list);
 		UCI_TRAP_RESTORE(ctx);
 		changes++;
 error:
@@ -292,86 +295,576 @@ error:
 	return changes;
 }
 
-/* returns the number of changes that were successfully parsed */
-static int uci_load_delta_file(struct uci_context *ctx, struct uci_package *p, char *filename, FILE *volatile *f, bool flush)
+/*
+ * per section/option state used while compacting a list of deltas.
+ * section keys have option == NULL
+ */
+struct uci_delta_key {
+	const char *section;
+	const char *option;
+	struct uci_delta_key *sec;
+	unsigned int gen;
+	bool killed;
+	bool dup;
+	struct uci_delta *last;
+	struct uci_delta *prev;
+	struct uci_delta *kill;
+	struct uci_delta *reorder;
+	unsigned int seq;
+	unsigned int hash;
+};
+
+struct uci_delta_index {
+	struct uci_delta_key *keys;
+	unsigned int mask;
+	unsigned int used;
+};
+
+static struct uci_delta_key *
+uci_delta_key(struct uci_delta_index *idx, const char *section, const char *option)
+{
+	struct uci_delta_key *k;
+	unsigned int hash, i;
+
+	hash = djbhash(~0U, section);
+	if (option)
+		hash = djbhash(hash, option);
+
+	for (i = (hash ^ (hash >> 15)) & idx->mask; idx->keys[i].section; i = (i + 1) & idx->mask) {
+		k = &idx->keys[i];
+		if ((k->hash != hash) || (strcmp(k->section, section) != 0))
+			continue;
+		if ((k->option == option) ||
+		    (k->option && option && !strcmp(k->option, option)))
+			return k;
+	}
+
+	k = &idx->keys[i];
+	k->section = section;
+	k->option = option;
+	k->hash = hash;
+	idx->used++;
+	if (option)
+		k->sec = uci_delta_key(idx, section, NULL);
+	return k;
+}
+
+static void uci_delta_grow(struct uci_context *ctx, struct uci_delta_index *idx)
+{
+	struct uci_delta_index old = *idx;
+	struct uci_delta_key *k, *sec;
+	unsigned int i, pass;
+
+	idx->mask = 2 * old.mask + 1;
+	idx->used = 0;
+	idx->keys = calloc(idx->mask + 1, sizeof(struct uci_delta_key));
+	if (!idx->keys) {
+		free(old.keys);
+		UCI_THROW(ctx, UCI_ERR_MEM);
+	}
+
+	/* sections first, so that their options can point to them */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i <= old.mask; i++) {
+			if (!old.keys[i].section || (!old.keys[i].option != !pass))
+				continue;
+
+			k = uci_delta_key(idx, old.keys[i].section, old.keys[i].option);
+			sec = k->sec;
+			*k = old.keys[i];
+			k->sec = sec;
+		}
+	}
+	free(old.keys);
+}
+
+/*
+ * make room for the keys of one more entry, which adds at most three.
+ * pointers to keys are only valid until the next call
+ */
+static inline void uci_delta_reserve(struct uci_context *ctx, struct uci_delta_index *idx)
+{
+	if (2 * (idx->used + 3) > idx->mask + 1)
+		uci_delta_grow(ctx, idx);
+}
+
+/*
+ * renames do not check for existing elements of the same name, so their
+ * targets can refer to more than one element and are left alone
+ */
+static inline bool uci_delta_dup(struct uci_delta_key *s, struct uci_delta_key *o)
+{
+	return s->dup || (o && o->dup);
+}
+
+static void uci_delta_drop(struct uci_list *dropped, struct uci_delta *h)
+{
+	uci_list_del(&h->e.list);
+	uci_list_add(dropped, &h->e.list);
+}
+
+/*
+ * collapse redundant entries of a delta list without changing the result
+ * of replaying it on top of any config:
+ *
+ * - everything done to an option before it or its section gets deleted,
+ *   and reorders of sections that get deleted. other section level changes
+ *   are kept, every section that is created counts for the generated names
+ * - repeated section type changes (kept at the position of the first one)
+ * - repeated reorders of a section with no other reorder in between
+ * - sets of an option to the value it already has
+ * - runs of three or more sets of an option, which become a delete
+ *   followed by the last set, as each set moves the option to the end
+ *
+ * renames and section level changes act as barriers for the keys they touch,
+ * rename targets are never compacted,
+ * reorders keep sections that are deleted later on in place, as the new
+ * index depends on them. returns the number of entries that were removed
+ * from the list
+ */
+__private int uci_compact_delta(struct uci_context *ctx, struct uci_list *list)
+{
+	struct uci_delta_index idx;
+	struct uci_list *ptr, *tmp;
+	struct uci_element *e, *etmp;
+	struct uci_list dropped;
+	unsigned int n = 0, size, i, seq = 0;
+	int changes = 0;
+
+	uci_list_init(&dropped);
+	uci_foreach_element(list, e)
+		n++;
+	if (n < 2)
+		return 0;
+
+	/* the index grows with the number of distinct keys */
+	for (size = 16; (size < 4 * n) && (size < 256); size <<= 1);
+	idx.keys = uci_malloc(ctx, size * sizeof(struct uci_delta_key));
+	idx.mask = size - 1;
+	idx.used = 0;
+
+	uci_foreach_element(list, e) {
+		struct uci_delta *h = uci_to_delta(e);
+
+		if (h->cmd != UCI_CMD_RENAME)
+			continue;
+		uci_delta_reserve(ctx, &idx);
+		if (h->e.name)
+			uci_delta_key(&idx, h->section, h->value)->dup = true;
+		else
+			uci_delta_key(&idx, h->value, NULL)->dup = true;
+	}
+
+	/* backwards: drop everything that is deleted later on */
+	for (ptr = list->prev; ptr != list; ptr = tmp) {
+		struct uci_delta *h = uci_to_delta(list_to_element(ptr));
+		struct uci_delta_key *s, *o = NULL, *t;
+		bool dup;
+
+		tmp = ptr->prev;
+		uci_delta_reserve(ctx, &idx);
+		s = uci_delta_key(&idx, h->section, NULL);
+		if (h->e.name)
+			o = uci_delta_key(&idx, h->section, h->e.name);
+		dup = uci_delta_dup(s, o);
+
+		if ((h->cmd == UCI_CMD_RENAME) && !o) {
+			t = uci_delta_key(&idx, h->value, NULL);
+			s->killed = t->killed = false;
+			s->gen++;
+			t->gen++;
+			continue;
+		}
+		if (!dup && s->killed &&
+		    (o || ((s->seq == seq) && (h->cmd == UCI_CMD_REORDER)))) {
+			uci_delta_drop(&dropped, h);
+			continue;
+		}
+		if (h->cmd == UCI_CMD_REORDER) {
+			seq++;
+			continue;
+		}
+		if (dup)
+			continue;
+		if (h->cmd == UCI_CMD_RENAME) {
+			s->gen++;
+			continue;
+		}
+		if (o && o->killed && (o->gen == s->gen)) {
+			uci_delta_drop(&dropped, h);
+			continue;
+		}
+		if ((h->cmd == UCI_CMD_REMOVE) && !h->value) {
+			if (o) {
+				o->killed = true;
+				o->gen = s->gen;
+			} else {
+				s->killed = true;
+				s->seq = seq;
+			}
+		}
+	}
+
+	for (i = 0; i <= idx.mask; i++) {
+		struct uci_delta_key *k = &idx.keys[i];
+
+		k->gen = k->seq = 0;
+		k->killed = false;
+	}
+	seq = 0;
+
+	/* forwards: collapse repeated changes of the same key */
+	uci_foreach_element_safe(list, etmp, e) {
+		struct uci_delta *h = uci_to_delta(e);
+		struct uci_delta_key *s, *o = NULL, *t;
+		bool dup;
+
+		uci_delta_reserve(ctx, &idx);
+		s = uci_delta_key(&idx, h->section, NULL);
+		if (h->e.name)
+			o = uci_delta_key(&idx, h->section, h->e.name);
+		dup = uci_delta_dup(s, o);
+
+		if (dup && (h->cmd != UCI_CMD_RENAME) && (h->cmd != UCI_CMD_REORDER))
+			continue;
+
+		switch(h->cmd) {
+		case UCI_CMD_RENAME:
+			s->gen++;
+			s->last = s->reorder = NULL;
+			if (o)
+				break;
+			t = uci_delta_key(&idx, h->value, NULL);
+			t->gen++;
+			t->last = t->reorder = NULL;
+			break;
+		case UCI_CMD_REORDER:
+			if (s->reorder && (s->seq == seq))
+				uci_delta_drop(&dropped, s->reorder);
+			s->reorder = dup ? NULL : h;
+			s->seq = ++seq;
+			break;
+		case UCI_CMD_ADD:
+		case UCI_CMD_CHANGE:
+			if (!o) {
+				/* may create the section, which ends option runs */
+				s->gen++;
+				if (s->last) {
+					uci_list_del(&h->e.list);
+					uci_list_add(&s->last->e.list, &h->e.list);
+					if (s->last->cmd == UCI_CMD_ADD)
+						h->cmd = UCI_CMD_ADD;
+					uci_delta_drop(&dropped, s->last);
+				}
+				s->last = h;
+				break;
+			}
+			if (!o->last || (o->gen != s->gen)) {
+				o->prev = o->kill = NULL;
+				o->gen = s->gen;
+			} else if (!strcmp(o->last->value, h->value)) {
+				uci_delta_drop(&dropped, h);
+				break;
+			} else if (o->kill) {
+				uci_list_del(&o->kill->e.list);
+				uci_list_add(&h->e.list, &o->kill->e.list);
+				uci_delta_drop(&dropped, o->last);
+			} else if (o->prev) {
+				uci_add_delta(ctx, &h->e.list, UCI_CMD_REMOVE, h->section, h->e.name, NULL);
+				o->kill = uci_to_delta(list_to_element(h->e.list.prev));
+				uci_delta_drop(&dropped, o->prev);
+				uci_delta_drop(&dropped, o->last);
+				o->prev = NULL;
+				changes--;
+			} else {
+				o->prev = o->last;
+			}
+			o->last = h;
+			break;
+		case UCI_CMD_REMOVE:
+			if (!o) {
+				s->gen++;
+				s->last = s->reorder = NULL;
+				break;
+			}
+			/* fall through */
+		default:
+			if (o)
+				o->last = NULL;
+			break;
+		}
+	}
+
+	free(idx.keys);
+	uci_foreach_element_safe(&dropped, etmp, e) {
+		uci_free_delta(uci_to_delta(e));
+		changes++;
+	}
+	return changes;
+}
+
+/*
+ * mark the entries of a delta list that later ones make redundant, so that
+ * they don't need to be replayed:
+ *
+ * - sets of an option to the value the set before gave it
+ * - all but the last two of a run of sets of an option. as each set that
+ *   changes the value moves the option to the end, those two give it its
+ *   final value and position no matter what the option was before
+ * - the sets of a run that ends with the option getting deleted
+ *
+ * section level changes end the runs of their options and are always
+ * replayed, as every section that gets created counts for the generated
+ * names. lists with renames are left alone. returns the number of marked
+ * entries
+ */
+static int uci_delta_supersede(struct uci_context *ctx, struct uci_list *list)
+{
+	struct uci_delta_index idx;
+	struct uci_element *e;
+	unsigned int size, n = 0;
+	int marked = 0;
+
+	uci_foreach_element(list, e) {
+		if (uci_to_delta(e)->cmd == UCI_CMD_RENAME)
+			return 0;
+		n++;
+	}
+	if (n < 3)
+		return 0;
+
+	for (size = 16; (size < 4 * n) && (size < 256); size <<= 1);
+	idx.keys = uci_malloc(ctx, size * sizeof(struct uci_delta_key));
+	idx.mask = size - 1;
+	idx.used = 0;
+
+	uci_foreach_element(list, e) {
+		struct uci_delta *h = uci_to_delta(e);
+		struct uci_delta_key *s, *o;
+
+		uci_delta_reserve(ctx, &idx);
+		if (!e->name) {
+			uci_delta_key(&idx, h->section, NULL)->gen++;
+			continue;
+		}
+
+		o = uci_delta_key(&idx, h->section, e->name);
+		s = o->sec;
+		if ((h->cmd == UCI_CMD_REMOVE) && !h->value) {
+			/* the option is gone, whatever the sets before did */
+			if (o->last && !(o->last->e.flags & UCI_ELEMENT_SUPERSEDED)) {
+				o->last->e.flags |= UCI_ELEMENT_SUPERSEDED;
+				marked++;
+			}
+			if (o->prev) {
+				o->prev->e.flags |= UCI_ELEMENT_SUPERSEDED;
+				marked++;
+			}
+			o->last = o->prev = NULL;
+			continue;
+		}
+
+		if (((h->cmd != UCI_CMD_ADD) && (h->cmd != UCI_CMD_CHANGE)) || !h->value[0]) {
+			o->last = o->prev = NULL;
+			continue;
+		}
+
+		if (!o->last || (o->gen != s->gen)) {
+			o->gen = s->gen;
+			o->prev = NULL;
+		} else if (!strcmp(o->last->value, h->value)) {
+			e->flags |= UCI_ELEMENT_SUPERSEDED;
+			marked++;
+			continue;
+		} else if (o->prev) {
+			o->prev->e.flags |= UCI_ELEMENT_SUPERSEDED;
+			marked++;
+			o->prev = o->last;
+		} else {
+			o->prev = o->last;
+		}
+		o->last = h;
+	}
+
+	free(idx.keys);
+	return marked;
+}
+
+/*
+ * apply the changes collected from all delta files in one go, leaving out
+ * the ones that later changes override. changes that fail are skipped like
+ * unparseable lines. the entries are moved to the saved_delta of the package
+ * if it keeps one. returns the number of changes that were applied or found
+ * to be redundant
+ */
+static int uci_replay_delta(struct uci_context *ctx, struct uci_package *p, struct uci_list *list, bool coalesce)
+{
+	struct uci_element *e, *tmp;
+	struct uci_ptr ptr;
+	volatile int changes = 0;
+
+	if (coalesce) {
+		changes = uci_delta_supersede(ctx, list);
+		UCI_STATS_ADD(ctx, delta_dropped, changes);
+	}
+
+	uci_foreach_element_safe(list, tmp, e) {
+		struct uci_delta *h = uci_to_delta(e);
+
+		if (e->flags & UCI_ELEMENT_SUPERSEDED) {
+			e->flags &= ~UCI_ELEMENT_SUPERSEDED;
+			goto next;
+		}
+
+		memset(&ptr, 0, sizeof(ptr));
+		ptr.package = p->e.name;
+		ptr.section = h->section;
+		ptr.option = e->name;
+		ptr.value = h->value;
+		ptr.target = e->name ? UCI_TYPE_OPTION : UCI_TYPE_SECTION;
+
+		UCI_TRAP_SAVE(ctx, next);
+		uci_apply_delta(ctx, h->cmd, &ptr);
+		UCI_TRAP_RESTORE(ctx);
+		changes++;
+next:
+		if (ctx->flags & UCI_FLAG_SAVED_DELTA) {
+			uci_list_del(&e->list);
+			uci_list_add(&p->saved_delta, &e->list);
+		} else {
+			uci_free_delta(h);
+		}
+	}
+
+	return changes;
+}
+
+/* returns the number of lines that were parsed */
+static int uci_load_delta_file(struct uci_context *ctx, struct uci_package *p, char *filename, struct uci_list *list)
 {
 	FILE *volatile stream = NULL;
 	volatile int changes = 0;
 
 	UCI_TRAP_SAVE(ctx, done);
-	stream = uci_open_stream(ctx, filename, NULL, SEEK_SET, flush, false);
+	stream = uci_open_stream(ctx, filename, NULL, SEEK_SET, false, false);
 	UCI_TRAP_RESTORE(ctx);
 
-	if (p)
-		changes = uci_parse_delta(ctx, stream, p);
+	changes = uci_parse_delta(ctx, stream, p, list);
 
 done:
-	if (f)
-		*f = stream;
-	else
-		uci_close_stream(stream);
+	uci_close_stream(stream);
 	return changes;
 }
 
-/* returns the number of changes that were successfully parsed */
-__private int uci_load_delta(struct uci_context *ctx, struct uci_package *p, bool flush)
+/*
+ * read the delta files of a package in delta_path order. returns the number
+ * of files that had changes in them
+ */
+static int uci_collect_delta(struct uci_context *ctx, struct uci_package *p, FILE *savedir, bool held, struct uci_list *list)
 {
 	struct uci_element *e;
 	char *filename = NULL;
-	FILE *volatile f = NULL;
-	volatile int changes = 0;
-
-	if (!p->has_delta)
-		return 0;
+	FILE *f;
+	int i = 0, n, layers = 0;
 
 	uci_foreach_element(&ctx->delta_path, e) {
-		if ((asprintf(&filename, "%s/%s", e->name, p->e.name) < 0) || !filename)
-			UCI_THROW(ctx, UCI_ERR_MEM);
+		/* the savedir is always the last one, failing to lock it is an error */
+		if (e->list.next == &ctx->delta_path) {
+			f = held ? savedir : uci_delta_open(ctx, p->e.name, false);
+			n = f ? uci_parse_delta(ctx, f, p, list) : 0;
+			if (!held)
+				uci_close_stream(f);
+		} else {
+			if ((asprintf(&filename, "%s/%s", e->name, p->e.name) < 0) || !filename)
+				UCI_THROW(ctx, UCI_ERR_MEM);
+			n = uci_load_delta_file(ctx, p, filename, list);
+			free(filename);
+		}
 
-		changes += uci_load_delta_file(ctx, p, filename, NULL, false);
-		free(filename);
+		UCI_STATS_ADD(ctx, delta_lines[i], n);
+		if (i < UCI_STATS_DELTA_PATHS - 1)
+			i++;
+		if (n > 0)
+			layers++;
 	}
 
-	if ((asprintf(&filename, "%s/%s", ctx->savedir, p->e.name) < 0) || !filename)
-		UCI_THROW(ctx, UCI_ERR_MEM);
-	uci_load_delta_file(ctx, NULL, filename, &f, flush);
+	return layers;
+}
 
-	if (flush && f && (changes > 0)) {
-		if (ftruncate(fileno(f), 0) < 0) {
-			free(filename);
-			uci_close_stream(f);
-			UCI_THROW(ctx, UCI_ERR_IO);
-		}
-	}
+/*
+ * returns the number of changes that were applied. if held is set, the
+ * caller has the savedir delta file opened already as savedir, which is
+ * NULL if there is none. readers lock it, commits hold the config lock
+ */
+__private int uci_load_delta(struct uci_context *ctx, struct uci_package *p, FILE *savedir, bool held)
+{
+	struct uci_element *e, *tmp;
+	struct uci_list list;
+	volatile int changes;
+	int layers;
+
+	if (!p->has_delta)
+		return 0;
+
+	p->has_saved_delta = !!(ctx->flags & UCI_FLAG_SAVED_DELTA);
+	uci_list_init(&list);
+	UCI_TRAP_SAVE(ctx, error);
+	/*
+	 * replaying a set costs about as much as finding out that a later one
+	 * overrides it, so only bother when layers are stacked up
+	 */
+	layers = uci_collect_delta(ctx, p, savedir, held, &list);
+	changes = uci_replay_delta(ctx, p, &list, layers > 1);
+	UCI_TRAP_RESTORE(ctx);
 
-	free(filename);
-	uci_close_stream(f);
 	ctx->err = 0;
 	return changes;
+
+error:
+	uci_foreach_element_safe(&list, tmp, e)
+		uci_free_delta(uci_to_delta(e));
+	UCI_THROW(ctx, ctx->err);
+	return 0;
 }
 
-static void uci_filter_delta(struct uci_context *ctx, const char *name, const char *section, const char *option)
+/*
+ * drop the entries matching section and option from the savedir delta
+ * file of a package, or just compact it if filter is false.
+ * the file is only rewritten if needed: entries matching at the end of
+ * the file are cut off by truncating it
+ */
+static inline bool uci_delta_compact_due(long from, long to)
+{
+	/* true if a power of two lies in (from, to] */
+	if (to <= 0)
+		return false;
+	while (to & (to - 1))
+		to &= to - 1;
+	return to > from;
+}
+
+static void uci_rewrite_delta(struct uci_context *ctx, FILE *f, const char *name, const char *section, const char *option, bool filter)
 {
 	struct uci_parse_context *pctx;
 	struct uci_element *e, *tmp;
+	struct uci_buf buf = { 0 };
 	struct uci_list list;
-	char *filename = NULL;
 	struct uci_ptr ptr;
-	FILE *f = NULL;
+	volatile long trunc = -1;
+	volatile bool rewrite = false;
+	int changes;
 
 	uci_list_init(&list);
 	uci_alloc_parse_context(ctx);
 	pctx = ctx->pctx;
-
-	if ((asprintf(&filename, "%s/%s", ctx->savedir, name) < 0) || !filename)
-		UCI_THROW(ctx, UCI_ERR_MEM);
+	pctx->file = f;
 
 	UCI_TRAP_SAVE(ctx, done);
-	f = uci_open_stream(ctx, filename, NULL, SEEK_SET, true, false);
-	pctx->file = f;
+	rewind(f);
 	while (!feof(f)) {
 		enum uci_command c;
-		bool match;
+		long pos = ftell(f);
+		bool match = filter;
 
 		pctx->pos = 0;
 		uci_getln(ctx, 0);
@@ -379,7 +872,6 @@ static void uci_filter_delta(struct uci_context *ctx, const char *name, const ch
 			continue;
 
 		c = uci_parse_delta_tuple(ctx, &ptr);
-		match = true;
 		if (section) {
 			if (!ptr.section || (strcmp(section, ptr.section) != 0))
 				match = false;
@@ -389,40 +881,70 @@ static void uci_filter_delta(struct uci_context *ctx, const char *name, const ch
 				match = false;
 		}
 
-		if (!match && ptr.section) {
-			uci_add_delta(ctx, &list, c,
-				ptr.section, ptr.option, ptr.value);
+		if (match) {
+			if (trunc < 0)
+				trunc = pos;
+			continue;
 		}
+
+		if (trunc >= 0)
+			rewrite = true;
+		trunc = -1;
+		uci_add_delta(ctx, &list, c, ptr.section, ptr.option, ptr.value);
+	}
+
+	changes = uci_compact_delta(ctx, &list);
+	if (!rewrite && !changes) {
+		if ((trunc >= 0) && (ftruncate(fileno(f), trunc) < 0))
+			UCI_THROW(ctx, UCI_ERR_IO);
+		goto out;
 	}
 
 	/* rebuild the delta file */
+	uci_foreach_element(&list, e)
+		uci_delta_save(ctx, &buf, name, uci_to_delta(e));
 	rewind(f);
-	if (ftruncate(fileno(f), 0) < 0)
+	if ((ftruncate(fileno(f), 0) < 0) || !uci_buf_write(fileno(f), &buf))
 		UCI_THROW(ctx, UCI_ERR_IO);
-	uci_foreach_element_safe(&list, tmp, e) {
-		struct uci_delta *h = uci_to_delta(e);
-		uci_delta_save(ctx, f, name, h);
-		uci_free_delta(h);
-	}
+out:
 	UCI_TRAP_RESTORE(ctx);
 
 done:
-	free(filename);
-	uci_close_stream(pctx->file);
+	free(buf.data);
 	uci_foreach_element_safe(&list, tmp, e) {
 		uci_free_delta(uci_to_delta(e));
 	}
 	uci_cleanup(ctx);
 }
 
+static void uci_filter_delta(struct uci_context *ctx, const char *name, const char *section, const char *option)
+{
+	char *filename = NULL;
+	FILE *volatile f = NULL;
+
+	if ((asprintf(&filename, "%s/%s", ctx->savedir, name) < 0) || !filename)
+		UCI_THROW(ctx, UCI_ERR_MEM);
+
+	UCI_TRAP_SAVE(ctx, done);
+	f = uci_open_stream(ctx, filename, NULL, SEEK_SET, true, false);
+	uci_rewrite_delta(ctx, f, name, section, option, true);
+	UCI_TRAP_RESTORE(ctx);
+
+done:
+	free(filename);
+	uci_close_stream(f);
+}
+
 int uci_revert(struct uci_context *ctx, struct uci_ptr *ptr)
 {
 	char *volatile package = NULL;
 	char *volatile section = NULL;
 	char *volatile option = NULL;
+	int lock;
 
 	UCI_HANDLE_ERR(ctx);
 	uci_expand_ptr(ctx, ptr, false);
+	UCI_ASSERT_WRITABLE(ctx, ptr->p);
 	UCI_ASSERT(ctx, ptr->p->has_delta);
 
 	/*
@@ -432,8 +954,9 @@ int uci_revert(struct uci_context *ctx, struct uci_ptr *ptr)
 	 * - filter the delta
 	 * - reload the package
 	 */
+	lock = uci_lock_config(ctx, ptr->p->path);
 	UCI_TRAP_SAVE(ctx, error);
-	UCI_INTERNAL(uci_save, ctx, ptr->p);
+	uci_save_delta(ctx, ptr->p);
 
 	/* NB: need to clone package, section and option names,
 	 * as they may get freed on uci_free_package() */
@@ -443,6 +966,7 @@ int uci_revert(struct uci_context *ctx, struct uci_ptr *ptr)
 	if (ptr->option)
 		option = uci_strdup(ctx, ptr->option);
 
+	uci_snapshot_invalidate(ctx, ptr->p);
 	uci_free_package(&ptr->p);
 	uci_filter_delta(ctx, package, section, option);
 
@@ -451,6 +975,8 @@ int uci_revert(struct uci_context *ctx, struct uci_ptr *ptr)
 	ctx->err = 0;
 
 error:
+	if (lock >= 0)
+		close(lock);
 	free(package);
 	free(section);
 	free(option);
@@ -459,27 +985,77 @@ error:
 	return 0;
 }
 
-int uci_save(struct uci_context *ctx, struct uci_package *p)
+/*
+ * true if the savedir delta file is still in the state the package was
+ * loaded from, so that appending our own changes keeps it up to date
+ */
+static bool uci_delta_fresh(struct uci_package *p, int fd)
+{
+	struct uci_stamp *old, cur;
+
+	if (!p->n_stamps)
+		return false;
+
+	old = &p->stamps[p->n_stamps - 1];
+	uci_stamp_fd(fd, &cur);
+	if (!old->ino)
+		return !cur.size;
+
+	return !memcmp(old, &cur, sizeof(cur));
+}
+
+/*
+ * open the savedir delta file of a package. readers lock it shared while
+ * they read the config and replay the deltas. commits open it for writing
+ * without a lock, the config file lock already keeps other writers out.
+ * they lock it exclusively only to replace the config and flush the delta,
+ * so that readers never see one without the other.
+ * returns NULL if the file can't be opened
+ */
+__private FILE *uci_delta_open(struct uci_context *ctx, const char *name, bool write)
+{
+	char *filename = NULL;
+	FILE *f;
+	int fd;
+
+	if ((asprintf(&filename, "%s/%s", ctx->savedir, name) < 0) || !filename)
+		UCI_THROW(ctx, UCI_ERR_MEM);
+
+	fd = open(filename, (write ? O_RDWR : O_RDONLY));
+	free(filename);
+	if (fd < 0)
+		return NULL;
+
+	if (!write && (uci_flock(ctx, fd, LOCK_SH) < 0) && (errno != ENOSYS)) {
+		close(fd);
+		UCI_THROW(ctx, UCI_ERR_IO);
+	}
+
+	f = fdopen(fd, (write ? "r+" : "r"));
+	if (!f) {
+		close(fd);
+		UCI_THROW(ctx, UCI_ERR_IO);
+	}
+	return f;
+}
+
+/*
+ * append the unsaved changes of a package to its savedir delta. the caller
+ * holds the config file lock, so that no commit is in the middle of
+ * consuming the delta
+ */
+__private void uci_save_delta(struct uci_context *ctx, struct uci_package *p)
 {
 	FILE *volatile f = NULL;
 	char *filename = NULL;
 	struct uci_element *e, *tmp;
+	struct uci_buf buf = { 0 };
 	struct stat statbuf;
-
-	UCI_HANDLE_ERR(ctx);
-	UCI_ASSERT(ctx, p != NULL);
-
-	/*
-	 * if the config file was outside of the /etc/config path,
-	 * don't save the delta to a file, update the real file
-	 * directly.
-	 * does not modify the uci_package pointer
-	 */
-	if (!p->has_delta)
-		return uci_commit(ctx, &p, false);
+	volatile bool fresh;
+	off_t start;
 
 	if (uci_list_empty(&p->delta))
-		return 0;
+		return;
 
 	if (stat(ctx->savedir, &statbuf) < 0) {
 		if (stat(ctx->confdir, &statbuf) == 0) {
@@ -496,18 +1072,88 @@ int uci_save(struct uci_context *ctx, struct uci_package *p)
 
 	ctx->err = 0;
 	UCI_TRAP_SAVE(ctx, done);
+	/* serialize all changes before taking the lock, they get written at once */
+	uci_foreach_element(&p->delta, e)
+		uci_delta_save(ctx, &buf, p->e.name, uci_to_delta(e));
 	f = uci_open_stream(ctx, filename, NULL, SEEK_END, true, true);
 	UCI_TRAP_RESTORE(ctx);
 
+	fresh = uci_delta_fresh(p, fileno(f));
+	start = lseek(fileno(f), 0, SEEK_CUR);
+	if ((start < 0) || !uci_buf_write(fileno(f), &buf)) {
+		/*
+		 * cut off a partial write, the changes stay in memory. if that
+		 * fails, the file no longer matches the package
+		 */
+		if ((start >= 0) && (ftruncate(fileno(f), start) < 0))
+			p->n_stamps = 0;
+		ctx->err = UCI_ERR_IO;
+		goto done;
+	}
+
+	/* the changes are now part of the delta file the package was loaded with */
 	uci_foreach_element_safe(&p->delta, tmp, e) {
-		struct uci_delta *h = uci_to_delta(e);
-		uci_delta_save(ctx, f, p->e.name, h);
-		uci_free_delta(h);
+		if (ctx->flags & UCI_FLAG_SAVED_DELTA) {
+			uci_list_del(&e->list);
+			uci_list_add(&p->saved_delta, &e->list);
+		} else {
+			uci_free_delta(uci_to_delta(e));
+			p->has_saved_delta = false;
+		}
+	}
+	uci_snapshot_invalidate(ctx, p);
+
+	/*
+	 * compact the file whenever it grows past UCI_DELTA_COMPACT
+	 * times a power of two, errors only leave it uncompacted
+	 */
+	if (uci_delta_compact_due(start / UCI_DELTA_COMPACT,
+	    (start + buf.len) / UCI_DELTA_COMPACT)) {
+		UCI_TRAP_SAVE(ctx, compacted);
+		uci_rewrite_delta(ctx, f, p->e.name, NULL, NULL, false);
+		UCI_TRAP_RESTORE(ctx);
+compacted:
+		ctx->err = 0;
 	}
 
+	if (fresh)
+		uci_stamp_fd(fileno(f), &p->stamps[p->n_stamps - 1]);
+
 done:
 	uci_close_stream(f);
 	free(filename);
+	free(buf.data);
+	if (ctx->err)
+		UCI_THROW(ctx, ctx->err);
+}
+
+int uci_save(struct uci_context *ctx, struct uci_package *p)
+{
+	int lock;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, p != NULL);
+
+	/*
+	 * if the config file was outside of the /etc/config path,
+	 * don't save the delta to a file, update the real file
+	 * directly.
+	 * does not modify the uci_package pointer
+	 */
+	if (!p->has_delta)
+		return uci_commit(ctx, &p, false);
+
+	if (uci_list_empty(&p->delta))
+		return 0;
+
+	lock = uci_lock_config(ctx, p->path);
+	UCI_TRAP_SAVE(ctx, done);
+	uci_save_delta(ctx, p);
+	UCI_TRAP_RESTORE(ctx);
+
+done:
+	if (lock >= 0)
+		close(lock);
 	if (ctx->err)
 		UCI_THROW(ctx, ctx->err);
 
@@ -0,0 +1,196 @@
+/*
+ * libuci - Library for the Unified Configuration Interface
+ * Copyright (C) 2008 Felix Fietkau <nbd@openwrt.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/*
+ * Comparing two versions of a package, so that daemons can apply just the
+ * sections and options that changed on reload.
+ *
+ * Both sides are matched up through the name indexes of the section and
+ * option lists, so a diff takes a lookup per element. Sections that did
+ * not change usually still list their options in the same order, those
+ * are compared in one pass without any lookups.
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "uci.h"
+#include "uci_internal.h"
+
+static void uci_diff_add(struct uci_context *ctx, struct uci_list *list, enum uci_diff_type type,
+			 const char *section, const char *option, struct uci_element *target)
+{
+	struct uci_diff *d;
+
+	d = uci_alloc_element(ctx, diff, option, strlen(section) + 1);
+	d->type = type;
+	d->section = strcpy(uci_dataptr(d), section);
+	d->target = target;
+	uci_list_add(list, &d->e.list);
+}
+
+static bool uci_diff_equal(struct uci_option *a, struct uci_option *b)
+{
+	struct uci_element *ea, *eb;
+
+	if (a->type != b->type)
+		return false;
+
+	if (a->type == UCI_TYPE_STRING)
+		return !strcmp(a->v.string, b->v.string);
+
+	for (ea = list_to_element(a->v.list.next), eb = list_to_element(b->v.list.next);
+	     (&ea->list != &a->v.list) && (&eb->list != &b->v.list);
+	     ea = list_to_element(ea->list.next), eb = list_to_element(eb->list.next)) {
+		if (strcmp(ea->name, eb->name) != 0)
+			return false;
+	}
+
+	return (&ea->list == &a->v.list) && (&eb->list == &b->v.list);
+}
+
+/* true if both sections have the same options in the same order */
+static bool uci_diff_same(struct uci_section *a, struct uci_section *b)
+{
+	struct uci_element *ea, *eb;
+
+	for (ea = list_to_element(a->options.next), eb = list_to_element(b->options.next);
+	     (&ea->list != &a->options) && (&eb->list != &b->options);
+	     ea = list_to_element(ea->list.next), eb = list_to_element(eb->list.next)) {
+		if (strcmp(ea->name, eb->name) != 0)
+			return false;
+		if (!uci_diff_equal(uci_to_option(ea), uci_to_option(eb)))
+			return false;
+	}
+
+	return (&ea->list == &a->options) && (&eb->list == &b->options);
+}
+
+static void uci_diff_section(struct uci_context *ctx, struct uci_list *list,
+			     struct uci_section *a, struct uci_section *b)
+{
+	struct uci_element *e, *o;
+
+	if (strcmp(a->type, b->type) != 0)
+		uci_diff_add(ctx, list, UCI_DIFF_CHANGE, b->e.name, NULL, &b->e);
+
+	if (uci_diff_same(a, b))
+		return;
+
+	uci_foreach_element(&a->options, e) {
+		if (!uci_lookup_list(&b->options, e->name))
+			uci_diff_add(ctx, list, UCI_DIFF_REMOVE, a->e.name, e->name, NULL);
+	}
+
+	uci_foreach_element(&b->options, e) {
+		o = uci_lookup_list(&a->options, e->name);
+		if (!o)
+			uci_diff_add(ctx, list, UCI_DIFF_ADD, b->e.name, e->name, e);
+		else if (!uci_diff_equal(uci_to_option(o), uci_to_option(e)))
+			uci_diff_add(ctx, list, UCI_DIFF_CHANGE, b->e.name, e->name, e);
+	}
+}
+
+static void uci_diff_sections(struct uci_context *ctx, struct uci_list *list,
+			      struct uci_list *a, struct uci_list *b)
+{
+	struct uci_element *e, *s;
+
+	uci_foreach_element(a, e) {
+		if (!uci_lookup_list(b, e->name))
+			uci_diff_add(ctx, list, UCI_DIFF_REMOVE, e->name, NULL, NULL);
+	}
+
+	uci_foreach_element(b, e) {
+		s = uci_lookup_list(a, e->name);
+		if (!s)
+			uci_diff_add(ctx, list, UCI_DIFF_ADD, e->name, NULL, e);
+		else
+			uci_diff_section(ctx, list, uci_to_section(s), uci_to_section(e));
+	}
+}
+
+int uci_diff(struct uci_context *ctx, struct uci_package *a, struct uci_package *b, struct uci_list *list)
+{
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, list != NULL);
+	uci_list_init(list);
+	UCI_ASSERT(ctx, a != NULL);
+	UCI_ASSERT(ctx, b != NULL);
+
+	uci_diff_sections(ctx, list, &a->sections, &b->sections);
+
+	return 0;
+}
+
+/* open the config file of a package, NULL if it does not exist (yet) */
+static FILE *uci_diff_open(struct uci_context *ctx, const char *path)
+{
+	FILE *volatile f = NULL;
+
+	UCI_TRAP_SAVE(ctx, error);
+	f = uci_open_config(ctx, path);
+	UCI_TRAP_RESTORE(ctx);
+	return f;
+
+error:
+	if (ctx->err != UCI_ERR_NOTFOUND)
+		UCI_THROW(ctx, ctx->err);
+	ctx->err = 0;
+	return NULL;
+}
+
+int uci_diff_delta(struct uci_context *ctx, struct uci_package *p, struct uci_list *list)
+{
+	struct uci_context *wctx;
+	struct uci_package *base = NULL;
+	FILE *volatile f = NULL;
+	struct uci_list empty;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, list != NULL);
+	uci_list_init(list);
+	UCI_ASSERT(ctx, p != NULL);
+	UCI_ASSERT(ctx, p->path != NULL);
+
+	/* ctx may hold the package already, so its config is parsed on the side */
+	wctx = uci_clone_context(ctx);
+	wctx->flags &= ~UCI_FLAG_STATS;
+	uci_list_init(&empty);
+
+	UCI_TRAP_SAVE(ctx, done);
+	f = uci_diff_open(ctx, p->path);
+	if (f && (uci_import(wctx, f, p->e.name, &base, true) != UCI_OK))
+		UCI_THROW(ctx, wctx->err);
+	uci_diff_sections(ctx, list, (base ? &base->sections : &empty), &p->sections);
+	UCI_TRAP_RESTORE(ctx);
+
+done:
+	uci_close_stream(f);
+	uci_free_context(wctx);
+	if (ctx->err)
+		UCI_THROW(ctx, ctx->err);
+	return 0;
+}
+
+void uci_free_diff(struct uci_list *list)
+{
+	struct uci_element *e, *tmp;
+
+	uci_foreach_element_safe(list, tmp, e)
+		uci_free_element(e);
+}
@@ -20,11 +20,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
-#include <ctype.h>
 #include <glob.h>
 #include <string.h>
 #include <stdlib.h>
@@ -35,6 +35,99 @@
 
 #define LINEBUF	32
 
+/*
+ * Map the input file of the parser context, so that lines can be parsed
+ * in place. The mapping is private, the null bytes written by the
+ * tokenizer never reach the file. Falls back to stdio if the stream
+ * can't be mapped or holds null bytes.
+ */
+static void uci_map_stream(struct uci_parse_context *pctx)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	size_t size;
+	char *map;
+	int fd;
+
+	fd = fileno(pctx->file);
+	if ((fd < 0) || fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    (st.st_size <= 0) || (ftello(pctx->file) != 0))
+		return;
+
+	/*
+	 * reserve at least one byte after the end of the file, so that the
+	 * last line can always be null terminated. if the file ends at a
+	 * page boundary, that byte comes from the anonymous mapping
+	 */
+	size = (st.st_size + page) & ~(page - 1);
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return;
+
+	/*
+	 * fgets stops at a null byte and reads the rest of the line as the
+	 * next one. lines are split at newlines only here, so such files go
+	 * through stdio to parse the same either way
+	 */
+	if ((mmap(map, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) ||
+	    memchr(map, 0, st.st_size)) {
+		munmap(map, size);
+		return;
+	}
+
+	pctx->map = map;
+	pctx->map_len = st.st_size;
+	pctx->map_size = size;
+	pctx->map_ofs = 0;
+	pctx->map_save = -1;
+}
+
+/*
+ * Fetch a new line from the mapped file. A new line is parsed in place,
+ * continuation lines are appended at offset. The byte after the line is
+ * replaced by a null byte and restored when fetching the next line.
+ */
+static void uci_getln_map(struct uci_context *ctx, size_t offset)
+{
+	struct uci_parse_context *pctx = ctx->pctx;
+	char *start, *end;
+	size_t len;
+
+	if (pctx->map_save >= 0) {
+		pctx->map[pctx->map_ofs] = pctx->map_save;
+		pctx->map_save = -1;
+	}
+
+	start = &pctx->map[pctx->map_ofs];
+	if (!offset)
+		pctx->buf = start;
+
+	if (pctx->map_ofs >= pctx->map_len) {
+		pctx->buf[offset] = 0;
+		return;
+	}
+
+	len = pctx->map_len - pctx->map_ofs;
+	end = memchr(start, '\n', len);
+	if (end)
+		len = end - start + 1;
+
+	if (&pctx->buf[offset] != start)
+		memmove(&pctx->buf[offset], start, len);
+
+	pctx->map_ofs += len;
+	pctx->buf_filled = offset + len;
+	end = &pctx->buf[pctx->buf_filled];
+	if ((end == &pctx->map[pctx->map_ofs]) && (pctx->map_ofs < pctx->map_len))
+		pctx->map_save = (unsigned char) *end;
+	*end = 0;
+
+	UCI_STATS_ADD(ctx, parse_bytes, len);
+	UCI_STATS_ADD(ctx, parse_lines, 1);
+	if (pctx->buf[pctx->buf_filled - 1] == '\n')
+		pctx->line++;
+}
+
 /*
  * Fetch a new line from the input stream and resize buffer if necessary
  */
@@ -44,6 +137,11 @@ __private void uci_getln(struct uci_context *ctx, size_t offset)
 	char *p;
 	size_t ofs;
 
+	if (pctx->map) {
+		uci_getln_map(ctx, offset);
+		return;
+	}
+
 	if (pctx->buf == NULL) {
 		pctx->buf = uci_malloc(ctx, LINEBUF);
 		pctx->bufsz = LINEBUF;
@@ -61,18 +159,23 @@ __private void uci_getln(struct uci_context *ctx, size_t offset)
 
 		p = fgets(p, pctx->bufsz - ofs, pctx->file);
 		if (!p || !*p)
-			return;
+			break;
 
 		ofs += strlen(p);
 		pctx->buf_filled = ofs;
 		if (pctx->buf[ofs - 1] == '\n') {
 			pctx->line++;
-			return;
+			break;
 		}
 
 		pctx->bufsz *= 2;
 		pctx->buf = uci_realloc(ctx, pctx->buf, pctx->bufsz);
 	} while (1);
+
+	if (ofs > offset) {
+		UCI_STATS_ADD(ctx, parse_bytes, ofs - offset);
+		UCI_STATS_ADD(ctx, parse_lines, 1);
+	}
 }
 
 /*
@@ -109,7 +212,7 @@ static void skip_whitespace(struct uci_context *ctx)
 {
 	struct uci_parse_context *pctx = ctx->pctx;
 
-	while (pctx_cur_char(pctx) && isspace(pctx_cur_char(pctx)))
+	while (uci_ctype_is(pctx_cur_char(pctx), UCI_CT_SPACE))
 		pctx->pos += 1;
 }
 
@@ -122,6 +225,27 @@ static inline void addc(struct uci_context *ctx, size_t *pos_dest, size_t *pos_s
 	*pos_src += 1;
 }
 
+/*
+ * copy the run of characters up to the next one of the given class
+ * in one go instead of byte by byte, returns the length of the run
+ */
+static size_t addspan(struct uci_context *ctx, size_t *pos_dest, size_t *pos_src, unsigned char class)
+{
+	struct uci_parse_context *pctx = ctx->pctx;
+	const char *str = pctx_str(pctx, *pos_src);
+	size_t len = 0;
+
+	while (!uci_ctype_is(str[len], class))
+		len++;
+
+	if (len && *pos_dest != *pos_src)
+		memmove(pctx_str(pctx, *pos_dest), str, len);
+	*pos_dest += len;
+	*pos_src += len;
+
+	return len;
+}
+
 static int uci_increase_pos(struct uci_parse_context *pctx, size_t add)
 {
 	if (pctx->pos + add > pctx->buf_filled)
@@ -143,6 +267,7 @@ static void parse_double_quote(struct uci_context *ctx, size_t *target)
 	pctx->pos += 1;
 
 	while (1) {
+		addspan(ctx, target, &pctx->pos, UCI_CT_DQUOTE);
 		c = pctx_cur_char(pctx);
 		switch(c) {
 		case '"':
@@ -177,6 +302,7 @@ static void parse_single_quote(struct uci_context *ctx, size_t *target)
 	pctx->pos += 1;
 
 	while (1) {
+		addspan(ctx, target, &pctx->pos, UCI_CT_SQUOTE);
 		c = pctx_cur_char(pctx);
 		switch(c) {
 		case '\'':
@@ -202,7 +328,10 @@ static void parse_str(struct uci_context *ctx, size_t *target)
 {
 	struct uci_parse_context *pctx = ctx->pctx;
 	bool next = true;
+	size_t len;
+
 	do {
+		len = addspan(ctx, target, &pctx->pos, UCI_CT_WORD);
 		switch(pctx_cur_char(pctx)) {
 		case '\'':
 			parse_single_quote(ctx, target);
@@ -221,12 +350,15 @@ static void parse_str(struct uci_context *ctx, size_t *target)
 		case '\\':
 			if (!parse_backslash(ctx))
 				continue;
-			/* fall through */
-		default:
 			addc(ctx, target, &pctx->pos);
 			break;
+		default:
+			/* whitespace, only copied if the string starts with it */
+			if (!len)
+				addc(ctx, target, &pctx->pos);
+			break;
 		}
-	} while (pctx_cur_char(pctx) && !isspace(pctx_cur_char(pctx)));
+	} while (pctx_cur_char(pctx) && !uci_ctype_is(pctx_cur_char(pctx), UCI_CT_SPACE));
 done:
 
 	/*
@@ -383,6 +515,13 @@ static void uci_switch_config(struct uci_context *ctx)
 	if (e)
 		UCI_THROW(ctx, UCI_ERR_DUPLICATE);
 	pctx->package = uci_alloc_package(ctx, name);
+
+	/* strings parsed from the mapped file are referenced by the package */
+	if (pctx->map && pctx->map_size) {
+		pctx->package->map = pctx->map;
+		pctx->package->map_size = pctx->map_size;
+		pctx->map_size = 0;
+	}
 }
 
 /*
@@ -554,116 +693,106 @@ invalid:
 	} while (1);
 }
 
-/* max number of characters that escaping adds to the string */
-#define UCI_QUOTE_ESCAPE	"'\\''"
+/* amount of buffered export output that is passed on to the stream at once */
+#define UCI_EXPORT_FLUSH	(64 * 1024)
 
-/*
- * escape an uci string for export
- */
-static const char *uci_escape(struct uci_context *ctx, const char *str)
+static void uci_export_str(struct uci_context *ctx, struct uci_buf *buf, const char *str)
 {
-	const char *end;
-	int ofs = 0;
-
-	if (!ctx->buf) {
-		ctx->bufsz = LINEBUF;
-		ctx->buf = malloc(LINEBUF);
-
-		if (!ctx->buf)
-			return str;
-	}
-
-	while (1) {
-		int len;
-
-		end = strchr(str, '\'');
-		if (!end)
-			end = str + strlen(str);
-		len = end - str;
-
-		/* make sure that we have enough room in the buffer */
-		while (ofs + len + (int) sizeof(UCI_QUOTE_ESCAPE) + 1 > ctx->bufsz) {
-			ctx->bufsz *= 2;
-			ctx->buf = uci_realloc(ctx, ctx->buf, ctx->bufsz);
-		}
-
-		/* copy the string until the character before the quote */
-		memcpy(&ctx->buf[ofs], str, len);
-		ofs += len;
-
-		/* end of string? return the buffer */
-		if (*end == 0)
-			break;
-
-		memcpy(&ctx->buf[ofs], UCI_QUOTE_ESCAPE, sizeof(UCI_QUOTE_ESCAPE));
-		ofs += strlen(&ctx->buf[ofs]);
-		str = end + 1;
-	}
+	uci_buf_put(ctx, buf, str, strlen(str));
+}
 
-	ctx->buf[ofs] = 0;
-	return ctx->buf;
+static void uci_export_line(struct uci_context *ctx, struct uci_buf *buf,
+			    const char *keyword, const char *name, const char *value)
+{
+	uci_export_str(ctx, buf, keyword);
+	uci_buf_put_escaped(ctx, buf, name);
+	uci_buf_put(ctx, buf, " '", 2);
+	uci_buf_put_escaped(ctx, buf, value);
+	uci_buf_put(ctx, buf, "'\n", 2);
 }
 
 /*
- * export a single config package to a file stream
+ * export a single config package into the output buffer
  */
-static void uci_export_package(struct uci_package *p, FILE *stream, bool header)
+static void uci_export_package(struct uci_context *ctx, struct uci_package *p,
+			       struct uci_buf *buf, FILE *stream, bool header)
 {
-	struct uci_context *ctx = p->ctx;
 	struct uci_element *s, *o, *i;
 
-	if (header)
-		fprintf(stream, "package %s\n", uci_escape(ctx, p->e.name));
+	if (header) {
+		uci_export_str(ctx, buf, "package ");
+		uci_buf_put_escaped(ctx, buf, p->e.name);
+		uci_buf_putc(ctx, buf, '\n');
+	}
 	uci_foreach_element(&p->sections, s) {
 		struct uci_section *sec = uci_to_section(s);
-		fprintf(stream, "\nconfig %s", uci_escape(ctx, sec->type));
-		if (!sec->anonymous || (ctx->flags & UCI_FLAG_EXPORT_NAME))
-			fprintf(stream, " '%s'", uci_escape(ctx, sec->e.name));
-		fprintf(stream, "\n");
+
+		uci_export_str(ctx, buf, "\nconfig ");
+		uci_buf_put_escaped(ctx, buf, sec->type);
+		if (!sec->anonymous || (ctx->flags & UCI_FLAG_EXPORT_NAME)) {
+			uci_buf_put(ctx, buf, " '", 2);
+			uci_buf_put_escaped(ctx, buf, sec->e.name);
+			uci_buf_putc(ctx, buf, '\'');
+		}
+		uci_buf_putc(ctx, buf, '\n');
 		uci_foreach_element(&sec->options, o) {
 			struct uci_option *opt = uci_to_option(o);
 			switch(opt->type) {
 			case UCI_TYPE_STRING:
-				fprintf(stream, "\toption %s", uci_escape(ctx, opt->e.name));
-				fprintf(stream, " '%s'\n", uci_escape(ctx, opt->v.string));
+				uci_export_line(ctx, buf, "\toption ", opt->e.name, opt->v.string);
 				break;
 			case UCI_TYPE_LIST:
-				uci_foreach_element(&opt->v.list, i) {
-					fprintf(stream, "\tlist %s", uci_escape(ctx, opt->e.name));
-					fprintf(stream, " '%s'\n", uci_escape(ctx, i->name));
-				}
+				uci_foreach_element(&opt->v.list, i)
+					uci_export_line(ctx, buf, "\tlist ", opt->e.name, i->name);
 				break;
 			default:
-				fprintf(stream, "\t# unknown type for option '%s'\n", uci_escape(ctx, opt->e.name));
+				uci_export_str(ctx, buf, "\t# unknown type for option '");
+				uci_buf_put_escaped(ctx, buf, opt->e.name);
+				uci_buf_put(ctx, buf, "'\n", 2);
 				break;
 			}
 		}
+
+		if ((buf->len >= UCI_EXPORT_FLUSH) && !uci_buf_flush(stream, buf))
+			UCI_THROW(ctx, UCI_ERR_IO);
 	}
-	fprintf(stream, "\n");
+	uci_buf_putc(ctx, buf, '\n');
 }
 
 int uci_export(struct uci_context *ctx, FILE *stream, struct uci_package *package, bool header)
 {
+	struct uci_buf buf = { 0 };
 	struct uci_element *e;
 
 	UCI_HANDLE_ERR(ctx);
 	UCI_ASSERT(ctx, stream != NULL);
 
+	/* the output is collected in large blocks and written past stdio */
+	UCI_TRAP_SAVE(ctx, error);
 	if (package)
-		uci_export_package(package, stream, header);
+		uci_export_package(ctx, package, &buf, stream, header);
 	else {
 		uci_foreach_element(&ctx->root, e) {
-			uci_export_package(uci_to_package(e), stream, header);
+			uci_export_package(ctx, uci_to_package(e), &buf, stream, header);
 		}
 	}
+	if (!uci_buf_flush(stream, &buf))
+		UCI_THROW(ctx, UCI_ERR_IO);
+	UCI_TRAP_RESTORE(ctx);
+	free(buf.data);
+	return 0;
 
+error:
+	free(buf.data);
+	UCI_THROW(ctx, ctx->err);
 	return 0;
 }
 
-int uci_import(struct uci_context *ctx, FILE *stream, const char *name, struct uci_package **package, bool single)
+/* returns the number of parse errors that were skipped */
+static int uci_import_stream(struct uci_context *ctx, FILE *stream, const char *name, struct uci_package **package, bool single, bool map)
 {
 	struct uci_parse_context *pctx;
-	UCI_HANDLE_ERR(ctx);
+	volatile int errors = 0;
 
 	/* make sure no memory from previous parse attempts is leaked */
 	uci_cleanup(ctx);
@@ -674,6 +803,8 @@ int uci_import(struct uci_context *ctx, FILE *stream, const char *name, struct u
 	if (package && *package && single) {
 		pctx->package = *package;
 		pctx->merge = true;
+	} else if (map) {
+		uci_map_stream(pctx);
 	}
 
 	/*
@@ -686,7 +817,7 @@ int uci_import(struct uci_context *ctx, FILE *stream, const char *name, struct u
 		pctx->name = name;
 	}
 
-	while (!feof(pctx->file)) {
+	while (pctx->map ? (pctx->map_ofs < pctx->map_len) : !feof(pctx->file)) {
 		pctx->pos = 0;
 		uci_getln(ctx, 0);
 		UCI_TRAP_SAVE(ctx, error);
@@ -695,6 +826,7 @@ int uci_import(struct uci_context *ctx, FILE *stream, const char *name, struct u
 		UCI_TRAP_RESTORE(ctx);
 		continue;
 error:
+		errors++;
 		if (ctx->flags & UCI_FLAG_PERROR)
 			uci_perror(ctx, NULL);
 		if ((ctx->err != UCI_ERR_PARSE) ||
@@ -715,11 +847,20 @@ error:
 	/* no error happened, we can get rid of the parser context now */
 	uci_cleanup(ctx);
 
+	return errors;
+}
+
+int uci_import(struct uci_context *ctx, FILE *stream, const char *name, struct uci_package **package, bool single)
+{
+	UCI_HANDLE_ERR(ctx);
+	if (package && *package)
+		UCI_ASSERT_WRITABLE(ctx, *package);
+	uci_import_stream(ctx, stream, name, package, single, false);
 	return 0;
 }
 
 
-static char *uci_config_path(struct uci_context *ctx, const char *name)
+__private char *uci_config_path(struct uci_context *ctx, const char *name)
 {
 	char *filename;
 
@@ -730,16 +871,118 @@ static char *uci_config_path(struct uci_context *ctx, const char *name)
 	return filename;
 }
 
-static void uci_file_commit(struct uci_context *ctx, struct uci_package **package, bool overwrite)
+/* a package commit between writing the new config file and renaming it */
+struct uci_commit_stage {
+	FILE *f1;
+	FILE *f2;
+	char *filename;
+	char *path;
+	/* the savedir delta, locked only while the config is replaced */
+	FILE *delta;
+	struct uci_package **package;
+};
+
+/*
+ * a delta replay drops changes with names or values that the parser rejects,
+ * those can only exist in memory
+ */
+static bool uci_file_replayable(struct uci_package *p)
+{
+	struct uci_element *s, *o, *i;
+
+	uci_foreach_element(&p->sections, s) {
+		struct uci_section *sec = uci_to_section(s);
+
+		if (!uci_validate_name(s->name) || !uci_validate_type(sec->type))
+			return false;
+
+		uci_foreach_element(&sec->options, o) {
+			struct uci_option *opt = uci_to_option(o);
+
+			if (!uci_validate_name(o->name))
+				return false;
+
+			if (opt->type == UCI_TYPE_STRING) {
+				if (!uci_validate_text(opt->v.string))
+					return false;
+				continue;
+			}
+
+			uci_foreach_element(&opt->v.list, i) {
+				if (!uci_validate_text(i->name))
+					return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/*
+ * if neither the config file nor any of the delta files changed since the
+ * package was loaded, parsing the config and replaying the deltas again
+ * would only rebuild the package as it is. keep it and have the delta
+ * flushed. *changes is set if there are deltas to commit, which saved_delta
+ * tells if it was filled when the package was loaded. otherwise any delta
+ * takes the slow path
+ */
+static bool uci_file_commit_fast(struct uci_context *ctx, struct uci_package *p, bool *changes)
+{
+	struct uci_snapshot_key *key;
+	unsigned int i;
+	bool same;
+
+	if (!p->n_stamps || p->stamp_racy)
+		return false;
+
+	key = uci_snapshot_key(ctx, p->e.name, p->path, true);
+	if (!key)
+		return false;
+
+	same = (key->n_stamps == p->n_stamps) &&
+		!memcmp(key->stamps, p->stamps, p->n_stamps * sizeof(struct uci_stamp));
+	*changes = false;
+	for (i = 1; i < key->n_stamps; i++) {
+		if (key->stamps[i].size)
+			*changes = true;
+	}
+	free(key);
+
+	if (!same)
+		return false;
+	if (!*changes)
+		return true;
+	if (!p->has_saved_delta)
+		return false;
+
+	/* only lines that could be replayed count as changes */
+	*changes = !uci_list_empty(&p->saved_delta);
+	if (!*changes)
+		return true;
+	if (!uci_file_replayable(p))
+		return false;
+
+	/* like a package that was imported again, it no longer matches its files */
+	free(p->stamps);
+	p->stamps = NULL;
+	p->n_stamps = 0;
+	return true;
+}
+
+/*
+ * lock the config file, replay the delta and write the new config to a
+ * temporary file, which is left open in st->f2 for syncing.
+ * st->filename stays NULL if there is nothing to commit.
+ * saves and reverts take the config file lock as well, so nothing gets
+ * added to the savedir delta between reading and flushing it
+ */
+static void uci_file_commit_stage(struct uci_context *ctx, struct uci_package **package, bool overwrite, struct uci_commit_stage *st)
 {
 	struct uci_package *p = *package;
-	FILE *f1, *f2 = NULL;
 	char *volatile name = NULL;
 	char *volatile path = NULL;
 	char *filename = NULL;
-	struct stat statbuf;
-	volatile bool do_rename = false;
-	int fd, sz;
+	int fd;
 
 	if (!p->path) {
 		if (overwrite)
@@ -748,30 +991,38 @@ static void uci_file_commit(struct uci_context *ctx, struct uci_package **packag
 			UCI_THROW(ctx, UCI_ERR_INVAL);
 	}
 
-	sz = snprintf(NULL, 0, "%s/.%s.uci-XXXXXX", ctx->confdir, p->e.name);
-	filename = alloca(sz + 1);
-	snprintf(filename, sz + 1, "%s/.%s.uci-XXXXXX", ctx->confdir, p->e.name);
+	if ((asprintf(&filename, "%s/.%s.uci-XXXXXX", ctx->confdir, p->e.name) < 0) || !filename)
+		UCI_THROW(ctx, UCI_ERR_MEM);
 
 	/* open the config file for writing now, so that it is locked */
-	f1 = uci_open_stream(ctx, p->path, NULL, SEEK_SET, true, true);
+	UCI_TRAP_SAVE(ctx, done);
+	st->f1 = uci_open_stream(ctx, p->path, NULL, SEEK_SET, true, true);
 
 	/* flush unsaved changes and reload from delta file */
-	UCI_TRAP_SAVE(ctx, done);
 	if (p->has_delta) {
 		if (!overwrite) {
-			name = uci_strdup(ctx, p->e.name);
-			path = uci_strdup(ctx, p->path);
+			bool changes;
+
 			/* dump our own changes to the delta file */
-			if (!uci_list_empty(&p->delta))
-				UCI_INTERNAL(uci_save, ctx, p);
+			uci_save_delta(ctx, p);
+
+			st->delta = uci_delta_open(ctx, p->e.name, true);
+			if (uci_file_commit_fast(ctx, p, &changes)) {
+				if (!changes)
+					goto out;
+				goto export;
+			}
 
 			/*
 			 * other processes might have modified the config
 			 * as well. dump and reload
 			 */
+			name = uci_strdup(ctx, p->e.name);
+			path = uci_strdup(ctx, p->path);
 			uci_free_package(&p);
+			*package = NULL;
 			uci_cleanup(ctx);
-			UCI_INTERNAL(uci_import, ctx, f1, name, &p, true);
+			UCI_INTERNAL(uci_import, ctx, st->f1, name, &p, true);
 
 			p->path = path;
 			p->has_delta = true;
@@ -781,51 +1032,239 @@ static void uci_file_commit(struct uci_context *ctx, struct uci_package **packag
 			path = NULL;
 		}
 
-		/* flush delta */
-		if (!uci_load_delta(ctx, p, true))
-			goto done;
+		if (overwrite)
+			st->delta = uci_delta_open(ctx, p->e.name, true);
+		if (!uci_load_delta(ctx, p, st->delta, true))
+			goto out;
 	}
 
+export:
 	fd = mkstemp(filename);
 	if (fd == -1)
 		UCI_THROW(ctx, UCI_ERR_IO);
 
-	if ((flock(fd, LOCK_EX) < 0) && (errno != ENOSYS))
+	st->filename = filename;
+	if ((uci_flock(ctx, fd, LOCK_EX) < 0) && (errno != ENOSYS)) {
+		close(fd);
 		UCI_THROW(ctx, UCI_ERR_IO);
+	}
 
-	if (lseek(fd, 0, SEEK_SET) < 0)
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		close(fd);
 		UCI_THROW(ctx, UCI_ERR_IO);
+	}
 
-	f2 = fdopen(fd, "w+");
-	if (!f2)
+	st->f2 = fdopen(fd, "w+");
+	if (!st->f2) {
+		close(fd);
 		UCI_THROW(ctx, UCI_ERR_IO);
+	}
 
-	uci_export(ctx, f2, p, false);
-
-	fflush(f2);
-	fsync(fileno(f2));
-	uci_close_stream(f2);
-
-	do_rename = true;
+	uci_export(ctx, st->f2, p, false);
+	fflush(st->f2);
 
+out:
 	UCI_TRAP_RESTORE(ctx);
 
 done:
 	free(name);
 	free(path);
-	uci_close_stream(f1);
-	if (do_rename) {
-		path = realpath(p->path, NULL);
-		if (!path || stat(path, &statbuf) || chmod(filename, statbuf.st_mode) || rename(filename, path)) {
-			unlink(filename);
-			UCI_THROW(ctx, UCI_ERR_IO);
+	if (!st->filename)
+		free(filename);
+	if (ctx->err) {
+		uci_close_stream(st->delta);
+		uci_close_stream(st->f1);
+		uci_close_stream(st->f2);
+		if (st->filename) {
+			unlink(st->filename);
+			free(st->filename);
 		}
-		free(path);
-	}
-	if (ctx->err)
+		memset(st, 0, sizeof(*st));
 		UCI_THROW(ctx, ctx->err);
+	}
+}
+
+/*
+ * move the new config file in place, flush the delta and release the
+ * config file lock. st->f2 must have been synced and closed already
+ */
+static bool uci_file_commit_finish(struct uci_context *ctx, struct uci_package *p, struct uci_commit_stage *st)
+{
+	struct stat statbuf;
+	uint64_t start;
+	bool ret = false;
+
+	if (!st->filename) {
+		ret = true;
+		goto out;
+	}
+
+	/*
+	 * readers hold the delta shared, so they see the new config with the
+	 * flushed delta only. everything in it was committed, since writers
+	 * wait for the config file lock
+	 */
+	st->path = realpath(p->path, NULL);
+	if (st->path && !stat(st->path, &statbuf) && !chmod(st->filename, statbuf.st_mode) &&
+	    (!st->delta || (uci_flock(ctx, fileno(st->delta), LOCK_EX) == 0) || (errno == ENOSYS))) {
+		start = uci_stats_clock(ctx);
+		ret = !rename(st->filename, st->path);
+		uci_stats_time(ctx, &ctx->stats.rename_time, start);
+	}
+
+	if (ret) {
+		uci_snapshot_invalidate(ctx, p);
+		if (st->delta && (ftruncate(fileno(st->delta), 0) < 0))
+			ret = false;
+	} else {
+		unlink(st->filename);
+	}
+
+	free(st->filename);
+	st->filename = NULL;
+out:
+	uci_close_stream(st->delta);
+	st->delta = NULL;
+	uci_close_stream(st->f1);
+	st->f1 = NULL;
+	return ret;
 }
 
+static void uci_file_commit(struct uci_context *ctx, struct uci_package **package, bool overwrite)
+{
+	struct uci_commit_stage st;
+	uint64_t start;
+	bool ok;
+
+	memset(&st, 0, sizeof(st));
+	uci_file_commit_stage(ctx, package, overwrite, &st);
+	if (st.f2) {
+		start = uci_stats_clock(ctx);
+		fsync(fileno(st.f2));
+		uci_stats_time(ctx, &ctx->stats.fsync_time, start);
+		uci_close_stream(st.f2);
+	}
+
+	ok = uci_file_commit_finish(ctx, *package, &st);
+	free(st.path);
+	if (!ok)
+		UCI_THROW(ctx, UCI_ERR_IO);
+}
+
+/* fsync the directory containing path, unless it was already synced */
+static void uci_file_sync_dir(struct uci_commit_stage *st, int i)
+{
+	char *dir, *slash;
+	int j, fd;
+
+	slash = strrchr(st[i].path, '/');
+	if (!slash)
+		return;
+
+	for (j = 0; j < i; j++) {
+		char *s = st[j].path ? strrchr(st[j].path, '/') : NULL;
+
+		if (s && (s - st[j].path == slash - st[i].path) &&
+		    !strncmp(st[j].path, st[i].path, slash - st[i].path))
+			return;
+	}
+
+	dir = strndup(st[i].path, (slash == st[i].path) ? 1 : slash - st[i].path);
+	if (!dir)
+		return;
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	free(dir);
+}
+
+/* packages without a path fail to stage, they go first */
+static int uci_commit_stage_cmp(const void *a, const void *b)
+{
+	const struct uci_package *pa = *((const struct uci_commit_stage *) a)->package;
+	const struct uci_package *pb = *((const struct uci_commit_stage *) b)->package;
+
+	if (!pa->path || !pb->path)
+		return !!pa->path - !!pb->path;
+
+	return strcmp(pa->path, pb->path);
+}
+
+/*
+ * commit several packages of the file backend: all new config files are
+ * written first and synced to disk with a single syncfs() before any of
+ * them gets renamed, so that each file is either the old or the new one
+ * after a crash. the directories are synced at the end to make the
+ * renames durable.
+ * once a delta has been flushed the package has to be committed, so
+ * packages staged before an error are still renamed
+ */
+__private void uci_file_commit_many(struct uci_context *ctx, struct uci_package **packages, int n, bool overwrite)
+{
+	struct uci_commit_stage *st;
+	volatile int staged = 0, count = 0;
+	uint64_t start;
+	bool synced;
+	int i, err;
+
+	st = uci_malloc(ctx, n * sizeof(struct uci_commit_stage));
+
+	UCI_TRAP_SAVE(ctx, error);
+	for (i = 0; i < n; i++) {
+		struct uci_package *p = packages[i];
+
+		if (p->backend != &uci_file_backend)
+			continue;
+		if (!p->path && overwrite)
+			p->path = uci_config_path(ctx, p->e.name);
+		st[count++].package = &packages[i];
+	}
+
+	/*
+	 * the config files stay locked until all of them are renamed. lock
+	 * them in the order of their paths, so that two processes committing
+	 * the same configs can't wait for each other
+	 */
+	qsort(st, count, sizeof(struct uci_commit_stage), uci_commit_stage_cmp);
+
+	for (; staged < count; staged++)
+		uci_file_commit_stage(ctx, st[staged].package, overwrite, &st[staged]);
+	UCI_TRAP_RESTORE(ctx);
+
+error:
+	err = ctx->err;
+	synced = false;
+	start = uci_stats_clock(ctx);
+	for (i = 0; i < staged; i++) {
+		if (!st[i].f2)
+			continue;
+		if (!synced)
+			synced = !syncfs(fileno(st[i].f2));
+		if (!synced)
+			fsync(fileno(st[i].f2));
+	}
+	uci_stats_time(ctx, &ctx->stats.fsync_time, start);
+	for (i = 0; i < staged; i++) {
+		uci_close_stream(st[i].f2);
+		if (!uci_file_commit_finish(ctx, *st[i].package, &st[i]) && !err)
+			err = UCI_ERR_IO;
+	}
+	start = uci_stats_clock(ctx);
+	for (i = 0; i < staged; i++) {
+		if (st[i].path)
+			uci_file_sync_dir(st, i);
+	}
+	uci_stats_time(ctx, &ctx->stats.fsync_time, start);
+	for (i = 0; i < staged; i++)
+		free(st[i].path);
+	free(st);
+
+	if (err)
+		UCI_THROW(ctx, err);
+}
 
 /*
  * This function returns the filename by returning the string
@@ -900,9 +1339,13 @@ static struct uci_package *uci_file_load(struct uci_context *ctx,
 					 const char *volatile name)
 {
 	struct uci_package *package = NULL;
+	struct uci_snapshot_key *volatile key = NULL;
+	struct uci_stamp stamp;
 	char *filename;
 	bool confdir;
 	FILE *volatile file = NULL;
+	FILE *volatile delta = NULL;
+	volatile int errors = 0;
 
 	switch (name[0]) {
 	case '.':
@@ -923,20 +1366,57 @@ static struct uci_package *uci_file_load(struct uci_context *ctx,
 		break;
 	}
 
+	/*
+	 * the config file is read without a lock, so that a commit that is
+	 * still syncing the new one doesn't hold up readers. the savedir delta
+	 * is locked instead, commits hold it while they swap both
+	 */
 	UCI_TRAP_SAVE(ctx, done);
-	file = uci_open_stream(ctx, filename, NULL, SEEK_SET, false, false);
+	if (confdir)
+		delta = uci_delta_open(ctx, name, false);
+	UCI_TRAP_RESTORE(ctx);
+
+	/* the stamps need to be taken before any of the files is read */
+	if (confdir)
+		key = uci_snapshot_key(ctx, name, filename, true);
+	else
+		uci_stamp_file(filename, &stamp);
+
+	if (key && (ctx->flags & UCI_FLAG_CACHE)) {
+		package = uci_snapshot_load(ctx, key, name);
+		if (package) {
+			package->path = filename;
+			package->has_delta = true;
+			uci_stamp_package(package, key->stamps, key->n_stamps);
+			free(key);
+			uci_close_stream(delta);
+			return package;
+		}
+	}
+
+	UCI_TRAP_SAVE(ctx, done);
+	file = uci_open_config(ctx, filename);
 	ctx->err = 0;
-	UCI_INTERNAL(uci_import, ctx, file, name, &package, true);
+	errors = uci_import_stream(ctx, file, name, &package, true, !!(ctx->flags & UCI_FLAG_MMAP));
 	UCI_TRAP_RESTORE(ctx);
 
 	if (package) {
 		package->path = filename;
 		package->has_delta = confdir;
-		uci_load_delta(ctx, package, false);
+		uci_load_delta(ctx, package, delta, !!delta);
+		if (key) {
+			uci_stamp_package(package, key->stamps, key->n_stamps);
+			if (!errors && (ctx->flags & UCI_FLAG_CACHE))
+				uci_snapshot_store(ctx, key, package);
+		} else if (!confdir) {
+			uci_stamp_package(package, &stamp, 1);
+		}
 	}
 
 done:
+	free(key);
 	uci_close_stream(file);
+	uci_close_stream(delta);
 	if (ctx->err) {
 		free(filename);
 		UCI_THROW(ctx, ctx->err);
@@ -944,6 +1424,36 @@ done:
 	return package;
 }
 
+int uci_package_stale(struct uci_context *ctx, struct uci_package *p, bool *stale)
+{
+	struct uci_snapshot_key *key;
+	struct uci_stamp stamp;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, p != NULL);
+	UCI_ASSERT(ctx, stale != NULL);
+
+	/* a racy stamp can't tell a rewrite within the same tick apart */
+	*stale = true;
+	if (!p->n_stamps || !p->path || p->stamp_racy)
+		return 0;
+
+	if (!p->has_delta) {
+		if (uci_stamp_file(p->path, &stamp))
+			*stale = !!memcmp(&stamp, p->stamps, sizeof(stamp));
+		return 0;
+	}
+
+	key = uci_snapshot_key(ctx, p->e.name, p->path, true);
+	if (!key)
+		return 0;
+
+	if (key->n_stamps == p->n_stamps)
+		*stale = !!memcmp(key->stamps, p->stamps, p->n_stamps * sizeof(struct uci_stamp));
+	free(key);
+	return 0;
+}
+
 __private UCI_BACKEND(uci_file_backend, "file",
 	.load = uci_file_load,
 	.commit = uci_file_commit,
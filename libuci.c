@@ -18,12 +18,15 @@
 
 #define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <dlfcn.h>
 #include <glob.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "uci.h"
 
 static const char *uci_errstr[] = {
@@ -42,9 +45,14 @@ static const char *uci_errstr[] = {
 
 __private const char *uci_confdir = UCI_CONFDIR;
 __private const char *uci_savedir = UCI_SAVEDIR;
+__private const char *uci_cachedir = UCI_CACHEDIR;
 
-/* exported functions */
-struct uci_context *uci_alloc_context(void)
+/*
+ * the backends are static and can only be linked into the list of one
+ * context at a time. contexts used on the side of another one leave them
+ * alone
+ */
+static struct uci_context *uci_alloc_bare_context(void)
 {
 	struct uci_context *ctx;
 
@@ -59,10 +67,25 @@ struct uci_context *uci_alloc_context(void)
 
 	ctx->confdir = (char *) uci_confdir;
 	ctx->savedir = (char *) uci_savedir;
+	ctx->cachedir = (char *) uci_cachedir;
+	ctx->lock_timeout = -1;
 	uci_add_delta_path(ctx, uci_savedir);
+	ctx->backend = &uci_file_backend;
+
+	return ctx;
+}
+
+/* exported functions */
+struct uci_context *uci_alloc_context(void)
+{
+	struct uci_context *ctx;
+
+	ctx = uci_alloc_bare_context();
+	if (!ctx)
+		return NULL;
 
 	uci_list_add(&ctx->backends, &uci_file_backend.e.list);
-	ctx->backend = &uci_file_backend;
+	uci_list_add(&ctx->backends, &uci_shm_backend.e.list);
 
 	return ctx;
 }
@@ -75,6 +98,8 @@ void uci_free_context(struct uci_context *ctx)
 		free(ctx->confdir);
 	if (ctx->savedir != uci_savedir)
 		free(ctx->savedir);
+	if (ctx->cachedir != uci_cachedir)
+		free(ctx->cachedir);
 
 	uci_cleanup(ctx);
 	UCI_TRAP_SAVE(ctx, ignore);
@@ -86,6 +111,7 @@ void uci_free_context(struct uci_context *ctx)
 		uci_free_element(e);
 	}
 	UCI_TRAP_RESTORE(ctx);
+	uci_intern_free(ctx);
 	free(ctx);
 
 ignore:
@@ -106,6 +132,27 @@ int uci_set_confdir(struct uci_context *ctx, const char *dir)
 	return 0;
 }
 
+int uci_set_lock_timeout(struct uci_context *ctx, int timeout)
+{
+	UCI_HANDLE_ERR(ctx);
+	ctx->lock_timeout = timeout;
+	return 0;
+}
+
+int uci_set_cachedir(struct uci_context *ctx, const char *dir)
+{
+	char *cdir;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, dir != NULL);
+
+	cdir = uci_strdup(ctx, dir);
+	if (ctx->cachedir != uci_cachedir)
+		free(ctx->cachedir);
+	ctx->cachedir = cdir;
+	return 0;
+}
+
 __private void uci_cleanup(struct uci_context *ctx)
 {
 	struct uci_parse_context *pctx;
@@ -124,8 +171,12 @@ __private void uci_cleanup(struct uci_context *ctx)
 	if (pctx->package)
 		uci_free_package(&pctx->package);
 
-	if (pctx->buf)
+	if (pctx->map) {
+		if (pctx->map_size)
+			munmap(pctx->map, pctx->map_size);
+	} else if (pctx->buf) {
 		free(pctx->buf);
+	}
 
 	free(pctx);
 }
@@ -188,11 +239,42 @@ int uci_commit(struct uci_context *ctx, struct uci_package **package, bool overw
 	UCI_ASSERT(ctx, package != NULL);
 	p = *package;
 	UCI_ASSERT(ctx, p != NULL);
+	UCI_ASSERT_WRITABLE(ctx, p);
 	UCI_ASSERT(ctx, p->backend && p->backend->commit);
 	p->backend->commit(ctx, package, overwrite);
 	return 0;
 }
 
+int uci_commit_many(struct uci_context *ctx, struct uci_package **packages, int n, bool overwrite)
+{
+	int i, j;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, packages != NULL);
+	UCI_ASSERT(ctx, n >= 0);
+	for (i = 0; i < n; i++) {
+		struct uci_package *p = packages[i];
+
+		UCI_ASSERT(ctx, p != NULL);
+		UCI_ASSERT_WRITABLE(ctx, p);
+		UCI_ASSERT(ctx, p->backend && p->backend->commit);
+		/* the same config can't be locked twice */
+		for (j = 0; j < i; j++) {
+			if (!strcmp(p->e.name, packages[j]->e.name))
+				UCI_THROW(ctx, UCI_ERR_DUPLICATE);
+		}
+	}
+
+	/* only the file backend knows how to batch its commits */
+	for (i = 0; i < n; i++) {
+		if (packages[i]->backend != &uci_file_backend)
+			packages[i]->backend->commit(ctx, &packages[i], overwrite);
+	}
+	if (n > 0)
+		uci_file_commit_many(ctx, packages, n, overwrite);
+	return 0;
+}
+
 int uci_load(struct uci_context *ctx, const char *name, struct uci_package **package)
 {
 	struct uci_package *p;
@@ -206,6 +288,198 @@ int uci_load(struct uci_context *ctx, const char *name, struct uci_package **pac
 	return 0;
 }
 
+struct uci_load_job {
+	struct uci_context *ctx;
+	char **names;
+	struct uci_package **res;
+	int n;
+	int *next;
+};
+
+static void *uci_load_worker(void *arg)
+{
+	struct uci_load_job *job = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(job->next, 1, __ATOMIC_RELAXED)) < job->n) {
+		/* failed configs are left for the caller to report */
+		if (uci_load(job->ctx, job->names[i], &job->res[i]))
+			job->res[i] = NULL;
+	}
+	return NULL;
+}
+
+/*
+ * set up a private context that loads packages exactly like ctx would.
+ * it has no backends list of its own and leaves the one of ctx alone
+ */
+__private struct uci_context *uci_clone_context(struct uci_context *ctx)
+{
+	struct uci_context *wctx;
+	struct uci_element *e, *tmp;
+
+	wctx = uci_alloc_bare_context();
+	if (!wctx)
+		UCI_THROW(ctx, UCI_ERR_MEM);
+
+	if (uci_set_confdir(wctx, ctx->confdir) ||
+	    uci_set_savedir(wctx, ctx->savedir) ||
+	    uci_set_cachedir(wctx, ctx->cachedir) ||
+	    uci_set_lock_timeout(wctx, ctx->lock_timeout))
+		goto error;
+
+	UCI_TRAP_SAVE(wctx, error);
+	uci_foreach_element_safe(&wctx->delta_path, tmp, e) {
+		uci_free_element(e);
+	}
+	uci_foreach_element(&ctx->delta_path, e) {
+		tmp = uci_alloc_generic(wctx, UCI_TYPE_PATH, e->name, sizeof(struct uci_element));
+		uci_list_add(&wctx->delta_path, &tmp->list);
+	}
+	UCI_TRAP_RESTORE(wctx);
+
+	wctx->flags = ctx->flags;
+	wctx->backend = ctx->backend;
+	return wctx;
+
+error:
+	uci_free_context(wctx);
+	UCI_THROW(ctx, UCI_ERR_MEM);
+	return NULL;
+}
+
+/* hand a package parsed by a worker context over to ctx */
+static void uci_load_adopt(struct uci_context *ctx, struct uci_package *p)
+{
+	struct uci_element *se, *oe;
+
+	/* the worker intern table goes away with its context */
+	uci_types_free(&p->types);
+	uci_foreach_element(&p->sections, se) {
+		struct uci_section *s = uci_to_section(se);
+
+		s->type = (char *) uci_intern(ctx, s->type);
+		uci_foreach_element(&s->options, oe)
+			oe->name = (char *) uci_intern(ctx, oe->name);
+	}
+	uci_list_del(&p->e.list);
+	p->ctx = ctx;
+	uci_list_add(&ctx->root, &p->e.list);
+}
+
+int uci_load_all(struct uci_context *ctx, char **names)
+{
+	struct uci_context **volatile wctx = NULL;
+	struct uci_load_job *volatile jobs = NULL;
+	struct uci_package **volatile res = NULL;
+	pthread_t *volatile threads = NULL;
+	char **volatile todo = NULL;
+	char **volatile configs = NULL;
+	char **volatile list = names;
+	volatile int n_workers = 0;
+	int n = 0, next = 0;
+	long cpus;
+	int i;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, ctx->backend && ctx->backend->load);
+
+	if (!list) {
+		UCI_ASSERT(ctx, ctx->backend->list_configs);
+		list = configs = ctx->backend->list_configs(ctx);
+		if (!configs)
+			return 0;
+	}
+
+	UCI_TRAP_SAVE(ctx, error);
+	for (i = 0; list[i]; i++)
+		;
+	todo = uci_malloc(ctx, (i + 1) * sizeof(char *));
+	for (i = 0; list[i]; i++) {
+		if (!uci_lookup_list(&ctx->root, list[i]))
+			todo[n++] = list[i];
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > UCI_LOAD_THREADS)
+		cpus = UCI_LOAD_THREADS;
+	if (cpus > n)
+		cpus = n;
+
+	if (cpus < 2) {
+		/* not worth the threads, load in place */
+		for (i = 0; i < n; i++) {
+			UCI_TRAP_SAVE(ctx, skip);
+			ctx->internal = true;
+			uci_load(ctx, todo[i], NULL);
+			UCI_TRAP_RESTORE(ctx);
+			continue;
+		skip:
+			ctx->err = 0;
+		}
+		goto done;
+	}
+
+	res = uci_malloc(ctx, n * sizeof(*res));
+	jobs = uci_malloc(ctx, cpus * sizeof(*jobs));
+	threads = uci_malloc(ctx, cpus * sizeof(*threads));
+	wctx = uci_malloc(ctx, cpus * sizeof(*wctx));
+
+	for (i = 0; i < cpus; i++) {
+		wctx[i] = uci_clone_context(ctx);
+		n_workers++;
+	}
+
+	for (i = 0; i < n_workers; i++) {
+		jobs[i].ctx = wctx[i];
+		jobs[i].names = todo;
+		jobs[i].res = res;
+		jobs[i].n = n;
+		jobs[i].next = &next;
+		if (pthread_create(&threads[i], NULL, uci_load_worker, &jobs[i]))
+			break;
+	}
+	if (!i)
+		uci_load_worker(&jobs[0]);
+	while (i-- > 0)
+		pthread_join(threads[i], NULL);
+
+	/* merge in the order the configs were listed */
+	for (i = 0; i < n; i++) {
+		if (res[i])
+			uci_load_adopt(ctx, res[i]);
+	}
+
+done:
+	UCI_TRAP_RESTORE(ctx);
+error:
+	for (i = 0; i < n_workers; i++) {
+		uci_stats_merge(&ctx->stats, &wctx[i]->stats);
+		uci_free_context(wctx[i]);
+	}
+	free(wctx);
+	free(threads);
+	free(jobs);
+	free(res);
+	free(todo);
+	free(configs);
+	if (ctx->err)
+		UCI_THROW(ctx, ctx->err);
+	return 0;
+}
+
+int uci_get_stats(struct uci_context *ctx, struct uci_stats *stats, bool reset)
+{
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, stats != NULL);
+
+	*stats = ctx->stats;
+	if (reset)
+		memset(&ctx->stats, 0, sizeof(ctx->stats));
+
+	return 0;
+}
+
 int uci_set_backend(struct uci_context *ctx, const char *name)
 {
 	struct uci_element *e;
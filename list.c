@@ -30,27 +30,457 @@ static bool uci_list_set_pos(struct uci_list *head, struct uci_list *ptr, int po
 	return (old_head != new_head);
 }
 
-static inline void uci_list_fixup(struct uci_list *ptr)
+/* Based on an efficient hash function published by D. J. Bernstein */
+__private unsigned int djbhash(unsigned int hash, const char *str)
+{
+	int len = strlen(str);
+	int i;
+
+	/* initial value */
+	if (hash == ~0U)
+		hash = 5381;
+
+	for(i = 0; i < len; i++) {
+		hash = ((hash << 5) + hash) + str[i];
+	}
+	return (hash & 0x7FFFFFFF);
+}
+
+static struct uci_hash *uci_hash_alloc(unsigned int size)
+{
+	struct uci_hash *h;
+
+	h = calloc(1, sizeof(struct uci_hash) + size * sizeof(struct uci_hash_entry));
+	if (h)
+		h->size = size;
+
+	return h;
+}
+
+static void uci_hash_insert(struct uci_hash *h, unsigned int hash, struct uci_element *e)
+{
+	unsigned int mask = h->size - 1;
+	unsigned int i;
+
+	for (i = hash & mask; h->entries[i].e; i = (i + 1) & mask)
+		;
+
+	h->entries[i].hash = hash;
+	h->entries[i].e = e;
+	h->count++;
+}
+
+/*
+ * add an element to an existing index. the index is only used to speed
+ * up lookups, so if it cannot be grown, it is dropped and rebuilt later
+ */
+static void uci_hash_add(struct uci_hash **hp, struct uci_element *e)
+{
+	struct uci_hash *h = *hp;
+	struct uci_hash *new;
+	unsigned int i;
+
+	if (!h || !e->name)
+		return;
+
+	if ((h->count + 1) * 4 > h->size * 3) {
+		new = uci_hash_alloc(h->size * 2);
+		for (i = 0; new && (i < h->size); i++) {
+			if (h->entries[i].e)
+				uci_hash_insert(new, h->entries[i].hash, h->entries[i].e);
+		}
+		free(h);
+		*hp = h = new;
+		if (!h)
+			return;
+	}
+
+	uci_hash_insert(h, djbhash(~0U, e->name), e);
+}
+
+static void uci_hash_del(struct uci_hash *h, struct uci_element *e)
+{
+	unsigned int mask, home, i, j;
+
+	if (!h || !e->name)
+		return;
+
+	mask = h->size - 1;
+	for (i = djbhash(~0U, e->name) & mask; h->entries[i].e != e; i = (i + 1) & mask) {
+		if (!h->entries[i].e)
+			return;
+	}
+
+	/*
+	 * move following entries of the probe sequence into the gap,
+	 * unless their home slot lies between the gap and their position
+	 */
+	for (j = (i + 1) & mask; h->entries[j].e; j = (j + 1) & mask) {
+		home = h->entries[j].hash & mask;
+		if ((i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j)))
+			continue;
+
+		h->entries[i] = h->entries[j];
+		i = j;
+	}
+	h->entries[i].e = NULL;
+	h->count--;
+}
+
+static struct uci_element *uci_hash_find(struct uci_hash *h, const char *name, uint64_t *cmp)
+{
+	unsigned int hash = djbhash(~0U, name);
+	unsigned int mask = h->size - 1;
+	unsigned int i;
+
+	for (i = hash & mask; h->entries[i].e; i = (i + 1) & mask) {
+		if (h->entries[i].hash != hash)
+			continue;
+		if (cmp)
+			(*cmp)++;
+		if (!strcmp(h->entries[i].e->name, name))
+			return h->entries[i].e;
+	}
+
+	return NULL;
+}
+
+static void uci_hash_build(struct uci_hash **hp, struct uci_list *list)
+{
+	unsigned int size = UCI_HASH_MIN * 2;
+	unsigned int count = 0;
+	struct uci_element *e;
+
+	uci_foreach_element(list, e)
+		count++;
+
+	while (size < count * 2)
+		size *= 2;
+
+	*hp = uci_hash_alloc(size);
+	if (!*hp)
+		return;
+
+	uci_foreach_element(list, e) {
+		if (e->name)
+			uci_hash_insert(*hp, djbhash(~0U, e->name), e);
+	}
+}
+
+static inline void uci_hash_free(struct uci_hash **hp)
+{
+	free(*hp);
+	*hp = NULL;
+}
+
+/* get the index of the list that a section or option belongs to */
+static struct uci_hash **uci_element_hash(struct uci_element *e)
+{
+	struct uci_option *o;
+
+	switch (e->type) {
+	case UCI_TYPE_SECTION:
+		return &uci_to_section(e)->package->hash;
+	case UCI_TYPE_OPTION:
+		o = uci_to_option(e);
+		if (o->section)
+			return &o->section->hash;
+		break;
+	default:
+		break;
+	}
+
+	return NULL;
+}
+
+/* get the index for a list head, if the list is a section or option list */
+static struct uci_hash **uci_list_hash(struct uci_list *list)
+{
+	struct uci_element *e;
+	struct uci_section *s;
+	struct uci_option *o;
+
+	if (uci_list_empty(list))
+		return NULL;
+
+	e = list_to_element(list->next);
+	switch (e->type) {
+	case UCI_TYPE_SECTION:
+		s = uci_to_section(e);
+		if (list == &s->package->sections)
+			return &s->package->hash;
+		break;
+	case UCI_TYPE_OPTION:
+		o = uci_to_option(e);
+		if (o->section && (list == &o->section->options))
+			return &o->section->hash;
+		break;
+	default:
+		break;
+	}
+
+	return NULL;
+}
+
+static void uci_types_free(struct uci_types **tp)
+{
+	struct uci_types *t = *tp;
+	unsigned int i;
+
+	if (!t)
+		return;
+
+	for (i = 0; i < t->count; i++)
+		free(t->vec[i].e);
+	free(t->vec);
+	free(t);
+	*tp = NULL;
+}
+
+/* types are compared by pointer if they were interned */
+static struct uci_type_vec *
+uci_types_find(struct uci_types *t, const char *type, bool interned)
+{
+	unsigned int i;
+
+	if (!type)
+		return &t->vec[0];
+
+	for (i = 1; i < t->count; i++) {
+		if (interned ? (t->vec[i].type == type) : !strcmp(t->vec[i].type, type))
+			return &t->vec[i];
+	}
+
+	return NULL;
+}
+
+static bool uci_types_push(struct uci_type_vec *v, struct uci_element *e)
+{
+	if (v->count == v->size) {
+		unsigned int size = v->size ? v->size * 2 : 8;
+		struct uci_element **new = realloc(v->e, size * sizeof(*new));
+
+		if (!new)
+			return false;
+		v->e = new;
+		v->size = size;
+	}
+	v->e[v->count++] = e;
+	return true;
+}
+
+/* insert a section where it belongs in list order */
+static bool uci_types_put(struct uci_type_vec *v, struct uci_section *s)
+{
+	struct uci_element *e;
+	unsigned int i = 0;
+
+	uci_foreach_element(&s->package->sections, e) {
+		if (e == &s->e)
+			break;
+		if (!v->type || (uci_to_section(e)->type == v->type))
+			i++;
+	}
+
+	if (!uci_types_push(v, &s->e))
+		return false;
+
+	memmove(&v->e[i + 1], &v->e[i], (v->count - i - 1) * sizeof(*v->e));
+	v->e[i] = &s->e;
+	return true;
+}
+
+/* the vector of a type, added if there is none yet */
+static struct uci_type_vec *uci_types_vec(struct uci_types *t, const char *type)
+{
+	struct uci_type_vec *v = uci_types_find(t, type, true);
+
+	if (!v) {
+		if (t->count == t->size) {
+			unsigned int size = t->size * 2;
+			struct uci_type_vec *new = realloc(t->vec, size * sizeof(*new));
+
+			if (!new)
+				return NULL;
+			t->vec = new;
+			t->size = size;
+		}
+		v = &t->vec[t->count++];
+		memset(v, 0, sizeof(*v));
+		v->type = type;
+	}
+
+	return v;
+}
+
+static bool uci_types_insert(struct uci_types *t, struct uci_section *s)
+{
+	struct uci_type_vec *v = uci_types_vec(t, s->type);
+
+	return v && uci_types_push(&t->vec[0], &s->e) && uci_types_push(v, &s->e);
+}
+
+/*
+ * append a new section to an existing index. like the name index, it is
+ * dropped and rebuilt later if it cannot be grown
+ */
+static void uci_types_add(struct uci_types **tp, struct uci_section *s)
+{
+	if (*tp && !uci_types_insert(*tp, s))
+		uci_types_free(tp);
+}
+
+static void uci_types_remove(struct uci_type_vec *v, struct uci_element *e)
 {
-	ptr->prev->next = ptr;
-	ptr->next->prev = ptr;
+	unsigned int i;
+
+	for (i = 0; i < v->count; i++) {
+		if (v->e[i] != e)
+			continue;
+
+		memmove(&v->e[i], &v->e[i + 1], (v->count - i - 1) * sizeof(*v->e));
+		v->count--;
+		return;
+	}
+}
+
+static void uci_types_del(struct uci_types *t, struct uci_section *s)
+{
+	struct uci_type_vec *v;
+
+	if (!t)
+		return;
+
+	uci_types_remove(&t->vec[0], &s->e);
+	v = uci_types_find(t, s->type, true);
+	if (v)
+		uci_types_remove(v, &s->e);
+}
+
+/*
+ * put a section back into the index after it was moved or its type
+ * changed, it must have been taken out with uci_types_del before
+ */
+static void uci_types_readd(struct uci_types **tp, struct uci_section *s)
+{
+	struct uci_type_vec *v;
+
+	if (!*tp)
+		return;
+
+	v = uci_types_vec(*tp, s->type);
+	if (!v || !uci_types_put(&(*tp)->vec[0], s) || !uci_types_put(v, s))
+		uci_types_free(tp);
+}
+
+static void uci_types_build(struct uci_package *p)
+{
+	struct uci_types *t;
+	struct uci_element *e;
+
+	if (p->types)
+		return;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return;
+
+	t->size = 8;
+	t->count = 1;
+	t->vec = calloc(t->size, sizeof(*t->vec));
+	p->types = t;
+	if (!t->vec) {
+		free(t);
+		p->types = NULL;
+		return;
+	}
+
+	uci_foreach_element(&p->sections, e) {
+		if (!uci_types_insert(t, uci_to_section(e))) {
+			uci_types_free(&p->types);
+			return;
+		}
+	}
+}
+
+/*
+ * returns the arena of the package that is currently being parsed,
+ * if it has one
+ */
+static struct uci_arena **
+uci_parse_arena(struct uci_context *ctx)
+{
+	struct uci_parse_context *pctx = ctx->pctx;
+
+	if (!pctx || !pctx->package || !pctx->package->arena)
+		return NULL;
+
+	return &pctx->package->arena;
+}
+
+/*
+ * check if a string points into the mapped file that the package
+ * currently being parsed was loaded from. such strings live as long as
+ * the package and don't need to be copied. the unread part of the file
+ * starts with the (temporary) terminator of the current line, so
+ * strings located there are not stable
+ */
+static bool
+uci_parse_mapped(struct uci_context *ctx, const char *str)
+{
+	struct uci_parse_context *pctx = ctx->pctx;
+
+	if (!str || !pctx || !pctx->map || !pctx->package ||
+	    pctx->package->map != pctx->map)
+		return false;
+
+	return (str >= pctx->map) && (str < pctx->map + pctx->map_ofs);
 }
 
 /*
  * uci_alloc_generic allocates a new uci_element with payload
  * payload is appended to the struct to save memory and reduce fragmentation
+ * while a package with an arena is being parsed, the element and its name
+ * are taken from the arena instead of the heap. names that are not owned
+ * by the element (mapped or interned) are only referenced
  */
 __private struct uci_element *
 uci_alloc_generic(struct uci_context *ctx, int type, const char *name, int size)
 {
+	struct uci_arena **arena = uci_parse_arena(ctx);
 	struct uci_element *e;
 	int datalen = size;
+	const char *ext = NULL;
 	void *ptr;
 
+	/* option names are shared through the context intern table */
+	if (name && (type == UCI_TYPE_OPTION))
+		ext = uci_intern(ctx, name);
+	else if (uci_parse_mapped(ctx, name))
+		ext = name;
+
+	if (arena) {
+		e = uci_arena_alloc(ctx, arena, datalen);
+		e->type = type;
+		e->flags = UCI_ELEMENT_ARENA;
+		if (ext) {
+			e->name = (char *) ext;
+			e->flags |= UCI_ELEMENT_EXT_NAME;
+		} else if (name) {
+			e->name = uci_arena_strdup(ctx, arena, name);
+			e->flags |= UCI_ELEMENT_EXT_NAME;
+		}
+		uci_list_init(&e->list);
+		return e;
+	}
+
 	ptr = uci_malloc(ctx, datalen);
 	e = (struct uci_element *) ptr;
 	e->type = type;
-	if (name) {
+	if (ext) {
+		e->name = (char *) ext;
+		e->flags |= UCI_ELEMENT_EXT_NAME;
+	} else if (name) {
 		UCI_TRAP_SAVE(ctx, error);
 		e->name = uci_strdup(ctx, name);
 		UCI_TRAP_RESTORE(ctx);
@@ -69,25 +499,34 @@ done:
 __private void
 uci_free_element(struct uci_element *e)
 {
-	free(e->name);
+	if (!(e->flags & UCI_ELEMENT_EXT_NAME))
+		free(e->name);
 	if (!uci_list_empty(&e->list))
 		uci_list_del(&e->list);
-	free(e);
+	if (!(e->flags & UCI_ELEMENT_ARENA))
+		free(e);
 }
 
-static struct uci_option *
+__private struct uci_option *
 uci_alloc_option(struct uci_section *s, const char *name, const char *value)
 {
 	struct uci_package *p = s->package;
 	struct uci_context *ctx = p->ctx;
 	struct uci_option *o;
 
-	o = uci_alloc_element(ctx, option, name, strlen(value) + 1);
+	if (uci_parse_mapped(ctx, value)) {
+		o = uci_alloc_element(ctx, option, name, 0);
+		o->e.flags |= UCI_ELEMENT_EXT_VALUE;
+		o->v.string = (char *) value;
+	} else {
+		o = uci_alloc_element(ctx, option, name, strlen(value) + 1);
+		o->v.string = uci_dataptr(o);
+		strcpy(o->v.string, value);
+	}
 	o->type = UCI_TYPE_STRING;
-	o->v.string = uci_dataptr(o);
 	o->section = s;
-	strcpy(o->v.string, value);
 	uci_list_add(&s->options, &o->e.list);
+	uci_hash_add(&s->hash, &o->e);
 
 	return o;
 }
@@ -97,16 +536,21 @@ uci_free_option(struct uci_option *o)
 {
 	struct uci_element *e, *tmp;
 
+	if ((o->e.type == UCI_TYPE_OPTION) && o->section)
+		uci_hash_del(o->section->hash, &o->e);
+
 	switch(o->type) {
 	case UCI_TYPE_STRING:
 		if ((o->v.string != uci_dataptr(o)) &&
-			(o->v.string != NULL))
+			(o->v.string != NULL) &&
+			!(o->e.flags & UCI_ELEMENT_EXT_VALUE))
 			free(o->v.string);
 		break;
 	case UCI_TYPE_LIST:
 		uci_foreach_element_safe(&o->v.list, tmp, e) {
 			uci_free_element(e);
 		}
+		uci_hash_free(&o->hash);
 		break;
 	default:
 		break;
@@ -114,7 +558,7 @@ uci_free_option(struct uci_option *o)
 	uci_free_element(&o->e);
 }
 
-static struct uci_option *
+__private struct uci_option *
 uci_alloc_list(struct uci_section *s, const char *name)
 {
 	struct uci_package *p = s->package;
@@ -126,26 +570,11 @@ uci_alloc_list(struct uci_section *s, const char *name)
 	o->section = s;
 	uci_list_init(&o->v.list);
 	uci_list_add(&s->options, &o->e.list);
+	uci_hash_add(&s->hash, &o->e);
 
 	return o;
 }
 
-/* Based on an efficient hash function published by D. J. Bernstein */
-static unsigned int djbhash(unsigned int hash, char *str)
-{
-	int len = strlen(str);
-	int i;
-
-	/* initial value */
-	if (hash == ~0U)
-		hash = 5381;
-
-	for(i = 0; i < len; i++) {
-		hash = ((hash << 5) + hash) + str[i];
-	}
-	return (hash & 0x7FFFFFFF);
-}
-
 /* fix up an unnamed section, e.g. after adding options to it */
 static void uci_fixup_section(struct uci_context *ctx, struct uci_section *s)
 {
@@ -179,36 +608,16 @@ static void uci_fixup_section(struct uci_context *ctx, struct uci_section *s)
 		}
 	}
 	sprintf(buf, "cfg%02x%04x", s->package->n_section, hash % (1 << 16));
-	s->e.name = uci_strdup(ctx, buf);
-}
-
-/* fix up option list HEAD pointers and pointer to section in options */
-static void uci_section_fixup_options(struct uci_section *s, bool no_options)
-{
-	struct uci_element *e;
-
-	if (no_options) {
-		/*
-		 * enforce empty list pointer state (s->next == s) when original
-		 * section had no options in the first place
-		 */
-		uci_list_init(&s->options);
-		return;
-	}
-
-	/* fix pointers to HEAD at end/beginning of list */
-	uci_list_fixup(&s->options);
-
-	/* fix back pointer to section in options */
-	uci_foreach_element(&s->options, e) {
-		struct uci_option *o;
-
-		o = uci_to_option(e);
-		o->section = s;
+	if (s->e.flags & UCI_ELEMENT_ARENA) {
+		s->e.name = uci_arena_strdup(ctx, &s->package->arena, buf);
+		s->e.flags |= UCI_ELEMENT_EXT_NAME;
+	} else {
+		s->e.name = uci_strdup(ctx, buf);
 	}
+	uci_hash_add(&s->package->hash, &s->e);
 }
 
-static struct uci_section *
+__private struct uci_section *
 uci_alloc_section(struct uci_package *p, const char *type, const char *name)
 {
 	struct uci_context *ctx = p->ctx;
@@ -217,16 +626,19 @@ uci_alloc_section(struct uci_package *p, const char *type, const char *name)
 	if (name && !name[0])
 		name = NULL;
 
-	s = uci_alloc_element(ctx, section, name, strlen(type) + 1);
+	type = uci_intern(ctx, type);
+	s = uci_alloc_element(ctx, section, name, 0);
+	s->e.flags |= UCI_ELEMENT_EXT_VALUE;
+	s->type = (char *) type;
 	uci_list_init(&s->options);
-	s->type = uci_dataptr(s);
 	s->package = p;
-	strcpy(s->type, type);
 	if (name == NULL)
 		s->anonymous = true;
 	p->n_section++;
 
 	uci_list_add(&p->sections, &s->e.list);
+	uci_hash_add(&p->hash, &s->e);
+	uci_types_add(&p->types, s);
 
 	return s;
 }
@@ -236,11 +648,15 @@ uci_free_section(struct uci_section *s)
 {
 	struct uci_element *o, *tmp;
 
+	uci_hash_del(s->package->hash, &s->e);
+	uci_types_del(s->package->types, s);
+	uci_hash_free(&s->hash);
 	uci_foreach_element_safe(&s->options, tmp, o) {
 		uci_free_option(uci_to_option(o));
 	}
 	if ((s->type != uci_dataptr(s)) &&
-		(s->type != NULL))
+		(s->type != NULL) &&
+		!(s->e.flags & UCI_ELEMENT_EXT_VALUE))
 		free(s->type);
 	uci_free_element(&s->e);
 }
@@ -252,10 +668,20 @@ uci_alloc_package(struct uci_context *ctx, const char *name)
 
 	p = uci_alloc_element(ctx, package, name, 0);
 	p->ctx = ctx;
+	if (ctx->flags & UCI_FLAG_ARENA) {
+		UCI_TRAP_SAVE(ctx, error);
+		uci_arena_alloc(ctx, &p->arena, 0);
+		UCI_TRAP_RESTORE(ctx);
+	}
 	uci_list_init(&p->sections);
 	uci_list_init(&p->delta);
 	uci_list_init(&p->saved_delta);
 	return p;
+
+error:
+	uci_free_element(&p->e);
+	UCI_THROW(ctx, ctx->err);
+	return NULL;
 }
 
 __private void
@@ -268,6 +694,9 @@ uci_free_package(struct uci_package **package)
 		return;
 
 	free(p->path);
+	free(p->stamps);
+	uci_hash_free(&p->hash);
+	uci_types_free(&p->types);
 	uci_foreach_element_safe(&p->sections, tmp, e) {
 		uci_free_section(uci_to_section(e));
 	}
@@ -277,6 +706,9 @@ uci_free_package(struct uci_package **package)
 	uci_foreach_element_safe(&p->saved_delta, tmp, e) {
 		uci_free_delta(uci_to_delta(e));
 	}
+	uci_arena_free(&p->arena);
+	if (p->map)
+		munmap(p->map, p->map_size);
 	uci_free_element(&p->e);
 	*package = NULL;
 }
@@ -297,63 +729,104 @@ uci_free_any(struct uci_element **e)
 	*e = NULL;
 }
 
+/* the number of names compared is added to cmp, unless it is NULL */
 __private struct uci_element *
-uci_lookup_list(struct uci_list *list, const char *name)
+uci_lookup_list_cmp(struct uci_list *list, const char *name, uint64_t *cmp)
 {
+	struct uci_hash **h = uci_list_hash(list);
 	struct uci_element *e;
+	unsigned int n = 0;
+
+	if (h && *h)
+		return uci_hash_find(*h, name, cmp);
 
 	uci_foreach_element(list, e) {
 		if (!strcmp(e->name, name))
-			return e;
+			goto found;
+		n++;
 	}
-	return NULL;
+	e = NULL;
+
+found:
+	if (cmp)
+		*cmp += n + !!e;
+	/* long section or option list, index it for the next lookups */
+	if (h && (n >= UCI_HASH_MIN))
+		uci_hash_build(h, list);
+
+	return e;
 }
 
-static struct uci_element *
-uci_lookup_ext_section(struct uci_context *ctx, struct uci_ptr *ptr)
+/*
+ * split an extended section name "@type[index]" in place,
+ * type is set to NULL if sections of any type match
+ */
+static bool uci_parse_ext_section(char *section, char **type, int *idx)
 {
-	char *idxstr, *t, *section, *name;
-	struct uci_element *e = NULL;
-	struct uci_section *s;
-	int idx, c;
-
-	section = uci_strdup(ctx, ptr->section);
-	name = idxstr = section + 1;
+	char *idxstr, *t, *name;
 
 	if (section[0] != '@')
-		goto error;
+		return false;
 
 	/* parse the section index part */
-	idxstr = strchr(idxstr, '[');
+	name = section + 1;
+	idxstr = strchr(name, '[');
 	if (!idxstr)
-		goto error;
+		return false;
 	*idxstr = 0;
 	idxstr++;
 
 	t = strchr(idxstr, ']');
 	if (!t)
-		goto error;
+		return false;
 	if (t[1] != 0)
-		goto error;
+		return false;
 	*t = 0;
 
 	t = NULL;
-	idx = strtol(idxstr, &t, 10);
+	*idx = strtol(idxstr, &t, 10);
 	if (t && *t)
-		goto error;
+		return false;
 
 	if (!*name)
 		name = NULL;
 	else if (!uci_validate_type(name))
-		goto error;
+		return false;
+
+	*type = name;
+	return true;
+}
+
+/* section types are compared by pointer if type was interned */
+static struct uci_element *
+uci_ext_section_nth(struct uci_package *p, const char *type, int idx, bool interned)
+{
+	struct uci_type_vec *v;
+	struct uci_element *e;
+	struct uci_section *s;
+	int c;
+
+	if (p->types) {
+		v = uci_types_find(p->types, type, interned);
+		if (!v)
+			return NULL;
+
+		/* a negative index counts from the end of the list */
+		if (idx < 0)
+			idx += v->count;
+		if ((idx < 0) || ((unsigned int) idx >= v->count))
+			return NULL;
+
+		return v->e[idx];
+	}
 
 	/* if the given index is negative, it specifies the section number from
 	 * the end of the list */
 	if (idx < 0) {
 		c = 0;
-		uci_foreach_element(&ptr->p->sections, e) {
+		uci_foreach_element(&p->sections, e) {
 			s = uci_to_section(e);
-			if (name && (strcmp(s->type, name) != 0))
+			if (type && (interned ? (s->type != type) : strcmp(s->type, type)))
 				continue;
 
 			c++;
@@ -362,23 +835,42 @@ uci_lookup_ext_section(struct uci_context *ctx, struct uci_ptr *ptr)
 	}
 
 	c = 0;
-	uci_foreach_element(&ptr->p->sections, e) {
+	uci_foreach_element(&p->sections, e) {
 		s = uci_to_section(e);
-		if (name && (strcmp(s->type, name) != 0))
+		if (type && (interned ? (s->type != type) : strcmp(s->type, type)))
 			continue;
 
 		if (idx == c)
-			goto done;
+			return e;
 		c++;
 	}
-	e = NULL;
-	goto done;
 
-error:
-	free(section);
-	memset(ptr, 0, sizeof(struct uci_ptr));
-	UCI_THROW(ctx, UCI_ERR_INVAL);
-done:
+	return NULL;
+}
+
+static struct uci_element *
+uci_lookup_ext_section(struct uci_context *ctx, struct uci_ptr *ptr)
+{
+	struct uci_element *e = NULL;
+	const char *type = NULL;
+	char *section, *name;
+	int idx;
+
+	section = uci_strdup(ctx, ptr->section);
+	if (!uci_parse_ext_section(section, &name, &idx)) {
+		free(section);
+		memset(ptr, 0, sizeof(struct uci_ptr));
+		UCI_THROW(ctx, UCI_ERR_INVAL);
+	}
+
+	/* frozen packages got their index when they were frozen */
+	if (!(ptr->p->e.flags & UCI_ELEMENT_FROZEN))
+		uci_types_build(ptr->p);
+
+	/* no section of an unknown type exists */
+	if (!name || (type = uci_intern_find(ctx, name)))
+		e = uci_ext_section_nth(ptr->p, type, idx, true);
+
 	free(section);
 	if (e)
 		ptr->section = e->name;
@@ -401,6 +893,7 @@ int
 uci_lookup_ptr(struct uci_context *ctx, struct uci_ptr *ptr, char *str, bool extended)
 {
 	struct uci_element *e;
+	uint64_t *cmp;
 
 	UCI_HANDLE_ERR(ctx);
 	UCI_ASSERT(ctx, ptr != NULL);
@@ -409,12 +902,14 @@ uci_lookup_ptr(struct uci_context *ctx, struct uci_ptr *ptr, char *str, bool ext
 		UCI_INTERNAL(uci_parse_ptr, ctx, ptr, str);
 
 	ptr->flags |= UCI_LOOKUP_DONE;
+	UCI_STATS_ADD(ctx, lookups, 1);
+	cmp = UCI_STATS_PTR(ctx, compares);
 
 	/* look up the package first */
 	if (ptr->p)
 		e = &ptr->p->e;
 	else
-		e = uci_lookup_list(&ctx->root, ptr->package);
+		e = uci_lookup_list_cmp(&ctx->root, ptr->package, cmp);
 
 	if (!e) {
 		UCI_INTERNAL(uci_load, ctx, ptr->package, &ptr->p);
@@ -439,7 +934,7 @@ uci_lookup_ptr(struct uci_context *ctx, struct uci_ptr *ptr, char *str, bool ext
 		else
 			UCI_THROW(ctx, UCI_ERR_INVAL);
 	} else {
-		e = uci_lookup_list(&ptr->p->sections, ptr->section);
+		e = uci_lookup_list_cmp(&ptr->p->sections, ptr->section, cmp);
 	}
 
 	if (!e)
@@ -449,7 +944,7 @@ uci_lookup_ptr(struct uci_context *ctx, struct uci_ptr *ptr, char *str, bool ext
 	ptr->s = uci_to_section(e);
 
 	if (ptr->option) {
-		e = uci_lookup_list(&ptr->s->options, ptr->option);
+		e = uci_lookup_list_cmp(&ptr->s->options, ptr->option, cmp);
 		if (!e)
 			goto abort;
 
@@ -508,12 +1003,65 @@ static void uci_add_element_list(struct uci_context *ctx, struct uci_ptr *ptr, b
 
 	e = uci_alloc_generic(ctx, UCI_TYPE_ITEM, ptr->value, sizeof(struct uci_option));
 	uci_list_add(&ptr->o->v.list, &e->list);
+	uci_hash_add(&ptr->o->hash, e);
+}
+
+/* look up a value of a list option, indexing the values of long lists */
+static struct uci_element *uci_lookup_list_value(struct uci_option *o, const char *value)
+{
+	struct uci_element *e;
+	unsigned int n = 0;
+
+	if (o->hash)
+		return uci_hash_find(o->hash, value, NULL);
+
+	uci_foreach_element(&o->v.list, e) {
+		if (!strcmp(e->name, value))
+			return e;
+		n++;
+	}
+
+	if (n >= UCI_HASH_MIN)
+		uci_hash_build(&o->hash, &o->v.list);
+
+	return NULL;
+}
+
+static void uci_free_list_value(struct uci_option *o, struct uci_element *e)
+{
+	uci_hash_del(o->hash, e);
+	uci_free_element(e);
+}
+
+/* remove all entries of a value from a list option */
+static void uci_del_list_value(struct uci_option *o, const char *value)
+{
+	struct uci_element *e, *tmp;
+	unsigned int n = 0;
+
+	if (o->hash) {
+		while ((e = uci_hash_find(o->hash, value, NULL)) != NULL)
+			uci_free_list_value(o, e);
+		return;
+	}
+
+	uci_foreach_element_safe(&o->v.list, tmp, e) {
+		if (!strcmp(e->name, value))
+			uci_free_element(e);
+		else
+			n++;
+	}
+
+	/* long list, index it for the next changes */
+	if (n >= UCI_HASH_MIN)
+		uci_hash_build(&o->hash, &o->v.list);
 }
 
 int uci_rename(struct uci_context *ctx, struct uci_ptr *ptr)
 {
 	/* NB: UCI_INTERNAL use means without delta tracking */
 	bool internal = ctx && ctx->internal;
+	struct uci_hash **h;
 	struct uci_element *e;
 	struct uci_package *p;
 	char *n;
@@ -523,15 +1071,28 @@ int uci_rename(struct uci_context *ctx, struct uci_ptr *ptr)
 	e = uci_expand_ptr(ctx, ptr, true);
 	p = ptr->p;
 
+	UCI_ASSERT_WRITABLE(ctx, p);
 	UCI_ASSERT(ctx, ptr->s);
 	UCI_ASSERT(ctx, ptr->value);
 
 	if (!internal && p->has_delta)
 		uci_add_delta(ctx, &p->delta, UCI_CMD_RENAME, ptr->section, ptr->option, ptr->value);
 
-	n = uci_strdup(ctx, ptr->value);
-	free(e->name);
+	if (e->type == UCI_TYPE_OPTION)
+		n = (char *) uci_intern(ctx, ptr->value);
+	else
+		n = uci_strdup(ctx, ptr->value);
+	h = uci_element_hash(e);
+	if (h)
+		uci_hash_del(*h, e);
+	if (!(e->flags & UCI_ELEMENT_EXT_NAME))
+		free(e->name);
+	e->flags &= ~UCI_ELEMENT_EXT_NAME;
+	if (e->type == UCI_TYPE_OPTION)
+		e->flags |= UCI_ELEMENT_EXT_NAME;
 	e->name = n;
+	if (h)
+		uci_hash_add(h, e);
 
 	if (e->type == UCI_TYPE_SECTION)
 		uci_to_section(e)->anonymous = false;
@@ -547,8 +1108,13 @@ int uci_reorder_section(struct uci_context *ctx, struct uci_section *s, int pos)
 	char order[32];
 
 	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT_WRITABLE(ctx, p);
 
 	changed = uci_list_set_pos(&s->package->sections, &s->e.list, pos);
+	if (changed) {
+		uci_types_del(p->types, s);
+		uci_types_readd(&p->types, s);
+	}
 	if (!internal && p->has_delta && changed) {
 		sprintf(order, "%d", pos);
 		uci_add_delta(ctx, &p->delta, UCI_CMD_REORDER, s->e.name, NULL, order);
@@ -564,6 +1130,7 @@ int uci_add_section(struct uci_context *ctx, struct uci_package *p, const char *
 
 	UCI_HANDLE_ERR(ctx);
 	UCI_ASSERT(ctx, p != NULL);
+	UCI_ASSERT_WRITABLE(ctx, p);
 	s = uci_alloc_section(p, type, NULL);
 	if (s && s->anonymous)
 		uci_fixup_section(ctx, s);
@@ -587,6 +1154,7 @@ int uci_delete(struct uci_context *ctx, struct uci_ptr *ptr)
 	e1 = uci_expand_ptr(ctx, ptr, true);
 	p = ptr->p;
 
+	UCI_ASSERT_WRITABLE(ctx, p);
 	UCI_ASSERT(ctx, ptr->s);
 
 	if (ptr->o && ptr->o->type == UCI_TYPE_LIST && ptr->value && *ptr->value) {
@@ -597,7 +1165,7 @@ int uci_delete(struct uci_context *ctx, struct uci_ptr *ptr)
 			if (index == 0) {
 				if (!internal && p->has_delta)
 					uci_add_delta(ctx, &p->delta, UCI_CMD_REMOVE, ptr->section, ptr->option, ptr->value);
-				uci_free_option(uci_to_option(e2));
+				uci_free_list_value(ptr->o, e2);
 				return 0;
 			}
 			index--;
@@ -619,7 +1187,7 @@ int uci_delete(struct uci_context *ctx, struct uci_ptr *ptr)
 	return 0;
 }
 
-int uci_add_list(struct uci_context *ctx, struct uci_ptr *ptr)
+static int uci_do_add_list(struct uci_context *ctx, struct uci_ptr *ptr, bool unique)
 {
 	/* NB: UCI_INTERNAL use means without delta tracking */
 	bool internal = ctx && ctx->internal;
@@ -629,19 +1197,23 @@ int uci_add_list(struct uci_context *ctx, struct uci_ptr *ptr)
 	UCI_HANDLE_ERR(ctx);
 
 	uci_expand_ptr(ctx, ptr, false);
+	UCI_ASSERT_WRITABLE(ctx, ptr->p);
 	UCI_ASSERT(ctx, ptr->s);
 	UCI_ASSERT(ctx, ptr->value);
 
 	if (ptr->o) {
 		switch (ptr->o->type) {
 		case UCI_TYPE_STRING:
+			if (unique && !strcmp(ptr->o->v.string, ptr->value))
+				return 0;
 			/* we already have a string value, convert that to a list */
 			prev = ptr->o;
 			value2 = ptr->value;
 			ptr->value = ptr->o->v.string;
 			break;
 		case UCI_TYPE_LIST:
-			uci_add_element_list(ctx, ptr, internal);
+			if (!unique || !uci_lookup_list_value(ptr->o, ptr->value))
+				uci_add_element_list(ctx, ptr, internal);
 			return 0;
 		default:
 			UCI_THROW(ctx, UCI_ERR_INVAL);
@@ -660,16 +1232,26 @@ int uci_add_list(struct uci_context *ctx, struct uci_ptr *ptr)
 	return 0;
 }
 
+int uci_add_list(struct uci_context *ctx, struct uci_ptr *ptr)
+{
+	return uci_do_add_list(ctx, ptr, false);
+}
+
+int uci_add_list_unique(struct uci_context *ctx, struct uci_ptr *ptr)
+{
+	return uci_do_add_list(ctx, ptr, true);
+}
+
 int uci_del_list(struct uci_context *ctx, struct uci_ptr *ptr)
 {
 	/* NB: pass on internal flag to uci_del_element */
 	bool internal = ctx && ctx->internal;
-	struct uci_element *e, *tmp;
 	struct uci_package *p;
 
 	UCI_HANDLE_ERR(ctx);
 
 	uci_expand_ptr(ctx, ptr, false);
+	UCI_ASSERT_WRITABLE(ctx, ptr->p);
 	UCI_ASSERT(ctx, ptr->s);
 	UCI_ASSERT(ctx, ptr->value);
 
@@ -683,11 +1265,7 @@ int uci_del_list(struct uci_context *ctx, struct uci_ptr *ptr)
 	if (!internal && p->has_delta)
 		uci_add_delta(ctx, &p->delta, UCI_CMD_LIST_DEL, ptr->section, ptr->option, ptr->value);
 
-	uci_foreach_element_safe(&ptr->o->v.list, tmp, e) {
-		if (!strcmp(ptr->value, uci_to_option(e)->e.name)) {
-			uci_free_option(uci_to_option(e));
-		}
-	}
+	uci_del_list_value(ptr->o, ptr->value);
 
 	return 0;
 }
@@ -699,6 +1277,7 @@ int uci_set(struct uci_context *ctx, struct uci_ptr *ptr)
 
 	UCI_HANDLE_ERR(ctx);
 	uci_expand_ptr(ctx, ptr, false);
+	UCI_ASSERT_WRITABLE(ctx, ptr->p);
 	UCI_ASSERT(ctx, ptr->value);
 	UCI_ASSERT(ctx, ptr->s || (!ptr->option && ptr->section));
 	if (!ptr->option && ptr->value[0]) {
@@ -736,22 +1315,15 @@ int uci_set(struct uci_context *ctx, struct uci_ptr *ptr)
 		uci_free_option(o);
 		ptr->last = &ptr->o->e;
 	} else if (ptr->s && ptr->section) { /* update section */
-		char *s = uci_strdup(ctx, ptr->value);
-
-		if (ptr->s->type == uci_dataptr(ptr->s)) {
-			/* drop the in-section storage of type name */
-			bool no_options;
-
-			no_options = uci_list_empty(&ptr->s->options);
-			ptr->last = NULL;
-			ptr->last = uci_realloc(ctx, ptr->s, sizeof(struct uci_section));
-			ptr->s = uci_to_section(ptr->last);
-			uci_list_fixup(&ptr->s->e.list);
-			uci_section_fixup_options(ptr->s, no_options);
-		} else {
-			free(ptr->s->type);
+		/* section types are interned, the old one stays in the table */
+		const char *type = uci_intern(ctx, ptr->value);
+
+		if (ptr->s->type != type) {
+			uci_types_del(ptr->p->types, ptr->s);
+			ptr->s->type = (char *) type;
+			uci_types_readd(&ptr->p->types, ptr->s);
 		}
-		ptr->s->type = s;
+		ptr->last = &ptr->s->e;
 	} else {
 		UCI_THROW(ctx, UCI_ERR_INVAL);
 	}
@@ -771,3 +1343,118 @@ int uci_unload(struct uci_context *ctx, struct uci_package *p)
 	return 0;
 }
 
+
+/* build the index of a list now if a lookup could build it later */
+static bool uci_freeze_list(struct uci_hash **hp, struct uci_list *list)
+{
+	struct uci_element *e;
+	unsigned int n = 0;
+
+	if (*hp)
+		return true;
+
+	uci_foreach_element(list, e)
+		n++;
+
+	if (n < UCI_HASH_MIN)
+		return true;
+
+	uci_hash_build(hp, list);
+	return !!*hp;
+}
+
+int uci_freeze(struct uci_context *ctx, struct uci_package *p)
+{
+	struct uci_element *e;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, p != NULL);
+
+	/* lookups must not modify anything once other threads can see it */
+	if (!uci_freeze_list(&p->hash, &p->sections))
+		UCI_THROW(ctx, UCI_ERR_MEM);
+	uci_types_build(p);
+	if (!p->types)
+		UCI_THROW(ctx, UCI_ERR_MEM);
+
+	uci_foreach_element(&p->sections, e) {
+		struct uci_section *s = uci_to_section(e);
+
+		if (!uci_freeze_list(&s->hash, &s->options))
+			UCI_THROW(ctx, UCI_ERR_MEM);
+	}
+
+	p->e.flags |= UCI_ELEMENT_FROZEN;
+	return 0;
+}
+
+struct uci_section *uci_frozen_section(struct uci_package *p, const char *name)
+{
+	struct uci_element *e = uci_lookup_list(&p->sections, name);
+
+	return e ? uci_to_section(e) : NULL;
+}
+
+struct uci_option *uci_frozen_option(struct uci_section *s, const char *name)
+{
+	struct uci_element *e = uci_lookup_list(&s->options, name);
+
+	return e ? uci_to_option(e) : NULL;
+}
+
+int uci_frozen_lookup_ptr(struct uci_package *p, struct uci_ptr *ptr, char *str)
+{
+	struct uci_element *e;
+
+	if (!p || !ptr)
+		return UCI_ERR_INVAL;
+
+	if (str && !uci_split_ptr(ptr, str))
+		return UCI_ERR_PARSE;
+
+	if (ptr->package && strcmp(ptr->package, p->e.name) != 0)
+		return UCI_ERR_NOTFOUND;
+
+	ptr->flags |= UCI_LOOKUP_DONE;
+	ptr->p = p;
+	ptr->last = &p->e;
+
+	if (!ptr->section && !ptr->s)
+		goto complete;
+
+	if (ptr->s) {
+		e = &ptr->s->e;
+	} else if (ptr->flags & UCI_LOOKUP_EXTENDED) {
+		char *section = alloca(strlen(ptr->section) + 1);
+		char *type;
+		int idx;
+
+		if (!uci_parse_ext_section(strcpy(section, ptr->section), &type, &idx))
+			return UCI_ERR_INVAL;
+
+		e = uci_ext_section_nth(p, type, idx, false);
+		if (e)
+			ptr->section = e->name;
+	} else {
+		e = uci_lookup_list(&p->sections, ptr->section);
+	}
+
+	if (!e)
+		return UCI_OK;
+
+	ptr->last = e;
+	ptr->s = uci_to_section(e);
+
+	if (ptr->option) {
+		e = uci_lookup_list(&ptr->s->options, ptr->option);
+		if (!e)
+			return UCI_OK;
+
+		ptr->o = uci_to_option(e);
+		ptr->last = e;
+	}
+
+complete:
+	ptr->flags |= UCI_LOOKUP_COMPLETE;
+	return UCI_OK;
+}
@@ -26,6 +26,12 @@
 
 #define MODNAME        "uci"
 #define METANAME       MODNAME ".meta"
+#define PKGMETANAME    MODNAME ".package"
+#define SECMETANAME    MODNAME ".section"
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#endif
 //#define DEBUG 1
 
 #ifdef DEBUG
@@ -58,7 +64,86 @@ static void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
 
 #endif
 
+/*
+ * packages the script unloaded without pending changes are kept in a per
+ * cursor cache instead of being freed. loading them again only re-parses
+ * the config when it or one of its delta files changed on disk
+ */
+struct uci_lua_cursor {
+	struct uci_context *ctx;
+	struct uci_list cache;
+};
+
 static struct uci_context *global_ctx = NULL;
+static struct uci_list global_cache = { &global_cache, &global_cache };
+
+static struct uci_list *
+uci_lua_cache(struct uci_context **ctx)
+{
+	if (ctx == &global_ctx)
+		return &global_cache;
+
+	return &((struct uci_lua_cursor *) ctx)->cache;
+}
+
+/* unlink a package from its current list and append it to head */
+static void
+uci_lua_move(struct uci_list *head, struct uci_element *e)
+{
+	e->list.prev->next = e->list.next;
+	e->list.next->prev = e->list.prev;
+	e->list.next = head;
+	e->list.prev = head->prev;
+	head->prev->next = &e->list;
+	head->prev = &e->list;
+}
+
+/* unload a package, keep it in the cache if it has no unsaved changes */
+static void
+uci_lua_release(struct uci_context **ctx, struct uci_package *p)
+{
+	if (!uci_list_empty(&p->delta)) {
+		uci_unload(*ctx, p);
+		return;
+	}
+
+	uci_lua_move(uci_lua_cache(ctx), &p->e);
+}
+
+/* bring a cached package back if it is still up to date, drop it otherwise */
+static struct uci_package *
+uci_lua_restore(struct uci_context **ctx, const char *name)
+{
+	struct uci_element *e, *tmp;
+	bool stale = true;
+
+	uci_foreach_element_safe(uci_lua_cache(ctx), tmp, e) {
+		struct uci_package *p = uci_to_package(e);
+
+		if (strcmp(e->name, name) != 0)
+			continue;
+
+		uci_package_stale(*ctx, p, &stale);
+		if (stale) {
+			uci_unload(*ctx, p);
+			return NULL;
+		}
+
+		uci_lua_move(&(*ctx)->root, e);
+		return p;
+	}
+
+	return NULL;
+}
+
+static void
+uci_lua_flush(struct uci_context **ctx)
+{
+	struct uci_element *e, *tmp;
+
+	uci_foreach_element_safe(uci_lua_cache(ctx), tmp, e)
+		uci_unload(*ctx, uci_to_package(e));
+}
 
 static struct uci_context *
 find_context(lua_State *L, int *offset)
@@ -87,9 +172,19 @@ find_context(lua_State *L, int *offset)
 	return *ctx;
 }
 
+static struct uci_context **
+find_context_ptr(lua_State *L, int offset)
+{
+	if (offset)
+		return lua_touserdata(L, 1);
+
+	return &global_ctx;
+}
+
 static struct uci_package *
-find_package(lua_State *L, struct uci_context *ctx, const char *str, bool al)
+find_package(lua_State *L, struct uci_context **ctxp, const char *str, bool al)
 {
+	struct uci_context *ctx = *ctxp;
 	struct uci_package *p = NULL;
 	struct uci_element *e;
 	char *sep;
@@ -115,7 +210,11 @@ find_package(lua_State *L, struct uci_context *ctx, const char *str, bool al)
 		goto done;
 	}
 
-	if (al)
+	if (!al)
+		goto done;
+
+	p = uci_lua_restore(ctxp, name);
+	if (!p)
 		uci_load(ctx, name, &p);
 
 done:
@@ -166,7 +265,7 @@ lookup_args(lua_State *L, struct uci_context *ctx, int offset, struct uci_ptr *p
 		goto error;
 
 	memset(ptr, 0, sizeof(struct uci_ptr));
-	if (!find_package(L, ctx, s, true))
+	if (!find_package(L, find_context_ptr(L, offset), s, true))
 		goto error;
 
 	switch (n - offset) {
@@ -289,9 +388,9 @@ uci_lua_unload(lua_State *L)
 	ctx = find_context(L, &offset);
 	luaL_checkstring(L, 1 + offset);
 	s = lua_tostring(L, 1 + offset);
-	p = find_package(L, ctx, s, false);
+	p = find_package(L, find_context_ptr(L, offset), s, false);
 	if (p) {
-		uci_unload(ctx, p);
+		uci_lua_release(find_context_ptr(L, offset), p);
 		return uci_push_status(L, ctx, false);
 	} else {
 		lua_pushboolean(L, 0);
@@ -305,14 +404,26 @@ uci_lua_load(lua_State *L)
 	struct uci_context *ctx;
 	struct uci_package *p = NULL;
 	const char *s;
+	bool stale = true;
 	int offset = 0;
 
 	ctx = find_context(L, &offset);
-	uci_lua_unload(L);
-	lua_pop(L, 1); /* bool ret value of unload */
-	s = lua_tostring(L, -1);
+	luaL_checkstring(L, 1 + offset);
+	s = lua_tostring(L, 1 + offset);
+
+	/* only re-parse if the package has changes or changed on disk */
+	p = find_package(L, find_context_ptr(L, offset), s, false);
+	if (p) {
+		if (uci_list_empty(&p->delta))
+			uci_package_stale(ctx, p, &stale);
+		if (!stale) {
+			lua_pushboolean(L, 1);
+			return 1;
+		}
+		uci_unload(ctx, p);
+	}
 
-	uci_load(ctx, s, &p);
+	find_package(L, find_context_ptr(L, offset), s, true);
 	return uci_push_status(L, ctx, false);
 }
 
@@ -320,7 +431,6 @@ uci_lua_load(lua_State *L)
 static int
 uci_lua_foreach(lua_State *L)
 {
-	struct uci_context *ctx;
 	struct uci_package *p;
 	struct uci_element *e, *tmp;
 	const char *package, *type;
@@ -328,7 +438,7 @@ uci_lua_foreach(lua_State *L)
 	int offset = 0;
 	int i = 0;
 
-	ctx = find_context(L, &offset);
+	find_context(L, &offset);
 	package = luaL_checkstring(L, 1 + offset);
 
 	if (lua_isnil(L, 2 + offset))
@@ -339,7 +449,7 @@ uci_lua_foreach(lua_State *L)
 	if (!lua_isfunction(L, 3 + offset) || !package)
 		return luaL_error(L, "Invalid argument");
 
-	p = find_package(L, ctx, package, true);
+	p = find_package(L, find_context_ptr(L, offset), package, true);
 	if (!p)
 		goto done;
 
@@ -444,6 +554,379 @@ uci_lua_get_all(lua_State *L)
 	return uci_lua_get_any(L, true);
 }
 
+/*
+ * lazy package and section handles. they only store the names and look up
+ * the package and section again on every access, so they stay safe when the
+ * tree changes underneath. values are converted when they are read
+ */
+struct uci_lua_proxy {
+	struct uci_context **ctx;
+	int ref; /* keeps the cursor alive, LUA_NOREF for the global context */
+	const char *section; /* NULL for a package handle */
+	char package[];
+};
+
+static const char *uci_lua_section_keys[] = {
+	".anonymous", ".type", ".name", ".index",
+};
+
+/* push a new handle, cursor is the stack index of the cursor object or 0 */
+static void
+uci_push_proxy(lua_State *L, struct uci_context **ctx, int cursor,
+	       const char *package, const char *section)
+{
+	struct uci_lua_proxy *px;
+	size_t len = strlen(package) + 1;
+	int ref = LUA_NOREF;
+
+	if (cursor) {
+		lua_pushvalue(L, cursor);
+		ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	px = lua_newuserdata(L, sizeof(*px) + len + (section ? strlen(section) + 1 : 0));
+	px->ctx = ctx;
+	px->ref = ref;
+	strcpy(px->package, package);
+	px->section = NULL;
+	if (section)
+		px->section = strcpy(px->package + len, section);
+	luaL_getmetatable(L, section ? SECMETANAME : PKGMETANAME);
+	lua_setmetatable(L, -2);
+}
+
+static void
+uci_push_section_proxy(lua_State *L, struct uci_lua_proxy *px, const char *section)
+{
+	int cursor = 0;
+
+	if (px->ref != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, px->ref);
+		cursor = lua_gettop(L);
+	}
+	uci_push_proxy(L, px->ctx, cursor, px->package, section);
+	if (cursor)
+		lua_remove(L, cursor);
+}
+
+static struct uci_package *
+uci_lua_proxy_package(lua_State *L, struct uci_lua_proxy *px)
+{
+	if (!*px->ctx) {
+		luaL_error(L, "UCI context was closed");
+		return NULL;
+	}
+
+	return find_package(L, px->ctx, px->package, true);
+}
+
+static struct uci_section *
+uci_lua_proxy_section(lua_State *L, struct uci_lua_proxy *px)
+{
+	struct uci_package *p = uci_lua_proxy_package(L, px);
+	struct uci_element *e = NULL;
+
+	if (!p || uci_lookup_next(*px->ctx, &e, &p->sections, px->section))
+		return NULL;
+
+	return uci_to_section(e);
+}
+
+static struct uci_element *
+uci_lua_next_element(struct uci_list *list, struct uci_element *e)
+{
+	if (e->list.next == list)
+		return NULL;
+
+	return list_to_element(e->list.next);
+}
+
+static void
+uci_push_section_key(lua_State *L, struct uci_section *s, unsigned int key)
+{
+	struct uci_element *e;
+	int i = 0;
+
+	switch (key) {
+	case 0:
+		lua_pushboolean(L, s->anonymous);
+		break;
+	case 1:
+		lua_pushstring(L, s->type);
+		break;
+	case 2:
+		lua_pushstring(L, s->e.name);
+		break;
+	default:
+		uci_foreach_element(&s->package->sections, e) {
+			if (e == &s->e)
+				break;
+			i++;
+		}
+		lua_pushinteger(L, i);
+		break;
+	}
+}
+
+/* iterate over the section keys first, then over the options */
+static int
+uci_lua_section_next(lua_State *L)
+{
+	struct uci_lua_proxy *px = luaL_checkudata(L, 1, SECMETANAME);
+	const char *key = lua_tostring(L, 2);
+	struct uci_section *s = uci_lua_proxy_section(L, px);
+	struct uci_element *e = NULL;
+	unsigned int i = 0;
+
+	if (!s)
+		return 0;
+
+	if (key) {
+		for (i = 0; i < ARRAY_SIZE(uci_lua_section_keys); i++) {
+			if (!strcmp(key, uci_lua_section_keys[i]))
+				break;
+		}
+		if (i < ARRAY_SIZE(uci_lua_section_keys)) {
+			i++;
+		} else {
+			if (uci_lookup_next(*px->ctx, &e, &s->options, key))
+				return 0;
+			e = uci_lua_next_element(&s->options, e);
+			if (!e)
+				return 0;
+		}
+	}
+
+	if (!e && (i < ARRAY_SIZE(uci_lua_section_keys))) {
+		lua_pushstring(L, uci_lua_section_keys[i]);
+		uci_push_section_key(L, s, i);
+		return 2;
+	}
+
+	if (!e) {
+		if (uci_list_empty(&s->options))
+			return 0;
+		e = list_to_element(s->options.next);
+	}
+
+	lua_pushstring(L, e->name);
+	uci_push_option(L, uci_to_option(e));
+	return 2;
+}
+
+static int
+uci_lua_package_next(lua_State *L)
+{
+	struct uci_lua_proxy *px = luaL_checkudata(L, 1, PKGMETANAME);
+	const char *key = lua_tostring(L, 2);
+	struct uci_package *p = uci_lua_proxy_package(L, px);
+	struct uci_element *e = NULL;
+
+	if (!p)
+		return 0;
+
+	if (key) {
+		if (uci_lookup_next(*px->ctx, &e, &p->sections, key))
+			return 0;
+		e = uci_lua_next_element(&p->sections, e);
+	} else if (!uci_list_empty(&p->sections)) {
+		e = list_to_element(p->sections.next);
+	}
+	if (!e)
+		return 0;
+
+	lua_pushstring(L, e->name);
+	uci_push_section_proxy(L, px, e->name);
+	return 2;
+}
+
+static int
+uci_lua_package_pairs(lua_State *L)
+{
+	luaL_checkudata(L, 1, PKGMETANAME);
+	lua_pushcfunction(L, uci_lua_package_next);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+static int
+uci_lua_section_pairs(lua_State *L)
+{
+	luaL_checkudata(L, 1, SECMETANAME);
+	lua_pushcfunction(L, uci_lua_section_next);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+/*
+ * lua 5.1 ignores __pairs, handle:pairs() returns the same iterator on
+ * every version. the method hides a section or option named pairs
+ */
+static bool
+uci_lua_proxy_method(lua_State *L, const char *key, lua_CFunction pairs)
+{
+	if (!key || strcmp(key, "pairs") != 0)
+		return false;
+
+	lua_pushcfunction(L, pairs);
+	return true;
+}
+
+static int
+uci_lua_section_index(lua_State *L)
+{
+	struct uci_lua_proxy *px = luaL_checkudata(L, 1, SECMETANAME);
+	const char *key = lua_tostring(L, 2);
+	struct uci_section *s;
+	struct uci_element *e = NULL;
+	unsigned int i;
+
+	if (uci_lua_proxy_method(L, key, uci_lua_section_pairs))
+		return 1;
+
+	s = key ? uci_lua_proxy_section(L, px) : NULL;
+	if (!s)
+		return 0;
+
+	if (key[0] == '.') {
+		for (i = 0; i < ARRAY_SIZE(uci_lua_section_keys); i++) {
+			if (strcmp(key, uci_lua_section_keys[i]) != 0)
+				continue;
+
+			uci_push_section_key(L, s, i);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (uci_lookup_next(*px->ctx, &e, &s->options, key))
+		return 0;
+
+	uci_push_option(L, uci_to_option(e));
+	return 1;
+}
+
+static int
+uci_lua_package_index(lua_State *L)
+{
+	struct uci_lua_proxy *px = luaL_checkudata(L, 1, PKGMETANAME);
+	const char *key = lua_tostring(L, 2);
+	struct uci_package *p;
+	struct uci_element *e = NULL;
+
+	if (uci_lua_proxy_method(L, key, uci_lua_package_pairs))
+		return 1;
+
+	p = key ? uci_lua_proxy_package(L, px) : NULL;
+	if (!p || uci_lookup_next(*px->ctx, &e, &p->sections, key))
+		return 0;
+
+	uci_push_section_proxy(L, px, e->name);
+	return 1;
+}
+
+static int
+uci_lua_proxy_gc(lua_State *L)
+{
+	struct uci_lua_proxy *px = lua_touserdata(L, 1);
+
+	luaL_unref(L, LUA_REGISTRYINDEX, px->ref);
+	return 0;
+}
+
+static int
+uci_lua_get_lazy(lua_State *L)
+{
+	struct uci_context *ctx;
+	struct uci_ptr ptr;
+	int offset = 0;
+	char *s = NULL;
+
+	ctx = find_context(L, &offset);
+
+	if (lookup_args(L, ctx, offset, &ptr, &s))
+		goto error;
+
+	lookup_ptr(ctx, &ptr, NULL, true);
+	if (!(ptr.flags & UCI_LOOKUP_COMPLETE)) {
+		ctx->err = UCI_ERR_NOTFOUND;
+		goto error;
+	}
+
+	switch(ptr.last->type) {
+	case UCI_TYPE_PACKAGE:
+		uci_push_proxy(L, find_context_ptr(L, offset), offset, ptr.p->e.name, NULL);
+		break;
+	case UCI_TYPE_SECTION:
+		uci_push_proxy(L, find_context_ptr(L, offset), offset, ptr.p->e.name, ptr.s->e.name);
+		break;
+	case UCI_TYPE_OPTION:
+		uci_push_option(L, ptr.o);
+		break;
+	default:
+		ctx->err = UCI_ERR_INVAL;
+		goto error;
+	}
+	free(s);
+	return 1;
+
+error:
+	free(s);
+	lua_pushnil(L);
+	return uci_push_status(L, ctx, true);
+}
+
+static int
+uci_lua_foreach_lazy(lua_State *L)
+{
+	struct uci_package *p;
+	struct uci_element *e, *tmp;
+	const char *package, *type;
+	bool ret = false;
+	int offset = 0;
+
+	find_context(L, &offset);
+	package = luaL_checkstring(L, 1 + offset);
+
+	if (lua_isnil(L, 2 + offset))
+		type = NULL;
+	else
+		type = luaL_checkstring(L, 2 + offset);
+
+	if (!lua_isfunction(L, 3 + offset) || !package)
+		return luaL_error(L, "Invalid argument");
+
+	p = find_package(L, find_context_ptr(L, offset), package, true);
+	if (!p)
+		goto done;
+
+	uci_foreach_element_safe(&p->sections, tmp, e) {
+		struct uci_section *s = uci_to_section(e);
+
+		if (type && (strcmp(s->type, type) != 0))
+			continue;
+
+		lua_pushvalue(L, 3 + offset); /* iterator function */
+		uci_push_proxy(L, find_context_ptr(L, offset), offset, p->e.name, s->e.name);
+		if (lua_pcall(L, 1, 1, 0) == 0) {
+			ret = true;
+			if (lua_isboolean(L, -1) && !lua_toboolean(L, -1))
+				break;
+		}
+		else
+		{
+			lua_error(L);
+			break;
+		}
+	}
+
+done:
+	lua_pushboolean(L, ret);
+	return 1;
+}
+
 static int
 uci_lua_add(lua_State *L)
 {
@@ -458,7 +941,7 @@ uci_lua_add(lua_State *L)
 	ctx = find_context(L, &offset);
 	package = luaL_checkstring(L, 1 + offset);
 	type = luaL_checkstring(L, 2 + offset);
-	p = find_package(L, ctx, package, true);
+	p = find_package(L, find_context_ptr(L, offset), package, true);
 	if (!p)
 		goto fail;
 
@@ -698,6 +1181,30 @@ enum pkg_cmd {
 	CMD_REVERT
 };
 
+static void
+uci_lua_commit_all(struct uci_context *ctx)
+{
+	struct uci_package **packages;
+	struct uci_element *e;
+	int n = 0;
+
+	uci_foreach_element(&ctx->root, e)
+		n++;
+
+	packages = calloc(n + 1, sizeof(struct uci_package *));
+	if (!packages) {
+		ctx->err = UCI_ERR_MEM;
+		return;
+	}
+
+	n = 0;
+	uci_foreach_element(&ctx->root, e)
+		packages[n++] = uci_to_package(e);
+
+	uci_commit_many(ctx, packages, n, false);
+	free(packages);
+}
+
 static int
 uci_lua_package_cmd(lua_State *L, enum pkg_cmd cmd)
 {
@@ -717,6 +1224,12 @@ uci_lua_package_cmd(lua_State *L, enum pkg_cmd cmd)
 
 	lookup_ptr(ctx, &ptr, NULL, true);
 
+	/* commit all loaded packages at once */
+	if ((cmd == CMD_COMMIT) && !ptr.p) {
+		uci_lua_commit_all(ctx);
+		goto err;
+	}
+
 	uci_foreach_element_safe(&ctx->root, tmp, e) {
 		struct uci_package *p = uci_to_package(e);
 
@@ -830,7 +1343,7 @@ uci_lua_add_change(lua_State *L, struct uci_element *e)
 }
 
 static void
-uci_lua_changes_pkg(lua_State *L, struct uci_context *ctx, const char *package)
+uci_lua_changes_pkg(lua_State *L, struct uci_context **ctx, const char *package)
 {
 	struct uci_package *p = NULL;
 	struct uci_element *e;
@@ -858,7 +1371,7 @@ uci_lua_changes_pkg(lua_State *L, struct uci_context *ctx, const char *package)
 
 done:
 	if (autoload)
-		uci_unload(ctx, p);
+		uci_lua_release(ctx, p);
 }
 
 static int
@@ -883,15 +1396,20 @@ uci_lua_changes(lua_State *L)
 
 	lua_newtable(L);
 	if (package) {
-		uci_lua_changes_pkg(L, ctx, package);
+		uci_lua_changes_pkg(L, find_context_ptr(L, offset), package);
 		return 1;
 	}
 
 	if ((uci_list_configs(ctx, &config) != UCI_OK) || !config)
 		return 1;
 
+	/* reuse what is cached, parse the rest in one go */
+	for (i = 0; config[i] != NULL; i++)
+		uci_lua_restore(find_context_ptr(L, offset), config[i]);
+	uci_load_all(ctx, config);
+
 	for (i = 0; config[i] != NULL; i++) {
-		uci_lua_changes_pkg(L, ctx, config[i]);
+		uci_lua_changes_pkg(L, find_context_ptr(L, offset), config[i]);
 	}
 
 	free(config);
@@ -914,6 +1432,7 @@ uci_lua_set_confdir(lua_State *L)
 
 	ctx = find_context(L, &offset);
 	luaL_checkstring(L, 1 + offset);
+	uci_lua_flush(find_context_ptr(L, offset));
 	uci_set_confdir(ctx, lua_tostring(L, -1));
 	return uci_push_status(L, ctx, false);
 }
@@ -934,6 +1453,7 @@ uci_lua_add_delta(lua_State *L)
 
 	ctx = find_context(L, &offset);
 	luaL_checkstring(L, 1 + offset);
+	uci_lua_flush(find_context_ptr(L, offset));
 	uci_add_delta_path(ctx, lua_tostring(L, -1));
 	return uci_push_status(L, ctx, false);
 }
@@ -946,6 +1466,7 @@ uci_lua_set_savedir(lua_State *L)
 
 	ctx = find_context(L, &offset);
 	luaL_checkstring(L, 1 + offset);
+	uci_lua_flush(find_context_ptr(L, offset));
 	uci_set_savedir(ctx, lua_tostring(L, -1));
 	return uci_push_status(L, ctx, false);
 }
@@ -984,6 +1505,7 @@ uci_lua_gc(lua_State *L)
 		if (!*ctx)
 			return 0;
 	}
+	uci_lua_flush(ctx);
 	uci_free_context(*ctx);
 	*ctx = NULL;
 	return 0;
@@ -992,13 +1514,16 @@ uci_lua_gc(lua_State *L)
 static int
 uci_lua_cursor(lua_State *L)
 {
+	struct uci_lua_cursor *cur;
 	struct uci_context **u;
 	int argc = lua_gettop(L);
 
-	u = lua_newuserdata(L, sizeof(struct uci_context *));
+	cur = lua_newuserdata(L, sizeof(struct uci_lua_cursor));
+	cur->cache.next = cur->cache.prev = &cur->cache;
 	luaL_getmetatable(L, METANAME);
 	lua_setmetatable(L, -2);
 
+	u = &cur->ctx;
 	*u = uci_alloc_context();
 	if (!*u)
 		return luaL_error(L, "Cannot allocate UCI context");
@@ -1037,6 +1562,8 @@ static const luaL_Reg uci[] = {
 	{ "reorder", uci_lua_reorder },
 	{ "changes", uci_lua_changes },
 	{ "foreach", uci_lua_foreach },
+	{ "get_lazy", uci_lua_get_lazy },
+	{ "foreach_lazy", uci_lua_foreach_lazy },
 	{ "add_history", uci_lua_add_delta },
 	{ "add_delta", uci_lua_add_delta },
 	{ "get_confdir", uci_lua_get_confdir },
@@ -1047,6 +1574,19 @@ static const luaL_Reg uci[] = {
 	{ NULL, NULL },
 };
 
+static const luaL_Reg uci_package_meta[] = {
+	{ "__index", uci_lua_package_index },
+	{ "__pairs", uci_lua_package_pairs },
+	{ "__gc", uci_lua_proxy_gc },
+	{ NULL, NULL },
+};
+
+static const luaL_Reg uci_section_meta[] = {
+	{ "__index", uci_lua_section_index },
+	{ "__pairs", uci_lua_section_pairs },
+	{ "__gc", uci_lua_proxy_gc },
+	{ NULL, NULL },
+};
 
 int
 luaopen_uci(lua_State *L)
@@ -1062,6 +1602,15 @@ luaopen_uci(lua_State *L)
 	luaL_setfuncs(L, uci, 0);
 	lua_pop(L, 1);
 
+	/* metatables of the lazy package and section handles */
+	luaL_newmetatable(L, PKGMETANAME);
+	luaL_setfuncs(L, uci_package_meta, 0);
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, SECMETANAME);
+	luaL_setfuncs(L, uci_section_meta, 0);
+	lua_pop(L, 1);
+
 	/* create module */
 	lua_newtable(L);
 	lua_pushvalue(L, -1);
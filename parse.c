@@ -14,25 +14,36 @@
 
 #include <string.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #include "uci.h"
+#include "uci_internal.h"
 
 void uci_parse_section(struct uci_section *s, const struct uci_parse_option *opts,
 		       int n_opts, struct uci_option **tb)
 {
+	const char **names = alloca(n_opts * sizeof(*names));
 	struct uci_element *e;
+	int i;
 
 	memset(tb, 0, n_opts * sizeof(*tb));
 
+	/*
+	 * option names are interned, resolve the wanted names once so that
+	 * the options can be matched by pointer. a name that is not in the
+	 * table isn't used by any option
+	 */
+	for (i = 0; i < n_opts; i++)
+		names[i] = uci_intern_find(s->package->ctx, opts[i].name);
+
 	uci_foreach_element(&s->options, e) {
 		struct uci_option *o = uci_to_option(e);
-		int i;
 
 		for (i = 0; i < n_opts; i++) {
 			if (tb[i])
 				continue;
 
-			if (strcmp(opts[i].name, o->e.name) != 0)
+			if (names[i] != o->e.name)
 				continue;
 
 			if (opts[i].type != o->type)
@@ -45,11 +56,119 @@ void uci_parse_section(struct uci_section *s, const struct uci_parse_option *opt
 	}
 }
 
+/*
+ * compiled form of a uci_parse_option array: an open addressing table over
+ * the hashes of the distinct option names. entries with the same name are
+ * chained in array order through next[], so that the compiled lookup picks
+ * the same option as uci_parse_section
+ */
+struct uci_parse_slot
+{
+	unsigned int hash;
+	int idx;
+};
+
+struct uci_parse_table
+{
+	const struct uci_parse_option *opts;
+	int n_opts;
+	unsigned int mask;
+	int *next;
+	struct uci_parse_slot slots[];
+};
+
+static struct uci_parse_slot *
+uci_parse_slot(const struct uci_parse_table *t, unsigned int hash, const char *name)
+{
+	const struct uci_parse_slot *slot;
+	unsigned int i;
+
+	for (i = hash & t->mask; ; i = (i + 1) & t->mask) {
+		slot = &t->slots[i];
+		if (slot->idx < 0)
+			break;
+
+		if ((slot->hash == hash) && !strcmp(t->opts[slot->idx].name, name))
+			break;
+	}
+
+	return (struct uci_parse_slot *) slot;
+}
+
+struct uci_parse_table *uci_parse_option_compile(const struct uci_parse_option *opts, int n_opts)
+{
+	struct uci_parse_table *t;
+	unsigned int size = 8;
+	int i, *tail;
+
+	while (size < (unsigned int) n_opts * 2)
+		size *= 2;
+
+	t = calloc(1, sizeof(*t) + size * sizeof(t->slots[0]) + n_opts * sizeof(int));
+	if (!t)
+		return NULL;
+
+	t->opts = opts;
+	t->n_opts = n_opts;
+	t->mask = size - 1;
+	t->next = (int *) &t->slots[size];
+	for (i = 0; i < (int) size; i++)
+		t->slots[i].idx = -1;
+
+	for (i = 0; i < n_opts; i++) {
+		unsigned int hash = djbhash(~0U, opts[i].name);
+		struct uci_parse_slot *slot = uci_parse_slot(t, hash, opts[i].name);
+
+		t->next[i] = -1;
+		if (slot->idx < 0) {
+			slot->hash = hash;
+			slot->idx = i;
+			continue;
+		}
+
+		for (tail = &slot->idx; *tail >= 0; tail = &t->next[*tail]);
+		*tail = i;
+	}
+
+	return t;
+}
+
+void uci_parse_table_free(struct uci_parse_table *t)
+{
+	free(t);
+}
+
+void uci_parse_section_compiled(struct uci_section *s, const struct uci_parse_table *t,
+				struct uci_option **tb)
+{
+	struct uci_element *e;
+
+	memset(tb, 0, t->n_opts * sizeof(*tb));
+
+	uci_foreach_element(&s->options, e) {
+		struct uci_option *o = uci_to_option(e);
+		int i;
+
+		i = uci_parse_slot(t, djbhash(~0U, o->e.name), o->e.name)->idx;
+		for (; i >= 0; i = t->next[i]) {
+			if (tb[i])
+				continue;
+
+			if (t->opts[i].type != o->type)
+				continue;
+
+			/* match found */
+			tb[i] = o;
+			break;
+		}
+	}
+}
+
 //-----------------------------------------------------------------------------
 // MurmurHashNeutral2, by Austin Appleby
 
 // Same as MurmurHash2, but endian- and alignment-neutral.
-static uint32_t hash_murmur2(uint32_t h, const void * key, int len)
+__private uint32_t hash_murmur2(uint32_t h, const void * key, int len)
 {
 	const unsigned char * data = key;
 	const uint32_t m = 0x5bd1e995;
@@ -52,6 +52,16 @@ config_load() {
 	uci_load "$@"
 }
 
+# load a package with a single eval, without running the callbacks
+config_load_eval() {
+	local data
+
+	[ -n "$IPKG_INSTROOT" ] && return 0
+	data="$(uci ${UCI_CONFIG_DIR:+-c "$UCI_CONFIG_DIR"} ${LOAD_STATE:+-P /var/state} \
+		-S -n -d "$LIST_SEP" eval "$1" 2>/dev/null)" || return
+	eval "$data"
+}
+
 reset_cb() {
 	config_cb() { return 0; }
 	option_cb() { return 0; }
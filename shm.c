@@ -0,0 +1,280 @@
+/*
+ * libuci - Library for the Unified Configuration Interface
+ * Copyright (C) 2008 Felix Fietkau <nbd@openwrt.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/*
+ * The shm backend shares parsed packages between processes. It works like
+ * the file backend, but every package is published as a segment in the
+ * cache dir (normally on tmpfs), named <package>.shm:
+ *
+ *   header, [snapshot]
+ *
+ * The snapshot has the same format as the ones of the snapshot cache and
+ * is only valid as long as the stamps of the config and delta files match.
+ * Segments are never modified, a new one is written and renamed over the
+ * old one, so readers just map them without taking any lock and keep a
+ * consistent copy for as long as they need it.
+ *
+ * Every commit through the shm backend increments the generation of the
+ * package, processes can wait for that on the descriptor returned by
+ * uci_shm_watch instead of polling the config files.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "uci.h"
+#include "uci_internal.h"
+
+#define UCI_SHM_MAGIC	0x55435302
+
+struct uci_shm_header
+{
+	uint32_t magic;
+	uint32_t snapshot;
+	uint64_t generation;
+};
+
+static char *uci_shm_path(struct uci_context *ctx, const char *name)
+{
+	char *path = NULL;
+
+	if (asprintf(&path, "%s/%s.shm", ctx->cachedir, name) < 0)
+		return NULL;
+
+	return path;
+}
+
+static bool uci_shm_read_header(const char *path, struct uci_shm_header *hdr)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	len = pread(fd, hdr, sizeof(*hdr), 0);
+	close(fd);
+
+	return (len == sizeof(*hdr)) && (hdr->magic == UCI_SHM_MAGIC);
+}
+
+/*
+ * write a new segment for a freshly loaded or committed package. the
+ * snapshot is left out if the files are too recent to be trusted, the
+ * segment is then only written to publish a new generation. errors only
+ * mean that other processes have to parse the config themselves
+ */
+static void uci_shm_publish(struct uci_context *ctx, struct uci_package *p, bool bump)
+{
+	struct uci_shm_header hdr = { .magic = UCI_SHM_MAGIC }, old;
+	struct uci_snapshot_key *volatile key = NULL;
+	char *volatile path = NULL;
+	struct uci_buf buf = { 0 };
+	char *tmp = NULL;
+	bool written;
+	int lockfd, fd;
+
+	if (!p->has_delta || !uci_snapshot_dir_ok(ctx->cachedir))
+		return;
+
+	/* serialize the writers, so that no generation gets lost */
+	lockfd = open(ctx->cachedir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (lockfd < 0)
+		return;
+
+	if ((uci_flock(ctx, lockfd, LOCK_EX) < 0) && (errno != ENOSYS))
+		goto out;
+
+	path = uci_shm_path(ctx, p->e.name);
+	if (!path)
+		goto out;
+
+	if (uci_shm_read_header(path, &old))
+		hdr.generation = old.generation;
+	if (bump)
+		hdr.generation++;
+
+	key = uci_snapshot_key(ctx, p->e.name, p->path, false);
+	if (key && (key->n_stamps == p->n_stamps)) {
+		memcpy(key->stamps, p->stamps, p->n_stamps * sizeof(struct uci_stamp));
+		hdr.snapshot = !uci_snapshot_racy(key);
+	}
+	if (!hdr.snapshot && !bump)
+		goto out;
+
+	UCI_TRAP_SAVE(ctx, out);
+	uci_buf_put(ctx, &buf, &hdr, sizeof(hdr));
+	if (hdr.snapshot)
+		uci_snapshot_serialize(ctx, &buf, key, p);
+	UCI_TRAP_RESTORE(ctx);
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+		tmp = NULL;
+		goto out;
+	}
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto out;
+
+	written = uci_buf_write(fd, &buf);
+	close(fd);
+	if (!written || (rename(tmp, path) < 0))
+		unlink(tmp);
+
+out:
+	ctx->err = 0;
+	close(lockfd);
+	free(key);
+	free(path);
+	free(tmp);
+	free(buf.data);
+}
+
+static struct uci_package *uci_shm_attach(struct uci_context *ctx, const char *name)
+{
+	struct uci_snapshot_key *key;
+	struct uci_package *p = NULL;
+	char *filename, *path;
+	size_t size = 0;
+	char *map;
+
+	if (uci_lookup_list(&ctx->root, name))
+		return NULL;
+
+	filename = uci_config_path(ctx, name);
+	key = uci_snapshot_key(ctx, name, filename, true);
+	path = uci_shm_path(ctx, name);
+	if (!key || !path)
+		goto out;
+
+	map = uci_snapshot_map(path, sizeof(struct uci_shm_header), &size);
+	if (!map)
+		goto out;
+
+	if (!((struct uci_shm_header *) map)->snapshot ||
+	    (((struct uci_shm_header *) map)->magic != UCI_SHM_MAGIC)) {
+		munmap(map, size);
+		goto out;
+	}
+
+	p = uci_snapshot_attach(ctx, key, name, map, size, sizeof(struct uci_shm_header));
+	if (p) {
+		p->path = filename;
+		p->has_delta = true;
+		uci_stamp_package(p, key->stamps, key->n_stamps);
+		filename = NULL;
+	}
+
+out:
+	free(filename);
+	free(path);
+	free(key);
+	return p;
+}
+
+static struct uci_package *uci_shm_load(struct uci_context *ctx, const char *name)
+{
+	struct uci_package *p;
+
+	/* configs outside of the config dir are not shared */
+	if ((name[0] == '.') || (name[0] == '/'))
+		return uci_file_backend.load(ctx, name);
+
+	p = uci_shm_attach(ctx, name);
+	if (p)
+		return p;
+
+	p = uci_file_backend.load(ctx, name);
+	if (p)
+		uci_shm_publish(ctx, p, false);
+
+	return p;
+}
+
+static void uci_shm_commit(struct uci_context *ctx, struct uci_package **package, bool overwrite)
+{
+	uci_file_backend.commit(ctx, package, overwrite);
+	if (*package)
+		uci_shm_publish(ctx, *package, true);
+}
+
+static char **uci_shm_list_configs(struct uci_context *ctx)
+{
+	return uci_file_backend.list_configs(ctx);
+}
+
+int uci_shm_generation(struct uci_context *ctx, const char *name, uint64_t *generation)
+{
+	struct uci_shm_header hdr;
+	char *path;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, name != NULL);
+	UCI_ASSERT(ctx, generation != NULL);
+	UCI_ASSERT(ctx, uci_validate_package(name));
+
+	path = uci_shm_path(ctx, name);
+	if (!path)
+		UCI_THROW(ctx, UCI_ERR_MEM);
+
+	*generation = 0;
+	if (uci_shm_read_header(path, &hdr))
+		*generation = hdr.generation;
+	free(path);
+
+	return 0;
+}
+
+int uci_shm_watch(struct uci_context *ctx, int *fd)
+{
+	int ifd;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, fd != NULL);
+
+	if (!uci_snapshot_dir_ok(ctx->cachedir))
+		UCI_THROW(ctx, UCI_ERR_IO);
+
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd < 0)
+		UCI_THROW(ctx, UCI_ERR_IO);
+
+	/* new segments are always renamed into place */
+	if (inotify_add_watch(ifd, ctx->cachedir, IN_MOVED_TO) < 0) {
+		close(ifd);
+		UCI_THROW(ctx, UCI_ERR_IO);
+	}
+
+	*fd = ifd;
+	return 0;
+}
+
+__private UCI_BACKEND(uci_shm_backend, "shm",
+	.load = uci_shm_load,
+	.commit = uci_shm_commit,
+	.list_configs = uci_shm_list_configs,
+);
@@ -0,0 +1,559 @@
+/*
+ * snapshot.c - binary snapshot cache for parsed uci packages
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/*
+ * A snapshot holds a package as it looks after loading the config file
+ * and replaying all delta files, so that it can be restored without
+ * parsing anything. The snapshot is keyed on the stat data of all files
+ * that went into it (config file and delta files, including the ones
+ * that did not exist), it is discarded as soon as any of them changes.
+ *
+ * Layout:
+ *   header, stamps[n_stamps], n_stamps paths, records, 'E'
+ *
+ * All strings are null terminated and referenced in place from the
+ * mapped snapshot. Records:
+ *   'S' <anonymous> type name		section
+ *   'O' name value			string option
+ *   'L' name, followed by 'I' value	list option and its items
+ *   'D' <cmd> <mask> [section] [option] [value]	saved delta
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "uci.h"
+#include "uci_internal.h"
+
+#define UCI_SNAPSHOT_MAGIC	0x55435301
+
+/* files modified more recently than this are not snapshotted */
+#define UCI_SNAPSHOT_RACY	1000000000LL
+
+struct uci_snapshot_header
+{
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t n_stamps;
+	uint32_t n_section;
+};
+
+enum {
+	SNAP_SECTION = (1 << 0),
+	SNAP_OPTION  = (1 << 1),
+	SNAP_VALUE   = (1 << 2),
+};
+
+static void uci_stamp_stat(const struct stat *s, struct uci_stamp *st)
+{
+	st->dev = s->st_dev;
+	st->ino = s->st_ino;
+	st->size = s->st_size;
+	st->mtime = (int64_t) s->st_mtim.tv_sec * 1000000000LL + s->st_mtim.tv_nsec;
+	st->ctime = (int64_t) s->st_ctim.tv_sec * 1000000000LL + s->st_ctim.tv_nsec;
+}
+
+__private bool uci_stamp_file(const char *path, struct uci_stamp *st)
+{
+	struct stat s;
+
+	memset(st, 0, sizeof(*st));
+	if (stat(path, &s) < 0)
+		return (errno == ENOENT);
+
+	uci_stamp_stat(&s, st);
+	return true;
+}
+
+__private void uci_stamp_fd(int fd, struct uci_stamp *st)
+{
+	struct stat s;
+
+	memset(st, 0, sizeof(*st));
+	if (fstat(fd, &s) == 0)
+		uci_stamp_stat(&s, st);
+}
+
+/*
+ * remember the state of the files a package was loaded from, so that
+ * uci_package_stale can tell when they change. a package without stamps
+ * is always stale. the stamp of a config file that was modified just
+ * before it was read can't prove that it is unchanged later on
+ */
+__private void uci_stamp_package(struct uci_package *p, const struct uci_stamp *stamps, unsigned int n)
+{
+	free(p->stamps);
+	p->n_stamps = 0;
+	p->stamp_racy = uci_stamps_racy(stamps, 1);
+	p->stamps = malloc(n * sizeof(struct uci_stamp));
+	if (!p->stamps)
+		return;
+
+	memcpy(p->stamps, stamps, n * sizeof(struct uci_stamp));
+	p->n_stamps = n;
+}
+
+__private bool uci_snapshot_dir_ok(const char *dir)
+{
+	struct stat s;
+
+	if (lstat(dir, &s) < 0) {
+		if ((errno != ENOENT) || (mkdir(dir, UCI_DIRMODE) < 0))
+			return false;
+		if (lstat(dir, &s) < 0)
+			return false;
+	}
+
+	/* never trust a directory that somebody else can write to */
+	return S_ISDIR(s.st_mode) && (s.st_uid == geteuid()) &&
+		!(s.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/*
+ * collect the paths of all files that make up the package, stat them
+ * and derive the snapshot file name. returns NULL if the package
+ * can't be cached
+ */
+__private struct uci_snapshot_key *
+uci_snapshot_key(struct uci_context *ctx, const char *name, const char *filename, bool stamp)
+{
+	struct uci_snapshot_key *key;
+	struct uci_element *e;
+	unsigned int hash = ~0U;
+	unsigned int n = 1, i;
+	size_t len, size;
+	char *ptr;
+
+	len = strlen(filename) + 1;
+	uci_foreach_element(&ctx->delta_path, e) {
+		len += strlen(e->name) + strlen(name) + 2;
+		n++;
+	}
+
+	size = sizeof(*key) + n * (sizeof(char *) + sizeof(struct uci_stamp));
+	size += len + strlen(ctx->cachedir) + strlen(name) + 16;
+	key = calloc(1, size);
+	if (!key)
+		return NULL;
+
+	key->n_stamps = n;
+	key->stamps = (struct uci_stamp *) (key + 1);
+	key->paths = (char **) (key->stamps + n);
+	ptr = (char *) (key->paths + n);
+
+	key->paths[0] = ptr;
+	ptr += sprintf(ptr, "%s", filename) + 1;
+	i = 1;
+	uci_foreach_element(&ctx->delta_path, e) {
+		key->paths[i++] = ptr;
+		ptr += sprintf(ptr, "%s/%s", e->name, name) + 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		hash = djbhash(hash, key->paths[i]);
+		if (stamp && !uci_stamp_file(key->paths[i], &key->stamps[i])) {
+			free(key);
+			return NULL;
+		}
+	}
+
+	key->file = ptr;
+	sprintf(ptr, "%s/%s.%08x", ctx->cachedir, name, hash);
+
+	return key;
+}
+
+static const char *uci_snapshot_str(struct uci_context *ctx, const char **cur, const char *end)
+{
+	const char *str = *cur;
+	const char *nul;
+
+	nul = memchr(str, 0, end - str);
+	if (!nul)
+		UCI_THROW(ctx, UCI_ERR_PARSE);
+
+	*cur = nul + 1;
+	return str;
+}
+
+static int uci_snapshot_byte(struct uci_context *ctx, const char **cur, const char *end)
+{
+	if (*cur >= end)
+		UCI_THROW(ctx, UCI_ERR_PARSE);
+
+	return (unsigned char) *(*cur)++;
+}
+
+static void uci_snapshot_restore(struct uci_context *ctx, struct uci_package *p,
+				 const char *cur, const char *end)
+{
+	struct uci_section *s = NULL;
+	struct uci_option *o = NULL;
+	struct uci_element *e;
+
+	while (1) {
+		const char *section, *option, *value;
+		int cmd, mask;
+
+		switch (uci_snapshot_byte(ctx, &cur, end)) {
+		case 'S':
+			mask = uci_snapshot_byte(ctx, &cur, end);
+			value = uci_snapshot_str(ctx, &cur, end);
+			section = uci_snapshot_str(ctx, &cur, end);
+			s = uci_alloc_section(p, value, section);
+			s->anonymous = !!mask;
+			o = NULL;
+			break;
+		case 'O':
+			option = uci_snapshot_str(ctx, &cur, end);
+			value = uci_snapshot_str(ctx, &cur, end);
+			if (!s)
+				UCI_THROW(ctx, UCI_ERR_PARSE);
+			uci_alloc_option(s, option, value);
+			o = NULL;
+			break;
+		case 'L':
+			option = uci_snapshot_str(ctx, &cur, end);
+			if (!s)
+				UCI_THROW(ctx, UCI_ERR_PARSE);
+			o = uci_alloc_list(s, option);
+			break;
+		case 'I':
+			value = uci_snapshot_str(ctx, &cur, end);
+			if (!o)
+				UCI_THROW(ctx, UCI_ERR_PARSE);
+			e = uci_alloc_generic(ctx, UCI_TYPE_ITEM, value, sizeof(struct uci_option));
+			uci_list_add(&o->v.list, &e->list);
+			break;
+		case 'D':
+			cmd = uci_snapshot_byte(ctx, &cur, end);
+			mask = uci_snapshot_byte(ctx, &cur, end);
+			section = (mask & SNAP_SECTION) ? uci_snapshot_str(ctx, &cur, end) : NULL;
+			option = (mask & SNAP_OPTION) ? uci_snapshot_str(ctx, &cur, end) : NULL;
+			value = (mask & SNAP_VALUE) ? uci_snapshot_str(ctx, &cur, end) : NULL;
+			uci_add_delta(ctx, &p->saved_delta, cmd, section, option, value);
+			break;
+		case 'E':
+			if (cur != end)
+				UCI_THROW(ctx, UCI_ERR_PARSE);
+			return;
+		default:
+			UCI_THROW(ctx, UCI_ERR_PARSE);
+		}
+	}
+}
+
+/*
+ * restore the package as if it was parsed from the mapped snapshot,
+ * so that all strings are referenced instead of copied. takes over
+ * the mapping, also on errors
+ */
+static struct uci_package *
+uci_snapshot_map_package(struct uci_context *ctx, const char *name, char *map, size_t size,
+			 const char *cur, int n_section)
+{
+	struct uci_parse_context *pctx;
+	struct uci_package *p;
+
+	UCI_TRAP_SAVE(ctx, error);
+	uci_cleanup(ctx);
+	uci_alloc_parse_context(ctx);
+	pctx = ctx->pctx;
+	pctx->map = map;
+	pctx->map_len = size;
+	pctx->map_ofs = size;
+	pctx->map_size = size;
+	pctx->package = p = uci_alloc_package(ctx, name);
+	p->map = map;
+	p->map_size = size;
+	pctx->map_size = 0;
+
+	uci_snapshot_restore(ctx, p, cur, map + size);
+	p->n_section = n_section;
+	p->backend = ctx->backend;
+	uci_list_add(&ctx->root, &p->e.list);
+	pctx->package = NULL;
+	UCI_TRAP_RESTORE(ctx);
+
+	uci_cleanup(ctx);
+	return p;
+
+error:
+	/* frees the partially restored package and the mapping */
+	if (!ctx->pctx)
+		munmap(map, size);
+	uci_cleanup(ctx);
+	ctx->err = 0;
+	return NULL;
+}
+
+/*
+ * validate a snapshot that starts at offset ofs of the mapping and restore
+ * the package from it. takes over the mapping, never throws
+ */
+__private struct uci_package *
+uci_snapshot_attach(struct uci_context *ctx, struct uci_snapshot_key *key, const char *name,
+		    char *map, size_t size, size_t ofs)
+{
+	struct uci_snapshot_header hdr;
+	struct uci_package *p;
+	const char *cur, *end;
+	unsigned int i;
+
+	if (size < ofs + sizeof(hdr))
+		goto error;
+
+	/* validate the header and the stamps of all files */
+	memcpy(&hdr, map + ofs, sizeof(hdr));
+	cur = map + ofs + sizeof(hdr);
+	end = map + size;
+	if ((hdr.magic != UCI_SNAPSHOT_MAGIC) ||
+	    (hdr.flags != (ctx->flags & UCI_FLAG_SAVED_DELTA)) ||
+	    (hdr.n_stamps != key->n_stamps) ||
+	    ((size_t) (end - cur) < key->n_stamps * sizeof(struct uci_stamp)))
+		goto error;
+
+	if (memcmp(cur, key->stamps, key->n_stamps * sizeof(struct uci_stamp)) != 0)
+		goto error;
+
+	cur += key->n_stamps * sizeof(struct uci_stamp);
+	for (i = 0; i < key->n_stamps; i++) {
+		size_t len = strlen(key->paths[i]) + 1;
+
+		if (((size_t) (end - cur) < len) || memcmp(cur, key->paths[i], len) != 0)
+			goto error;
+		cur += len;
+	}
+
+	p = uci_snapshot_map_package(ctx, name, map, size, cur, hdr.n_section);
+	if (p)
+		p->has_saved_delta = !!hdr.flags;
+	return p;
+
+error:
+	munmap(map, size);
+	return NULL;
+}
+
+/*
+ * map a file read-only, if it is a regular file owned by us and larger
+ * than min bytes. returns NULL otherwise
+ */
+__private char *uci_snapshot_map(const char *path, size_t min, size_t *size)
+{
+	struct stat st;
+	char *map = NULL;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && (st.st_uid == geteuid()) &&
+	    ((size_t) st.st_size > min)) {
+		*size = st.st_size;
+		map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	return map;
+}
+
+/*
+ * restore a package from its snapshot, if there is a valid one.
+ * never throws, returns NULL if the package needs to be parsed
+ */
+__private struct uci_package *
+uci_snapshot_load(struct uci_context *ctx, struct uci_snapshot_key *key, const char *name)
+{
+	size_t size = 0;
+	char *map;
+
+	if (uci_lookup_list(&ctx->root, name))
+		return NULL;
+
+	map = uci_snapshot_map(key->file, sizeof(struct uci_snapshot_header), &size);
+	if (!map)
+		return NULL;
+
+	return uci_snapshot_attach(ctx, key, name, map, size, 0);
+}
+
+static void uci_snapshot_puts(struct uci_context *ctx, struct uci_buf *buf, const char *str)
+{
+	if (!str)
+		UCI_THROW(ctx, UCI_ERR_INVAL);
+
+	uci_buf_put(ctx, buf, str, strlen(str) + 1);
+}
+
+__private void uci_snapshot_serialize(struct uci_context *ctx, struct uci_buf *buf,
+				      struct uci_snapshot_key *key, struct uci_package *p)
+{
+	struct uci_snapshot_header hdr = {
+		.magic = UCI_SNAPSHOT_MAGIC,
+		.flags = p->has_saved_delta ? UCI_FLAG_SAVED_DELTA : 0,
+		.n_stamps = key->n_stamps,
+		.n_section = p->n_section,
+	};
+	struct uci_element *s, *o, *i, *e;
+	unsigned int n;
+
+	uci_buf_put(ctx, buf, &hdr, sizeof(hdr));
+	uci_buf_put(ctx, buf, key->stamps, key->n_stamps * sizeof(struct uci_stamp));
+	for (n = 0; n < key->n_stamps; n++)
+		uci_snapshot_puts(ctx, buf, key->paths[n]);
+
+	uci_foreach_element(&p->sections, s) {
+		struct uci_section *sec = uci_to_section(s);
+
+		uci_buf_putc(ctx, buf, 'S');
+		uci_buf_putc(ctx, buf, sec->anonymous);
+		uci_snapshot_puts(ctx, buf, sec->type);
+		uci_snapshot_puts(ctx, buf, sec->e.name);
+		uci_foreach_element(&sec->options, o) {
+			struct uci_option *opt = uci_to_option(o);
+
+			switch (opt->type) {
+			case UCI_TYPE_STRING:
+				uci_buf_putc(ctx, buf, 'O');
+				uci_snapshot_puts(ctx, buf, opt->e.name);
+				uci_snapshot_puts(ctx, buf, opt->v.string);
+				break;
+			case UCI_TYPE_LIST:
+				uci_buf_putc(ctx, buf, 'L');
+				uci_snapshot_puts(ctx, buf, opt->e.name);
+				uci_foreach_element(&opt->v.list, i) {
+					uci_buf_putc(ctx, buf, 'I');
+					uci_snapshot_puts(ctx, buf, i->name);
+				}
+				break;
+			default:
+				UCI_THROW(ctx, UCI_ERR_INVAL);
+			}
+		}
+	}
+
+	uci_foreach_element(&p->saved_delta, e) {
+		struct uci_delta *h = uci_to_delta(e);
+		int mask = 0;
+
+		if (h->section)
+			mask |= SNAP_SECTION;
+		if (h->e.name)
+			mask |= SNAP_OPTION;
+		if (h->value)
+			mask |= SNAP_VALUE;
+
+		uci_buf_putc(ctx, buf, 'D');
+		uci_buf_putc(ctx, buf, h->cmd);
+		uci_buf_putc(ctx, buf, mask);
+		if (h->section)
+			uci_snapshot_puts(ctx, buf, h->section);
+		if (h->e.name)
+			uci_snapshot_puts(ctx, buf, h->e.name);
+		if (h->value)
+			uci_snapshot_puts(ctx, buf, h->value);
+	}
+	uci_buf_putc(ctx, buf, 'E');
+}
+
+/*
+ * file times have a limited granularity, a file that was modified very
+ * recently might be modified again without changing its stamp
+ */
+__private bool uci_stamps_racy(const struct uci_stamp *stamps, unsigned int n)
+{
+	struct timespec now;
+	int64_t limit;
+	unsigned int i;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	limit = (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec - UCI_SNAPSHOT_RACY;
+	for (i = 0; i < n; i++) {
+		if ((stamps[i].mtime > limit) || (stamps[i].ctime > limit))
+			return true;
+	}
+
+	return false;
+}
+
+__private bool uci_snapshot_racy(struct uci_snapshot_key *key)
+{
+	return uci_stamps_racy(key->stamps, key->n_stamps);
+}
+
+/*
+ * write the snapshot of a freshly loaded package. the stamps in the key
+ * must have been taken before the files were read. errors are ignored,
+ * the snapshot is just not written then
+ */
+__private void uci_snapshot_store(struct uci_context *ctx, struct uci_snapshot_key *key, struct uci_package *p)
+{
+	struct uci_buf buf = { 0 };
+	char *tmp = NULL;
+	bool written;
+	int fd;
+
+	if (uci_snapshot_racy(key) || !uci_snapshot_dir_ok(ctx->cachedir))
+		return;
+
+	UCI_TRAP_SAVE(ctx, error);
+	uci_snapshot_serialize(ctx, &buf, key, p);
+	UCI_TRAP_RESTORE(ctx);
+
+	if (asprintf(&tmp, "%s.XXXXXX", key->file) < 0)
+		goto error;
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto error;
+
+	written = uci_buf_write(fd, &buf);
+	close(fd);
+	if (!written || (rename(tmp, key->file) < 0))
+		unlink(tmp);
+
+error:
+	ctx->err = 0;
+	free(tmp);
+	free(buf.data);
+}
+
+/* drop the snapshot of a package, called whenever its files change */
+__private void uci_snapshot_invalidate(struct uci_context *ctx, struct uci_package *p)
+{
+	struct uci_snapshot_key *key;
+
+	if (!(ctx->flags & UCI_FLAG_CACHE) || !p->path)
+		return;
+
+	key = uci_snapshot_key(ctx, p->e.name, p->path, false);
+	if (!key)
+		return;
+
+	unlink(key->file);
+	free(key);
+}
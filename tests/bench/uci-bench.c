@@ -0,0 +1,453 @@
+/*
+ * uci-bench - timing of the parse, lookup, delta and commit paths
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#include "uci.h"
+#include "uci_blob.h"
+#include "ucimap.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#define BENCH_PATH 64
+
+static const char *types[] = { "rule", "host", "zone" };
+
+static struct uci_context *ctx;
+static char confdir[] = "/tmp/uci-bench.XXXXXX";
+static char savedir[sizeof(confdir) + 5];
+static char conffile[sizeof(confdir) + 6];
+static char deltafile[sizeof(savedir) + 6];
+
+static int n_sections;
+static int n_items = 8;
+static int n_deltas = 10000;
+static int iterations = 10;
+
+struct bench_section {
+	struct ucimap_section_data map;
+	char *name;
+	bool enabled;
+	int port;
+	char *proto;
+	struct ucimap_list *addr;
+};
+
+static struct uci_optmap bench_options[] = {
+	{
+		UCIMAP_OPTION(struct bench_section, name),
+		.type = UCIMAP_STRING,
+	},
+	{
+		UCIMAP_OPTION(struct bench_section, enabled),
+		.type = UCIMAP_BOOL,
+	},
+	{
+		UCIMAP_OPTION(struct bench_section, port),
+		.type = UCIMAP_INT,
+	},
+	{
+		UCIMAP_OPTION(struct bench_section, proto),
+		.type = UCIMAP_STRING,
+	},
+	{
+		UCIMAP_OPTION(struct bench_section, addr),
+		.type = UCIMAP_LIST | UCIMAP_STRING,
+	},
+};
+
+static int bench_section_init(struct uci_map *map, void *section, struct uci_section *s)
+{
+	return 0;
+}
+
+static int bench_section_add(struct uci_map *map, void *section)
+{
+	return 0;
+}
+
+#define BENCH_SECTIONMAP(_type) { \
+	UCIMAP_SECTION(struct bench_section, map), \
+	.type = _type, \
+	.init = bench_section_init, \
+	.add = bench_section_add, \
+	.options = bench_options, \
+	.n_options = ARRAY_SIZE(bench_options), \
+}
+
+static struct uci_sectionmap bench_smap[] = {
+	BENCH_SECTIONMAP("rule"),
+	BENCH_SECTIONMAP("host"),
+	BENCH_SECTIONMAP("zone"),
+};
+
+static struct uci_sectionmap *bench_smap_list[] = {
+	&bench_smap[0], &bench_smap[1], &bench_smap[2],
+};
+
+static const struct blobmsg_policy bench_policy[] = {
+	{ .name = "name", .type = BLOBMSG_TYPE_STRING },
+	{ .name = "enabled", .type = BLOBMSG_TYPE_BOOL },
+	{ .name = "port", .type = BLOBMSG_TYPE_INT32 },
+	{ .name = "proto", .type = BLOBMSG_TYPE_STRING },
+	{ .name = "addr", .type = BLOBMSG_TYPE_ARRAY },
+};
+
+static const struct uci_blob_param_list bench_params = {
+	.n_params = ARRAY_SIZE(bench_policy),
+	.params = bench_policy,
+};
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* one tab separated line per benchmark, see the header in main() */
+static void bench_report(const char *name, unsigned long ops, uint64_t ns)
+{
+	printf("%s\t%d\t%lu\t%" PRIu64 "\t%" PRIu64 "\n",
+	       name, n_sections, ops, ns, ops ? ns / ops : 0);
+	fflush(stdout);
+}
+
+static void bench_check(int ret, const char *what)
+{
+	if (ret == UCI_OK)
+		return;
+
+	uci_perror(ctx, what);
+	exit(1);
+}
+
+static void bench_generate(void)
+{
+	FILE *f;
+	int i, j;
+
+	f = fopen(conffile, "w");
+	if (!f) {
+		perror(conffile);
+		exit(1);
+	}
+
+	for (i = 0; i < n_sections; i++) {
+		fprintf(f, "config %s 's%d'\n", types[i % ARRAY_SIZE(types)], i);
+		fprintf(f, "\toption name 'section %d'\n", i);
+		fprintf(f, "\toption enabled '%d'\n", i & 1);
+		fprintf(f, "\toption port '%d'\n", i % 65536);
+		fputs("\toption proto 'tcp'\n", f);
+		for (j = 0; j < n_items; j++)
+			fprintf(f, "\tlist addr '10.%d.%d.%d'\n", (i >> 8) & 0xff, i & 0xff, j & 0xff);
+		fputc('\n', f);
+	}
+	fclose(f);
+	unlink(deltafile);
+}
+
+static struct uci_package *bench_load(void)
+{
+	struct uci_package *p = NULL;
+
+	bench_check(uci_load(ctx, "bench", &p), "load");
+	return p;
+}
+
+static void bench_import(void)
+{
+	struct uci_package *p;
+	uint64_t start = bench_now();
+	FILE *f;
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		f = fopen(conffile, "r");
+		if (!f) {
+			perror(conffile);
+			exit(1);
+		}
+		p = NULL;
+		bench_check(uci_import(ctx, f, "bench", &p, true), "import");
+		fclose(f);
+		uci_unload(ctx, p);
+	}
+	bench_report("import", iterations, bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++)
+		uci_unload(ctx, bench_load());
+	bench_report("load", iterations, bench_now() - start);
+}
+
+/* lookup strings get modified in place, so every call works on a copy */
+static void bench_lookup(const char *name, const char *prefix, const char *suffix,
+			 int range, bool extended)
+{
+	struct uci_package *p = bench_load();
+	struct uci_ptr ptr;
+	char path[BENCH_PATH];
+	char (*paths)[BENCH_PATH];
+	uint64_t start;
+	int i;
+
+	paths = calloc(n_sections, sizeof(*paths));
+	if (!paths)
+		exit(1);
+
+	/* stride through the package instead of walking it in order */
+	for (i = 0; i < n_sections; i++)
+		snprintf(paths[i], BENCH_PATH, "%s%d%s", prefix,
+			 (int) (((uint64_t) i * 7919) % range), suffix);
+
+	start = bench_now();
+	for (i = 0; i < n_sections; i++) {
+		memcpy(path, paths[i], BENCH_PATH);
+		bench_check(uci_lookup_ptr(ctx, &ptr, path, extended), name);
+		if (!(ptr.flags & UCI_LOOKUP_COMPLETE)) {
+			fprintf(stderr, "%s: %s not found\n", name, paths[i]);
+			exit(1);
+		}
+	}
+	bench_report(name, n_sections, bench_now() - start);
+
+	free(paths);
+	uci_unload(ctx, p);
+}
+
+/* both return the time they took */
+static uint64_t bench_set(int n)
+{
+	struct uci_ptr ptr;
+	char path[BENCH_PATH];
+	uint64_t start = bench_now();
+	int i;
+
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "bench.s%d.port=%d",
+			 (int) (((uint64_t) i * 7919) % n_sections), i);
+		bench_check(uci_lookup_ptr(ctx, &ptr, path, false), "set");
+		bench_check(uci_set(ctx, &ptr), "set");
+	}
+	return bench_now() - start;
+}
+
+static uint64_t bench_save(struct uci_package *p)
+{
+	uint64_t start = bench_now();
+
+	bench_check(uci_save(ctx, p), "save");
+	return bench_now() - start;
+}
+
+static void bench_delta(void)
+{
+	struct uci_package *p;
+	struct uci_ptr ptr;
+	char path[] = "bench";
+	uint64_t start;
+	int i;
+
+	p = bench_load();
+	bench_report("set", n_sections, bench_set(n_sections));
+	bench_report("save", 1, bench_save(p));
+	uci_unload(ctx, p);
+
+	/* a long history of small saves, as left behind by many uci calls */
+	p = bench_load();
+	for (i = 0; i < n_deltas; i += 100) {
+		bench_set(100);
+		bench_save(p);
+	}
+	uci_unload(ctx, p);
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++)
+		uci_unload(ctx, bench_load());
+	bench_report("load_delta", iterations, bench_now() - start);
+
+	bench_load();
+	start = bench_now();
+	bench_check(uci_lookup_ptr(ctx, &ptr, path, true), "revert");
+	bench_check(uci_revert(ctx, &ptr), "revert");
+	bench_report("revert", 1, bench_now() - start);
+
+	/* the revert reloads the package */
+	uci_unload(ctx, ptr.p);
+}
+
+static void bench_commit(void)
+{
+	struct uci_package *p;
+	uint64_t total = 0, start;
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		p = bench_load();
+		bench_set(n_sections / 10 + 1);
+		bench_save(p);
+
+		start = bench_now();
+		bench_check(uci_commit(ctx, &p, false), "commit");
+		total += bench_now() - start;
+		uci_unload(ctx, p);
+	}
+	bench_report("commit", iterations, total);
+}
+
+static void bench_ucimap(void)
+{
+	struct uci_package *p = bench_load();
+	struct uci_map map;
+	uint64_t start = bench_now();
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		memset(&map, 0, sizeof(map));
+		map.sections = bench_smap_list;
+		map.n_sections = ARRAY_SIZE(bench_smap_list);
+		ucimap_init(&map);
+		ucimap_parse(&map, p);
+		ucimap_cleanup(&map);
+	}
+	bench_report("ucimap_parse", iterations, bench_now() - start);
+	uci_unload(ctx, p);
+}
+
+static void bench_blob(void)
+{
+	struct uci_package *p = bench_load();
+	struct uci_blob_state *st;
+	struct uci_element *e;
+	struct blob_buf b = {};
+	uint64_t start;
+
+	start = bench_now();
+	uci_foreach_element(&p->sections, e) {
+		blob_buf_init(&b, 0);
+		uci_to_blob(&b, uci_to_section(e), &bench_params);
+	}
+	bench_report("to_blob", n_sections, bench_now() - start);
+
+	st = uci_blob_param_compile(&bench_params);
+	if (!st)
+		exit(1);
+
+	start = bench_now();
+	uci_foreach_element(&p->sections, e) {
+		blob_buf_init(&b, 0);
+		uci_to_blob_compiled(&b, uci_to_section(e), st);
+	}
+	bench_report("to_blob_compiled", n_sections, bench_now() - start);
+
+	uci_blob_state_free(st);
+	blob_buf_free(&b);
+	uci_unload(ctx, p);
+}
+
+static void bench_run(void)
+{
+	bench_generate();
+	bench_import();
+	bench_lookup("lookup", "bench.s", ".port", n_sections, false);
+	bench_lookup("lookup_ext", "bench.@rule[", "].port",
+		     (n_sections + ARRAY_SIZE(types) - 1) / ARRAY_SIZE(types), true);
+	bench_ucimap();
+	bench_blob();
+	bench_delta();
+	bench_commit();
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [<options>]\n\n"
+		"Options:\n"
+		"\t-s <list>  comma separated package sizes in sections (default: 1000,10000,100000)\n"
+		"\t-l <count> list items per section (default: 8)\n"
+		"\t-d <count> changes in the delta history (default: 10000)\n"
+		"\t-n <count> iterations of the whole package benchmarks (default: 10)\n"
+		"\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	char *sizes = NULL, *size, *next;
+	int c;
+
+	while ((c = getopt(argc, argv, "s:l:d:n:")) != -1) {
+		switch (c) {
+		case 's':
+			sizes = optarg;
+			break;
+		case 'l':
+			n_items = atoi(optarg);
+			break;
+		case 'd':
+			n_deltas = atoi(optarg);
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	sizes = strdup(sizes ? sizes : "1000,10000,100000");
+
+	if (!mkdtemp(confdir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(savedir, sizeof(savedir), "%s/save", confdir);
+	snprintf(conffile, sizeof(conffile), "%s/bench", confdir);
+	snprintf(deltafile, sizeof(deltafile), "%s/bench", savedir);
+	if (mkdir(savedir, 0700)) {
+		perror(savedir);
+		return 1;
+	}
+
+	ctx = uci_alloc_context();
+	if (!ctx)
+		return 1;
+	uci_set_confdir(ctx, confdir);
+	uci_set_savedir(ctx, savedir);
+
+	printf("benchmark\tsections\tops\ttotal_ns\tns_per_op\n");
+	/* the library uses strtok() itself */
+	for (next = sizes; (size = strsep(&next, ",")) != NULL; ) {
+		n_sections = atoi(size);
+		if (n_sections > 0)
+			bench_run();
+	}
+
+	uci_free_context(ctx);
+	unlink(deltafile);
+	unlink(conffile);
+	rmdir(savedir);
+	rmdir(confdir);
+	free(sizes);
+
+	return 0;
+}
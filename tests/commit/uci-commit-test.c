@@ -0,0 +1,191 @@
+/*
+ * uci-commit-test - checks of the commit paths that the cli can't reach
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "uci.h"
+
+static struct uci_context *ctx;
+static char confdir[] = "/tmp/uci-commit.XXXXXX";
+static char savedir[sizeof(confdir) + 5];
+static char conffile[sizeof(confdir) + 5];
+static char deltafile[sizeof(savedir) + 5];
+static int failed;
+
+static void test_check(int ret, const char *what)
+{
+	if (ret == UCI_OK)
+		return;
+
+	uci_perror(ctx, what);
+	exit(1);
+}
+
+static void test_fail(const char *name, const char *what)
+{
+	fprintf(stderr, "%s: %s\n", name, what);
+	failed++;
+}
+
+/*
+ * write the config and wait until its stamp is no longer racy, so that
+ * the package may take the fast commit path
+ */
+static void test_generate(void)
+{
+	FILE *f;
+
+	f = fopen(conffile, "w");
+	if (!f) {
+		perror(conffile);
+		exit(1);
+	}
+	fputs("config sec 'a'\n\toption o '1'\n", f);
+	fclose(f);
+	unlink(deltafile);
+	sleep(2);
+}
+
+static struct uci_package *test_load(void)
+{
+	struct uci_package *p = NULL;
+
+	test_check(uci_load(ctx, "pkg", &p), "load");
+	return p;
+}
+
+static void test_set(struct uci_package *p, const char *value)
+{
+	struct uci_ptr ptr = {
+		.package = "pkg",
+		.section = "a",
+		.option = "o",
+		.value = value,
+	};
+
+	test_check(uci_lookup_ptr(ctx, &ptr, NULL, false), "set");
+	test_check(uci_set(ctx, &ptr), "set");
+	test_check(uci_save(ctx, p), "save");
+}
+
+/* the committed value has to be in the config and the delta file empty */
+static void test_verify(const char *name, const char *value)
+{
+	struct uci_package *p;
+	struct uci_section *s;
+	const char *v;
+	struct stat st;
+
+	if (!stat(deltafile, &st) && st.st_size)
+		test_fail(name, "changes left in the delta file");
+
+	unlink(deltafile);
+	p = test_load();
+	s = uci_lookup_section(ctx, p, "a");
+	v = s ? uci_lookup_option_string(ctx, s, "o") : NULL;
+	if (!v || strcmp(v, value))
+		test_fail(name, "value not committed");
+	uci_unload(ctx, p);
+}
+
+/* nothing changed since the load, so the commit writes the package as it is */
+static void test_commit_fast(void)
+{
+	struct uci_stats stats;
+	struct uci_package *p;
+
+	test_generate();
+	p = test_load();
+	test_set(p, "2");
+	uci_unload(ctx, p);
+
+	p = test_load();
+	test_check(uci_get_stats(ctx, &stats, true), "stats");
+	test_check(uci_commit(ctx, &p, false), "commit");
+	test_check(uci_get_stats(ctx, &stats, true), "stats");
+	uci_unload(ctx, p);
+	if (stats.parse_lines)
+		test_fail("commit_fast", "config parsed again");
+
+	test_verify("commit_fast", "2");
+}
+
+/*
+ * a package loaded without UCI_FLAG_SAVED_DELTA doesn't know the changes
+ * in the delta file, turning the flag on must not make them look empty
+ */
+static void test_commit_saved_delta_flag(void)
+{
+	struct uci_package *p;
+
+	test_generate();
+	p = test_load();
+	test_set(p, "2");
+	uci_unload(ctx, p);
+
+	ctx->flags &= ~UCI_FLAG_SAVED_DELTA;
+	p = test_load();
+	ctx->flags |= UCI_FLAG_SAVED_DELTA;
+	test_check(uci_commit(ctx, &p, false), "commit");
+	uci_unload(ctx, p);
+	test_verify("commit_saved_delta_flag", "2");
+
+	/* the same for changes saved after the flag was turned on */
+	test_generate();
+	ctx->flags &= ~UCI_FLAG_SAVED_DELTA;
+	p = test_load();
+	ctx->flags |= UCI_FLAG_SAVED_DELTA;
+	test_set(p, "3");
+	test_check(uci_commit(ctx, &p, false), "commit");
+	uci_unload(ctx, p);
+	test_verify("commit_saved_delta_flag", "3");
+}
+
+int main(void)
+{
+	if (!mkdtemp(confdir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(savedir, sizeof(savedir), "%s/save", confdir);
+	snprintf(conffile, sizeof(conffile), "%s/pkg", confdir);
+	snprintf(deltafile, sizeof(deltafile), "%s/pkg", savedir);
+	if (mkdir(savedir, 0700)) {
+		perror(savedir);
+		return 1;
+	}
+
+	ctx = uci_alloc_context();
+	if (!ctx)
+		return 1;
+
+	ctx->flags |= UCI_FLAG_STATS;
+	test_check(uci_set_confdir(ctx, confdir), "confdir");
+	test_check(uci_set_savedir(ctx, savedir), "savedir");
+
+	test_commit_fast();
+	test_commit_saved_delta_flag();
+
+	uci_free_context(ctx);
+	unlink(conffile);
+	unlink(deltafile);
+	rmdir(savedir);
+	rmdir(confdir);
+
+	return !!failed;
+}
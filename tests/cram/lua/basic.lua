@@ -20,8 +20,42 @@ A(t.lan.enabled == 'off')
 A(c:get("network", "lan", "ifname") == "eth0")
 A(c:get("network", "lan", "enabled") == "off")
 
+local p = c:get_lazy("network")
+A(p.wan.ifname == 'eth1')
+A(p.lan[".type"] == 'interface')
+A(p.lan[".index"] == 2)
+A(p.missing == nil)
+
+local s = c:get_lazy("network", "wan")
+A(s.proto == 'dhcp')
+A(s[".anonymous"] == false)
+A(c:get_lazy("network", "wan", "ifname") == 'eth1')
+
+local names = {}
+for name, sec in p:pairs() do
+	A(sec[".name"] == name)
+	names[#names + 1] = name
+end
+A(table.concat(names, " ") == "a b lan wan c d")
+
+local keys = {}
+for k, v in s:pairs() do
+	keys[k] = v
+end
+A(keys[".type"] == 'interface')
+A(keys.ifname == 'eth1')
+A(keys.aliases == 'c d')
+
+local n = 0
+c:foreach_lazy("network", "alias", function(s)
+	n = n + 1
+	A(s.interface == 'lan' or s.interface == 'wan')
+end)
+A(n == 4)
+
 A(c:set("network", "lan", "ifname", "eth5"))
 A(c:get("network", "lan", "ifname") == "eth5")
+A(p.lan.ifname == "eth5")
 A(c:revert("network"))
 A(c:get("network", "lan", "ifname") == "eth0")
 
@@ -0,0 +1,33 @@
+local A = assert
+local c = uci.cursor(os.getenv("CONFIG_DIR"))
+local d = uci.cursor(os.getenv("CONFIG_DIR"))
+
+A(c:load("network"))
+A(c:get("network", "lan", "ifname") == "eth0")
+
+-- unchanged packages come back from the cache
+A(c:unload("network"))
+A(c:load("network"))
+A(c:load("network"))
+A(c:get("network", "lan", "ifname") == "eth0")
+
+-- changes of another cursor are picked up after load
+A(d:set("network", "lan", "ifname", "eth7"))
+A(d:commit("network"))
+A(c:get("network", "lan", "ifname") == "eth0")
+A(c:load("network"))
+A(c:get("network", "lan", "ifname") == "eth7")
+
+A(c:unload("network"))
+A(d:set("network", "lan", "ifname", "eth8"))
+A(d:save("network"))
+A(c:get("network", "lan", "ifname") == "eth8")
+
+-- load drops unsaved changes like before
+A(c:set("network", "lan", "proto", "dhcp"))
+A(c:load("network"))
+A(c:get("network", "lan", "proto") == "static")
+
+A(d:revert("network"))
+A(c:load("network"))
+A(c:get("network", "lan", "ifname") == "eth7")
@@ -15,9 +15,11 @@ check available methods:
   cursor
   get_all
   foreach
+  get_lazy
   __gc
-  delete
   set_savedir
+  delete
+  foreach_lazy
   set
   revert
   get_savedir
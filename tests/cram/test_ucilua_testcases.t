@@ -15,3 +15,9 @@ check that set method with empty table value doesn't leak memory:
   $ export CONFIG_DIR=$(pwd)/config
   $ ucilua $TESTDIR/lua/test_cases/set_with_empty_table_doesnt_leak.lua
   false\tCannot set an uci option to an empty table value (esc)
+
+check that load and unload pick up changes on disk:
+
+  $ cp -R "$TESTDIR/config" .
+  $ export CONFIG_DIR=$(pwd)/config
+  $ ucilua $TESTDIR/lua/test_cases/reload_picks_up_changes.lua
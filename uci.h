@@ -38,6 +38,7 @@ extern "C" {
 
 #define UCI_CONFDIR "/etc/config"
 #define UCI_SAVEDIR "/tmp/.uci"
+#define UCI_CACHEDIR "/tmp/.uci-cache"
 #define UCI_DIRMODE 0700
 #define UCI_FILEMODE 0600
 
@@ -70,7 +71,14 @@ struct uci_delta;
 struct uci_context;
 struct uci_backend;
 struct uci_parse_option;
+struct uci_stats;
+struct uci_parse_table;
 struct uci_parse_context;
+struct uci_hash;
+struct uci_types;
+struct uci_arena;
+struct uci_stamp;
+struct uci_intern;
 
 
 /**
@@ -131,6 +139,19 @@ extern int uci_export(struct uci_context *ctx, FILE *stream, struct uci_package
  */
 extern int uci_load(struct uci_context *ctx, const char *name, struct uci_package **package);
 
+/**
+ * uci_load_all: Parse several uci config files in parallel
+ *
+ * @ctx: uci context
+ * @names: NULL terminated list of config names, or NULL for all configs
+ *
+ * configs that are already loaded are skipped, the others are parsed on a
+ * small pool of worker threads and added to the context in the order of
+ * @names. configs that fail to load are left out, use uci_load on them
+ * to get the error
+ */
+extern int uci_load_all(struct uci_context *ctx, char **names);
+
 /**
  * uci_unload: Unload a config file from the uci context
  *
@@ -139,6 +160,96 @@ extern int uci_load(struct uci_context *ctx, const char *name, struct uci_packag
  */
 extern int uci_unload(struct uci_context *ctx, struct uci_package *p);
 
+/**
+ * uci_freeze: make a package read-only, so that it can be shared between threads
+ * @ctx: uci context
+ * @p: pointer to the uci_package struct
+ *
+ * All lookup indexes are built up front, afterwards lookups never modify the
+ * package. Any function that would change it fails with UCI_ERR_INVAL.
+ * Other threads can then use the uci_frozen_* functions concurrently, they
+ * don't need a context. The package stays frozen until it is unloaded, which
+ * must only happen once no other thread uses it anymore.
+ */
+extern int uci_freeze(struct uci_context *ctx, struct uci_package *p);
+
+/**
+ * uci_frozen_section: look up a section of a frozen package
+ * @p: package
+ * @name: section name
+ *
+ * returns NULL if there is no such section
+ */
+extern struct uci_section *uci_frozen_section(struct uci_package *p, const char *name);
+
+/**
+ * uci_frozen_option: look up an option of a section of a frozen package
+ * @s: section
+ * @name: option name
+ *
+ * returns NULL if there is no such option
+ */
+extern struct uci_option *uci_frozen_option(struct uci_section *s, const char *name);
+
+/**
+ * uci_frozen_lookup_ptr: split an uci tuple string and look it up in a frozen package
+ * @p: package
+ * @ptr: lookup result struct
+ * @str: uci tuple string to look up, or NULL if ptr is already filled in
+ *
+ * like uci_lookup_ptr with extended lookups, but the package part of the
+ * tuple must match p. never throws, returns the error code instead
+ */
+extern int uci_frozen_lookup_ptr(struct uci_package *p, struct uci_ptr *ptr, char *str);
+
+/**
+ * uci_package_stale: Check if a config file was modified since it was loaded
+ *
+ * @ctx: uci context
+ * @p: pointer to the uci_package struct
+ * @stale: set to true if the config file or one of its delta files
+ *         changed behind the back of this context, the package should be
+ *         unloaded and loaded again to pick up those changes. also set
+ *         if the config file was modified just before it was loaded
+ */
+extern int uci_package_stale(struct uci_context *ctx, struct uci_package *p, bool *stale);
+
+/**
+ * uci_diff: Compare two versions of a package
+ * @ctx: uci context
+ * @a: package as it was before
+ * @b: package as it is now
+ * @list: list head that is set up to hold the struct uci_diff entries
+ *
+ * Sections and options are matched up by name. Sections that were added or
+ * removed get one entry each, the changes of their options are implied.
+ * Other entries are about options that were added, removed or got another
+ * value, or sections that got another type. The target of an entry points
+ * to the element in @b, so the entries must not be used after @b is
+ * unloaded. The order of sections and options is not compared.
+ *
+ * The entries are freed with uci_free_diff, also if an error is returned
+ */
+extern int uci_diff(struct uci_context *ctx, struct uci_package *a, struct uci_package *b, struct uci_list *list);
+
+/**
+ * uci_diff_delta: Compare a package with its config file
+ * @ctx: uci context
+ * @p: loaded package
+ * @list: list head that is set up to hold the struct uci_diff entries
+ *
+ * Works like uci_diff with the config file as it currently is on disk as
+ * @a, so that the entries describe what the changes that were loaded or
+ * made since then would do once they are committed
+ */
+extern int uci_diff_delta(struct uci_context *ctx, struct uci_package *p, struct uci_list *list);
+
+/**
+ * uci_free_diff: Free all entries of a list filled by uci_diff
+ * @list: list head
+ */
+extern void uci_free_diff(struct uci_list *list);
+
 /**
  * uci_lookup_ptr: Split an uci tuple string and look up an element tree
  * @ctx: uci context
@@ -193,6 +304,16 @@ extern int uci_set(struct uci_context *ctx, struct uci_ptr *ptr);
  */
 extern int uci_add_list(struct uci_context *ctx, struct uci_ptr *ptr);
 
+/**
+ * uci_add_list_unique: Append a string to an element list, unless it is in there
+ * @ctx: uci context
+ * @ptr: uci pointer (with value)
+ *
+ * Like uci_add_list, but nothing is changed if the option already holds
+ * the value, either as list entry or as string value
+ */
+extern int uci_add_list_unique(struct uci_context *ctx, struct uci_ptr *ptr);
+
 /**
  * uci_del_list: Remove a string from an element list
  * @ctx: uci context
@@ -241,6 +362,28 @@ extern int uci_save(struct uci_context *ctx, struct uci_package *p);
  */
 extern int uci_commit(struct uci_context *ctx, struct uci_package **p, bool overwrite);
 
+/**
+ * uci_commit_many: commit changes to several packages at once
+ * @ctx: uci context
+ * @p: array of uci_package struct pointers
+ * @n: number of packages
+ * @overwrite: overwrite existing config data and flush delta
+ *
+ * like uci_commit, but all new config files are written and synced to
+ * disk before the first one replaces the old file. the config files are
+ * locked in the order of their paths, not in the order of the array.
+ * pointers in the array are updated like the one passed to uci_commit
+ */
+extern int uci_commit_many(struct uci_context *ctx, struct uci_package **p, int n, bool overwrite);
+
+/**
+ * uci_get_stats: get the counters collected while UCI_FLAG_STATS was set
+ * @ctx: uci context
+ * @stats: filled with the counters
+ * @reset: start the counters over from zero
+ */
+extern int uci_get_stats(struct uci_context *ctx, struct uci_stats *stats, bool reset);
+
 /**
  * uci_list_configs: List available uci config files
  * @ctx: uci context
@@ -265,6 +408,25 @@ extern int uci_set_savedir(struct uci_context *ctx, const char *dir);
  */
 extern int uci_set_confdir(struct uci_context *ctx, const char *dir);
 
+/**
+ * uci_set_cachedir: override the default snapshot cache directory
+ * @ctx: uci context
+ * @dir: directory name
+ *
+ * The cache is only used if UCI_FLAG_CACHE is set
+ */
+extern int uci_set_cachedir(struct uci_context *ctx, const char *dir);
+
+/**
+ * uci_set_lock_timeout: limit how long to wait for file locks
+ * @ctx: uci context
+ * @timeout: milliseconds, 0 gives up right away, negative waits forever
+ *
+ * Loading, saving or committing fails with UCI_ERR_IO if a lock can't be
+ * taken in time. Loading only waits while a commit replaces the config file
+ */
+extern int uci_set_lock_timeout(struct uci_context *ctx, int timeout);
+
 /**
  * uci_add_delta_path: add a directory to the search path for change delta files
  * @ctx: uci context
@@ -298,10 +460,32 @@ extern int uci_parse_argument(struct uci_context *ctx, FILE *stream, char **str,
  * @ctx: uci context
  * @name: name of the backend
  *
- * The default backend is "file", which uses /etc/config for config storage
+ * The default backend is "file", which uses /etc/config for config storage.
+ * The "shm" backend uses the same files, but shares the parsed packages with
+ * other processes through segments in the cache directory
  */
 extern int uci_set_backend(struct uci_context *ctx, const char *name);
 
+/**
+ * uci_shm_generation: get the generation of a package shared by the shm backend
+ * @ctx: uci context
+ * @name: name of the config
+ * @generation: set to the number of commits done through the shm backend,
+ *              0 if the package was never shared
+ */
+extern int uci_shm_generation(struct uci_context *ctx, const char *name, uint64_t *generation);
+
+/**
+ * uci_shm_watch: get a descriptor for waiting on shared package updates
+ * @ctx: uci context
+ * @fd: set to a non-blocking inotify descriptor, which becomes readable
+ *      whenever a segment in the cache directory is replaced
+ *
+ * The caller needs to read the pending events and close the descriptor,
+ * uci_shm_generation tells which of the packages were committed
+ */
+extern int uci_shm_watch(struct uci_context *ctx, int *fd);
+
 /**
  * uci_validate_text: validate a value string for uci options
  * @str: value
@@ -342,6 +526,32 @@ int uci_lookup_next(struct uci_context *ctx, struct uci_element **e, struct uci_
 void uci_parse_section(struct uci_section *s, const struct uci_parse_option *opts,
 		       int n_opts, struct uci_option **tb);
 
+/**
+ * uci_parse_option_compile: prepare a set of options for repeated lookups
+ * @opts: list of options to look up, must stay valid while the table is used
+ * @n_opts: number of options to look up
+ *
+ * returns NULL if the table could not be allocated
+ */
+struct uci_parse_table *uci_parse_option_compile(const struct uci_parse_option *opts, int n_opts);
+
+/**
+ * uci_parse_table_free: free a table returned by uci_parse_option_compile
+ * @t: compiled option table
+ */
+void uci_parse_table_free(struct uci_parse_table *t);
+
+/**
+ * uci_parse_section_compiled: look up a set of compiled options
+ * @s: uci section
+ * @t: compiled option table
+ * @tb: array of pointers to found options, with one entry per option
+ *
+ * same as uci_parse_section, but in a single pass over the section's options
+ */
+void uci_parse_section_compiled(struct uci_section *s, const struct uci_parse_table *t,
+				struct uci_option **tb);
+
 /**
  * uci_hash_options: build a hash over a list of options
  * @tb: list of option pointers
@@ -361,6 +571,7 @@ enum uci_type {
 	UCI_TYPE_BACKEND = 6,
 	UCI_TYPE_ITEM = 7,
 	UCI_TYPE_HOOK = 8,
+	UCI_TYPE_DIFF = 9,
 };
 
 enum uci_option_type {
@@ -373,6 +584,30 @@ enum uci_flags {
 	UCI_FLAG_PERROR =        (1 << 1), /* print parser error messages */
 	UCI_FLAG_EXPORT_NAME =   (1 << 2), /* when exporting, name unnamed sections */
 	UCI_FLAG_SAVED_DELTA = (1 << 3), /* store the saved delta in memory as well */
+	UCI_FLAG_ARENA =       (1 << 4), /* allocate parsed packages from a per-package arena */
+	UCI_FLAG_MMAP =        (1 << 5), /* parse config files straight from a private file mapping */
+	UCI_FLAG_CACHE =       (1 << 6), /* restore packages from binary snapshots in the cache dir */
+	UCI_FLAG_STATS =       (1 << 7), /* collect the counters reported by uci_get_stats */
+};
+
+/* delta_path entries past the last slot are counted in the last one */
+#define UCI_STATS_DELTA_PATHS	8
+
+struct uci_stats
+{
+	uint64_t parse_bytes;	/* config and delta input read by the parser */
+	uint64_t parse_lines;
+	uint64_t lookups;	/* uci_lookup_ptr calls */
+	uint64_t compares;	/* names compared by those lookups */
+
+	/* delta lines read from each delta_path entry, in list order */
+	uint64_t delta_lines[UCI_STATS_DELTA_PATHS];
+	uint64_t delta_dropped;	/* of those, superseded ones that were never applied */
+
+	/* nanoseconds spent waiting for file locks, in fsync and in rename */
+	uint64_t lock_wait;
+	uint64_t fsync_time;
+	uint64_t rename_time;
 };
 
 struct uci_element
@@ -380,6 +615,9 @@ struct uci_element
 	struct uci_list list;
 	enum uci_type type;
 	char *name;
+
+	/* private: */
+	unsigned int flags;
 };
 
 struct uci_backend
@@ -422,6 +660,10 @@ struct uci_context
 	bool internal, nested;
 	char *buf;
 	int bufsz;
+	char *cachedir;
+	struct uci_intern *intern;
+	struct uci_stats stats;
+	int lock_timeout;
 };
 
 struct uci_package
@@ -438,6 +680,15 @@ struct uci_package
 	int n_section;
 	struct uci_list delta;
 	struct uci_list saved_delta;
+	struct uci_hash *hash;
+	struct uci_types *types;
+	struct uci_arena *arena;
+	char *map;
+	size_t map_size;
+	struct uci_stamp *stamps;
+	unsigned int n_stamps;
+	bool stamp_racy;
+	bool has_saved_delta;
 };
 
 struct uci_section
@@ -447,6 +698,9 @@ struct uci_section
 	struct uci_package *package;
 	bool anonymous;
 	char *type;
+
+	/* private: */
+	struct uci_hash *hash;
 };
 
 struct uci_option
@@ -458,6 +712,9 @@ struct uci_option
 		struct uci_list list;
 		char *string;
 	} v;
+
+	/* private: */
+	struct uci_hash *hash;
 };
 
 /*
@@ -484,6 +741,24 @@ struct uci_delta
 	char *value;
 };
 
+enum uci_diff_type {
+	UCI_DIFF_ADD,
+	UCI_DIFF_REMOVE,
+	UCI_DIFF_CHANGE,
+};
+
+/*
+ * e.name is the name of the option, or NULL if the entry is about the
+ * section itself. target is NULL for removals
+ */
+struct uci_diff
+{
+	struct uci_element e;
+	enum uci_diff_type type;
+	char *section;
+	struct uci_element *target;
+};
+
 struct uci_ptr
 {
 	enum uci_type target;
@@ -571,6 +846,7 @@ struct uci_parse_option {
 /* wrappers for dynamic type handling */
 #define uci_type_backend UCI_TYPE_BACKEND
 #define uci_type_delta UCI_TYPE_DELTA
+#define uci_type_diff UCI_TYPE_DIFF
 #define uci_type_package UCI_TYPE_PACKAGE
 #define uci_type_section UCI_TYPE_SECTION
 #define uci_type_option UCI_TYPE_OPTION
@@ -580,6 +856,7 @@ struct uci_parse_option {
 static const char *uci_typestr[] = {
 	[uci_type_backend] = "backend",
 	[uci_type_delta] = "delta",
+	[uci_type_diff] = "diff",
 	[uci_type_package] = "package",
 	[uci_type_section] = "section",
 	[uci_type_option] = "option",
@@ -601,6 +878,7 @@ static void uci_typecast_error(int from, int to)
 
 BUILD_CAST(backend)
 BUILD_CAST(delta)
+BUILD_CAST(diff)
 BUILD_CAST(package)
 BUILD_CAST(section)
 BUILD_CAST(option)
@@ -608,6 +886,7 @@ BUILD_CAST(option)
 #else
 #define uci_to_backend(ptr) container_of(ptr, struct uci_backend, e)
 #define uci_to_delta(ptr) container_of(ptr, struct uci_delta, e)
+#define uci_to_diff(ptr) container_of(ptr, struct uci_diff, e)
 #define uci_to_package(ptr) container_of(ptr, struct uci_package, e)
 #define uci_to_section(ptr) container_of(ptr, struct uci_section, e)
 #define uci_to_option(ptr)  container_of(ptr, struct uci_option, e)
@@ -31,12 +31,36 @@ struct uci_blob_param_list {
 	const struct uci_blob_param_list *next[];
 };
 
+struct uci_blob_state;
+
 int uci_to_blob(struct blob_buf *b, struct uci_section *s,
 		const struct uci_blob_param_list *p);
+
+/*
+ * precompiled version of uci_to_blob for converting many sections with the
+ * same param list. the state keeps scratch buffers between calls, so it must
+ * not be shared between threads. returns NULL if out of memory
+ */
+struct uci_blob_state *uci_blob_param_compile(const struct uci_blob_param_list *p);
+void uci_blob_state_free(struct uci_blob_state *st);
+int uci_to_blob_compiled(struct blob_buf *b, struct uci_section *s,
+			 struct uci_blob_state *st);
 bool uci_blob_check_equal(struct blob_attr *c1, struct blob_attr *c2,
 			  const struct uci_blob_param_list *config);
 bool uci_blob_diff(struct blob_attr **tb1, struct blob_attr **tb2,
 		   const struct uci_blob_param_list *config,
 		   unsigned long *diff_bits);
 
+/*
+ * hash over the attributes compared by uci_blob_check_equal, meant to be
+ * computed once per blob. blobs with different fingerprints are never
+ * equal, so uci_blob_check_equal_fingerprint only does the full comparison
+ * when the fingerprints match
+ */
+uint32_t uci_blob_fingerprint(struct blob_attr *c,
+			      const struct uci_blob_param_list *config);
+bool uci_blob_check_equal_fingerprint(struct blob_attr *c1, uint32_t fp1,
+				      struct blob_attr *c2, uint32_t fp2,
+				      const struct uci_blob_param_list *config);
+
 #endif
@@ -18,6 +18,9 @@
 #define __private __attribute__((visibility("hidden")))
 #define __public
 
+/* upper limit for the worker threads used by uci_load_all */
+#define UCI_LOAD_THREADS	8
+
 struct uci_parse_context
 {
 	/* error context */
@@ -35,39 +38,230 @@ struct uci_parse_context
 	size_t bufsz;
 	size_t buf_filled;
 	size_t pos;
+
+	/* mapped input file, buf points into it */
+	char *map;
+	size_t map_len;
+	size_t map_ofs;
+	size_t map_size; /* non-zero while the mapping is not owned by a package */
+	int map_save;
+};
+
+/* private flags for uci elements */
+enum uci_element_flags {
+	UCI_ELEMENT_ARENA =    (1 << 0), /* element is allocated from a package arena */
+	UCI_ELEMENT_EXT_NAME = (1 << 1), /* name is not owned by the element, don't free it */
+	UCI_ELEMENT_EXT_VALUE = (1 << 2), /* same for the option value or section type */
+	UCI_ELEMENT_FROZEN =   (1 << 3), /* package is read-only, see uci_freeze */
+	UCI_ELEMENT_SUPERSEDED = (1 << 4), /* delta entry that later ones override */
+};
+
+/*
+ * package arena, used to allocate the elements of a package while it is
+ * being parsed. chunks are never freed individually, only together
+ * with the package
+ */
+#define UCI_ARENA_CHUNK	8192
+#define UCI_ARENA_ALIGN	sizeof(void *)
+
+struct uci_arena
+{
+	struct uci_arena *next;
+	size_t size;
+	size_t used;
+	char data[];
 };
+
+/* growing output buffer, written out in one go */
+struct uci_buf
+{
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+/*
+ * the savedir delta file of a package gets compacted whenever a save makes
+ * it grow past a multiple of this size (doubling each time)
+ */
+#define UCI_DELTA_COMPACT	16384
+
 #define pctx_pos(pctx)		((pctx)->pos)
 #define pctx_str(pctx, i)	(&(pctx)->buf[(i)])
 #define pctx_cur_str(pctx)	pctx_str(pctx, pctx_pos(pctx))
 #define pctx_char(pctx, i)	((pctx)->buf[(i)])
 #define pctx_cur_char(pctx)	pctx_char(pctx, pctx_pos(pctx))
 
+/*
+ * character classes used by the tokenizer and the name validation.
+ * every class that ends a span contains the null byte, so span scans
+ * always stop at the end of the line buffer
+ */
+enum {
+	UCI_CT_SPACE = (1 << 0),	/* isspace() in the C locale */
+	UCI_CT_NAME = (1 << 1),		/* alphanumeric or '_' */
+	UCI_CT_WORD = (1 << 2),		/* ends an unquoted string */
+	UCI_CT_DQUOTE = (1 << 3),	/* ends a double quoted span */
+	UCI_CT_SQUOTE = (1 << 4),	/* ends a single quoted span */
+};
+
+extern __private const unsigned char uci_ctype[256];
+
+static inline bool uci_ctype_is(char c, unsigned char class)
+{
+	return uci_ctype[(unsigned char) c] & class;
+}
+
+/*
+ * name index over the elements of a section or option list, or over the
+ * values of a list option, which may hold the same value more than once.
+ * it is built on demand once a list grows beyond UCI_HASH_MIN entries,
+ * the list itself stays authoritative for the element order
+ */
+#define UCI_HASH_MIN	16
+
+struct uci_hash_entry
+{
+	unsigned int hash;
+	struct uci_element *e;
+};
+
+struct uci_hash
+{
+	unsigned int size;
+	unsigned int count;
+	struct uci_hash_entry entries[];
+};
+
+/*
+ * per type vectors over the sections of a package, in list order, so that
+ * extended section references are resolved by index. vector 0 holds the
+ * sections of any type. built on the first extended lookup and kept up to
+ * date when sections are added, moved, retyped or freed
+ */
+struct uci_type_vec
+{
+	const char *type;
+	unsigned int count;
+	unsigned int size;
+	struct uci_element **e;
+};
+
+struct uci_types
+{
+	unsigned int count;
+	unsigned int size;
+	struct uci_type_vec *vec;
+};
+
+/*
+ * context wide table of section types and option names. each distinct
+ * string is stored once in the table arena and stays valid until the
+ * context is freed, sections and options only reference it. since all
+ * types and option names are interned, they can be compared by pointer
+ */
+#define UCI_INTERN_MIN	64
+
+struct uci_intern_entry
+{
+	unsigned int hash;
+	const char *str;
+};
+
+struct uci_intern
+{
+	unsigned int size;
+	unsigned int count;
+	struct uci_arena *arena;
+	struct uci_intern_entry *entries;
+};
+
+/* stat data of a file, used to detect changes. all zero if it doesn't exist */
+struct uci_stamp
+{
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+	int64_t ctime;
+};
+
+/* the files a package is made of: the config file followed by its delta files */
+struct uci_snapshot_key
+{
+	char *file;
+	unsigned int n_stamps;
+	char **paths;
+	struct uci_stamp *stamps;
+};
+
 extern const char *uci_confdir;
 extern const char *uci_savedir;
+extern const char *uci_cachedir;
 
 __private void *uci_malloc(struct uci_context *ctx, size_t size);
 __private void *uci_realloc(struct uci_context *ctx, void *ptr, size_t size);
 __private char *uci_strdup(struct uci_context *ctx, const char *str);
+__private void *uci_arena_alloc(struct uci_context *ctx, struct uci_arena **arena, size_t size);
+__private char *uci_arena_strdup(struct uci_context *ctx, struct uci_arena **arena, const char *str);
+__private void uci_arena_free(struct uci_arena **arena);
+__private const char *uci_intern(struct uci_context *ctx, const char *str);
+__private const char *uci_intern_find(struct uci_context *ctx, const char *str);
+__private void uci_intern_free(struct uci_context *ctx);
+__private void uci_buf_put(struct uci_context *ctx, struct uci_buf *buf, const void *data, size_t len);
+__private void uci_buf_putc(struct uci_context *ctx, struct uci_buf *buf, int c);
+__private void uci_buf_put_escaped(struct uci_context *ctx, struct uci_buf *buf, const char *str);
+__private bool uci_buf_write(int fd, const struct uci_buf *buf);
+__private bool uci_buf_flush(FILE *stream, struct uci_buf *buf);
+__private uint64_t uci_stats_now(void);
+__private void uci_stats_merge(struct uci_stats *dst, const struct uci_stats *src);
+__private int uci_flock(struct uci_context *ctx, int fd, int op);
 __private bool uci_validate_str(const char *str, bool name, bool package);
 __private void uci_add_delta(struct uci_context *ctx, struct uci_list *list, int cmd, const char *section, const char *option, const char *value);
 __private void uci_free_delta(struct uci_delta *h);
 __private struct uci_package *uci_alloc_package(struct uci_context *ctx, const char *name);
+__private struct uci_section *uci_alloc_section(struct uci_package *p, const char *type, const char *name);
+__private struct uci_option *uci_alloc_option(struct uci_section *s, const char *name, const char *value);
+__private struct uci_option *uci_alloc_list(struct uci_section *s, const char *name);
+__private unsigned int djbhash(unsigned int hash, const char *str);
+__private uint32_t hash_murmur2(uint32_t h, const void *key, int len);
 
 __private FILE *uci_open_stream(struct uci_context *ctx, const char *filename, const char *origfilename, int pos, bool write, bool create);
+__private FILE *uci_open_config(struct uci_context *ctx, const char *filename);
+__private int uci_lock_config(struct uci_context *ctx, const char *filename);
 __private void uci_close_stream(FILE *stream);
 __private void uci_getln(struct uci_context *ctx, size_t offset);
 
 __private void uci_parse_error(struct uci_context *ctx, char *reason);
+__private bool uci_split_ptr(struct uci_ptr *ptr, char *str);
 __private void uci_alloc_parse_context(struct uci_context *ctx);
 
 __private void uci_cleanup(struct uci_context *ctx);
-__private struct uci_element *uci_lookup_list(struct uci_list *list, const char *name);
+__private struct uci_context *uci_clone_context(struct uci_context *ctx);
+__private struct uci_element *uci_lookup_list_cmp(struct uci_list *list, const char *name, uint64_t *cmp);
 __private void uci_free_package(struct uci_package **package);
 __private struct uci_element *uci_alloc_generic(struct uci_context *ctx, int type, const char *name, int size);
 __private void uci_free_element(struct uci_element *e);
 __private struct uci_element *uci_expand_ptr(struct uci_context *ctx, struct uci_ptr *ptr, bool complete);
 
-__private int uci_load_delta(struct uci_context *ctx, struct uci_package *p, bool flush);
+__private int uci_load_delta(struct uci_context *ctx, struct uci_package *p, FILE *savedir, bool held);
+__private FILE *uci_delta_open(struct uci_context *ctx, const char *name, bool write);
+__private void uci_save_delta(struct uci_context *ctx, struct uci_package *p);
+__private int uci_compact_delta(struct uci_context *ctx, struct uci_list *list);
+
+__private bool uci_stamp_file(const char *path, struct uci_stamp *st);
+__private void uci_stamp_fd(int fd, struct uci_stamp *st);
+__private void uci_stamp_package(struct uci_package *p, const struct uci_stamp *stamps, unsigned int n);
+__private struct uci_snapshot_key *uci_snapshot_key(struct uci_context *ctx, const char *name, const char *filename, bool stamp);
+__private struct uci_package *uci_snapshot_load(struct uci_context *ctx, struct uci_snapshot_key *key, const char *name);
+__private void uci_snapshot_store(struct uci_context *ctx, struct uci_snapshot_key *key, struct uci_package *p);
+__private void uci_snapshot_invalidate(struct uci_context *ctx, struct uci_package *p);
+__private bool uci_snapshot_dir_ok(const char *dir);
+__private bool uci_stamps_racy(const struct uci_stamp *stamps, unsigned int n);
+__private bool uci_snapshot_racy(struct uci_snapshot_key *key);
+__private char *uci_snapshot_map(const char *path, size_t min, size_t *size);
+__private struct uci_package *uci_snapshot_attach(struct uci_context *ctx, struct uci_snapshot_key *key, const char *name, char *map, size_t size, size_t ofs);
+__private void uci_snapshot_serialize(struct uci_context *ctx, struct uci_buf *buf, struct uci_snapshot_key *key, struct uci_package *p);
 
 static inline bool uci_validate_package(const char *str)
 {
@@ -85,6 +279,11 @@ static inline bool uci_validate_name(const char *str)
 }
 
 /* initialize a list head/item */
+static inline struct uci_element *uci_lookup_list(struct uci_list *list, const char *name)
+{
+	return uci_lookup_list_cmp(list, name, NULL);
+}
+
 static inline void uci_list_init(struct uci_list *ptr)
 {
 	ptr->prev = ptr;
@@ -122,6 +321,9 @@ static inline void uci_list_del(struct uci_list *ptr)
 
 
 extern struct uci_backend uci_file_backend;
+extern struct uci_backend uci_shm_backend;
+__private char *uci_config_path(struct uci_context *ctx, const char *name);
+__private void uci_file_commit_many(struct uci_context *ctx, struct uci_package **packages, int n, bool overwrite);
 
 #ifdef UCI_PLUGIN_SUPPORT
 /**
@@ -255,4 +457,32 @@ struct uci_backend _var = {		\
 	}				\
 } while (0)
 
+/* frozen packages can be shared between threads and must not change */
+#define UCI_ASSERT_WRITABLE(ctx, p) \
+	UCI_ASSERT(ctx, !((p)->e.flags & UCI_ELEMENT_FROZEN))
+
+/*
+ * counters are only collected with UCI_FLAG_STATS, so that the clock is
+ * not read on every file operation otherwise
+ */
+#define UCI_STATS_ADD(ctx, field, n) do {		\
+	if ((ctx)->flags & UCI_FLAG_STATS)		\
+		(ctx)->stats.field += (n);		\
+} while (0)
+
+#define UCI_STATS_PTR(ctx, field) \
+	(((ctx)->flags & UCI_FLAG_STATS) ? &(ctx)->stats.field : NULL)
+
+static inline uint64_t uci_stats_clock(struct uci_context *ctx)
+{
+	return (ctx->flags & UCI_FLAG_STATS) ? uci_stats_now() : 0;
+}
+
+/* add the time passed since start, which came from uci_stats_clock */
+static inline void uci_stats_time(struct uci_context *ctx, uint64_t *counter, uint64_t start)
+{
+	if (ctx->flags & UCI_FLAG_STATS)
+		*counter += uci_stats_now() - start;
+}
+
 #endif
@@ -38,12 +38,22 @@ struct ucimap_alloc_custom {
 	void *ptr;
 };
 
-struct ucimap_fixup {
-	struct ucimap_fixup *next;
+/*
+ * section reference of an option, kept with the referencing section so that
+ * it can be resolved again when the referenced section is replaced
+ */
+struct ucimap_ref {
+	struct ucimap_ref *next;
 	struct uci_sectionmap *sm;
-	const char *name;
 	enum ucimap_type type;
 	union ucimap_data *data;
+	void *target;
+	char name[];
+};
+
+struct ucimap_fixup {
+	struct ucimap_fixup *next;
+	struct ucimap_ref *ref;
 };
 
 #define ucimap_foreach_option(_sm, _o) \
@@ -120,9 +130,94 @@ ucimap_init(struct uci_map *map)
 	map->sdata = NULL;
 	map->fixup_tail = &map->fixup;
 	map->sdata_tail = &map->sdata;
+	map->index = NULL;
+	map->index_size = 0;
+	map->index_count = 0;
 	return 0;
 }
 
+/*
+ * index over the mapped sections (listed and pending) by section map and
+ * name, used to resolve section references. without an index, lookups
+ * fall back to walking the section lists
+ */
+static unsigned int
+ucimap_index_hash(struct uci_sectionmap *sm, const char *name)
+{
+	unsigned int hash = (unsigned int) (uintptr_t) sm;
+
+	while (*name)
+		hash = hash * 33 + (unsigned char) *name++;
+
+	return hash ^ (hash >> 16);
+}
+
+static void
+ucimap_index_insert(struct uci_map *map, struct ucimap_section_data *sd)
+{
+	unsigned int i = ucimap_index_hash(sd->sm, sd->section_name) & (map->index_size - 1);
+
+	sd->hnext = map->index[i];
+	map->index[i] = sd;
+	map->index_count++;
+}
+
+static void
+ucimap_index_rebuild(struct uci_map *map, struct ucimap_section_data **index, unsigned int size)
+{
+	struct ucimap_section_data *sd;
+
+	free(map->index);
+	map->index = index;
+	map->index_size = size;
+	map->index_count = 0;
+	for (sd = map->sdata; sd; sd = sd->next)
+		ucimap_index_insert(map, sd);
+	for (sd = map->pending; sd; sd = sd->next)
+		ucimap_index_insert(map, sd);
+}
+
+/* add a section that was just put on one of the section lists */
+static void
+ucimap_index_add(struct uci_map *map, struct ucimap_section_data *sd)
+{
+	struct ucimap_section_data **index;
+	unsigned int size;
+
+	if (map->index_count >= map->index_size) {
+		size = map->index_size ? map->index_size * 2 : 64;
+		index = calloc(size, sizeof(*index));
+		if (index) {
+			ucimap_index_rebuild(map, index, size);
+			return;
+		}
+		if (!map->index)
+			return;
+	}
+
+	ucimap_index_insert(map, sd);
+}
+
+static void
+ucimap_index_del(struct uci_map *map, struct ucimap_section_data *sd)
+{
+	struct ucimap_section_data **cur;
+	unsigned int i;
+
+	if (!map->index)
+		return;
+
+	i = ucimap_index_hash(sd->sm, sd->section_name) & (map->index_size - 1);
+	for (cur = &map->index[i]; *cur; cur = &(*cur)->hnext) {
+		if (*cur != sd)
+			continue;
+
+		*cur = sd->hnext;
+		map->index_count--;
+		break;
+	}
+}
+
 static void
 ucimap_add_alloc(struct ucimap_section_data *sd, void *ptr)
 {
@@ -133,16 +228,29 @@ ucimap_add_alloc(struct ucimap_section_data *sd, void *ptr)
 void
 ucimap_free_section(struct uci_map *map, struct ucimap_section_data *sd)
 {
+	struct ucimap_ref *r, *next;
 	void *section;
 	unsigned int i;
 
 	section = ucimap_section_ptr(sd);
-	if (sd->ref)
+	if (sd->section_name)
+		ucimap_index_del(map, sd);
+	if (sd->ref) {
 		*sd->ref = sd->next;
+		if (sd->next)
+			sd->next->ref = sd->ref;
+		else if (map->sdata_tail == &sd->next)
+			map->sdata_tail = sd->ref;
+	}
 
 	if (sd->sm->free)
 		sd->sm->free(map, section);
 
+	for (r = sd->refs; r; r = next) {
+		next = r->next;
+		free(r);
+	}
+
 	for (i = 0; i < sd->allocmap_len; i++) {
 		free(sd->allocmap[i].ptr);
 	}
@@ -168,30 +276,60 @@ ucimap_cleanup(struct uci_map *map)
 		sd_next = sd->next;
 		ucimap_free_section(map, sd);
 	}
+	free(map->index);
+	map->index = NULL;
+	map->index_size = 0;
+	map->index_count = 0;
 }
 
-static void *
-ucimap_find_section(struct uci_map *map, struct ucimap_fixup *f)
+static struct ucimap_section_data *
+ucimap_find_data(struct ucimap_section_data *sd, struct uci_sectionmap *sm, const char *name)
 {
-	struct ucimap_section_data *sd;
-
-	for (sd = map->sdata; sd; sd = sd->next) {
-		if (sd->sm != f->sm)
+	for (; sd; sd = sd->next) {
+		if (sd->sm != sm)
 			continue;
-		if (strcmp(f->name, sd->section_name) != 0)
+		if (strcmp(name, sd->section_name) != 0)
 			continue;
-		return ucimap_section_ptr(sd);
+		return sd;
 	}
-	for (sd = map->pending; sd; sd = sd->next) {
-		if (sd->sm != f->sm)
+	return NULL;
+}
+
+static struct ucimap_section_data *
+ucimap_index_find(struct uci_map *map, struct uci_sectionmap *sm, const char *name)
+{
+	struct ucimap_section_data *sd;
+
+	if (!map->index) {
+		sd = ucimap_find_data(map->sdata, sm, name);
+		if (!sd)
+			sd = ucimap_find_data(map->pending, sm, name);
+		return sd;
+	}
+
+	sd = map->index[ucimap_index_hash(sm, name) & (map->index_size - 1)];
+	for (; sd; sd = sd->hnext) {
+		if (sd->sm != sm)
 			continue;
-		if (strcmp(f->name, sd->section_name) != 0)
+		if (strcmp(name, sd->section_name) != 0)
 			continue;
-		return ucimap_section_ptr(sd);
+		return sd;
 	}
 	return NULL;
 }
 
+static void *
+ucimap_find_section(struct uci_map *map, struct ucimap_ref *r)
+{
+	struct ucimap_section_data *sd;
+
+	sd = ucimap_index_find(map, r->sm, r->name);
+	if (!sd)
+		return NULL;
+
+	return ucimap_section_ptr(sd);
+}
+
 static union ucimap_data *
 ucimap_list_append(struct ucimap_list *list)
 {
@@ -205,26 +343,27 @@ ucimap_list_append(struct ucimap_list *list)
 
 
 static bool
-ucimap_handle_fixup(struct uci_map *map, struct ucimap_fixup *f)
+ucimap_handle_fixup(struct uci_map *map, struct ucimap_ref *r)
 {
-	void *ptr = ucimap_find_section(map, f);
+	void *ptr = ucimap_find_section(map, r);
 	union ucimap_data *data;
 
 	if (!ptr)
 		return false;
 
-	switch(f->type & UCIMAP_TYPE) {
+	switch(r->type & UCIMAP_TYPE) {
 	case UCIMAP_SIMPLE:
-		f->data->ptr = ptr;
+		r->data->ptr = ptr;
 		break;
 	case UCIMAP_LIST:
-		data = ucimap_list_append(f->data->list);
+		data = ucimap_list_append(r->data->list);
 		if (!data)
 			return false;
 
 		data->ptr = ptr;
 		break;
 	}
+	r->target = ptr;
 	return true;
 }
 
@@ -312,23 +451,34 @@ set:
 static void
 ucimap_add_fixup(struct ucimap_section_data *sd, union ucimap_data *data, struct uci_optmap *om, const char *str)
 {
-	struct ucimap_fixup *f, tmp;
 	struct uci_map *map = sd->map;
+	struct ucimap_ref *r, **tail;
+	struct ucimap_fixup *f;
 
-	tmp.next = NULL;
-	tmp.sm = om->data.sm;
-	tmp.name = str;
-	tmp.type = om->type;
-	tmp.data = data;
-	if (ucimap_handle_fixup(map, &tmp))
+	r = malloc(sizeof(struct ucimap_ref) + strlen(str) + 1);
+	if (!r)
+		return;
+
+	r->next = NULL;
+	r->sm = om->data.sm;
+	r->type = om->type;
+	r->data = data;
+	r->target = NULL;
+	strcpy(r->name, str);
+
+	/* keep the references in option order, lists are rebuilt from them */
+	for (tail = &sd->refs; *tail; tail = &(*tail)->next);
+	*tail = r;
+
+	if (ucimap_handle_fixup(map, r))
 		return;
 
 	f = malloc(sizeof(struct ucimap_fixup));
 	if (!f)
 		return;
 
-	memcpy(f, &tmp, sizeof(tmp));
 	f->next = NULL;
+	f->ref = r;
 	*map->fixup_tail = f;
 	map->fixup_tail = &f->next;
 }
@@ -712,6 +862,7 @@ ucimap_parse_section(struct uci_map *map, struct uci_sectionmap *sm, struct ucim
 	} else {
 		ucimap_add_section_list(map, sd);
 	}
+	ucimap_index_add(map, sd);
 
 	err = ucimap_parse_options(map, sm, sd, s);
 	if (err)
@@ -869,13 +1020,37 @@ ucimap_store_section(struct uci_map *map, struct uci_package *p, struct ucimap_s
 	return 0;
 }
 
-void
-ucimap_parse(struct uci_map *map, struct uci_package *pkg)
+/* hash over all options of a section, used to detect changes on updates */
+static uint32_t
+ucimap_hash_section(struct uci_section *s)
+{
+	struct uci_option *tb[32];
+	struct uci_element *e;
+	uint32_t hash = 0;
+	int n = 0;
+
+	uci_foreach_element(&s->options, e) {
+		tb[n++] = uci_to_option(e);
+		if (n < (int) ARRAY_SIZE(tb))
+			continue;
+
+		hash = hash * 31 + uci_hash_options(tb, n);
+		n = 0;
+	}
+
+	return hash * 31 + uci_hash_options(tb, n);
+}
+
+static bool
+ucimap_parse_package(struct uci_map *map, struct uci_package *pkg, bool update)
 {
 	struct uci_element *e;
 	struct ucimap_section_data *sd, **sd_tail;
 	struct ucimap_fixup *f;
+	const char *unmapped = NULL;
+	bool found, hashed, added = false;
 	unsigned int i;
+	uint32_t hash = 0;
 
 	sd_tail = map->sdata_tail;
 	map->parsed = false;
@@ -883,6 +1058,14 @@ ucimap_parse(struct uci_map *map, struct uci_package *pkg)
 	uci_foreach_element(&pkg->sections, e) {
 		struct uci_section *s = uci_to_section(e);
 
+		/*
+		 * section types are shared by all sections of a context, so a
+		 * type that matched no section map can be skipped by pointer
+		 */
+		if (s->type == unmapped)
+			continue;
+
+		found = hashed = false;
 		for (i = 0; i < map->n_sections; i++) {
 			struct uci_sectionmap *sm = map->sections[i];
 			struct ucimap_section_data *sd;
@@ -890,6 +1073,14 @@ ucimap_parse(struct uci_map *map, struct uci_package *pkg)
 			if (strcmp(s->type, map->sections[i]->type) != 0)
 				continue;
 
+			found = true;
+
+			if (update) {
+				sd = ucimap_index_find(map, sm, s->e.name);
+				if (sd && sd->keep)
+					continue;
+			}
+
 			if (sm->alloc) {
 				sd = sm->alloc(map, sm, s);
 				if (!sd)
@@ -902,8 +1093,16 @@ ucimap_parse(struct uci_map *map, struct uci_package *pkg)
 				sd = ucimap_ptr_section(sm, sd);
 			}
 
+			if (!hashed) {
+				hash = ucimap_hash_section(s);
+				hashed = true;
+			}
+			sd->hash = hash;
 			ucimap_parse_section(map, sm, sd, s);
+			added = true;
 		}
+		if (!found)
+			unmapped = s->type;
 	}
 	if (!map->parsed) {
 		map->parsed = true;
@@ -913,7 +1112,7 @@ ucimap_parse(struct uci_map *map, struct uci_package *pkg)
 	f = map->fixup;
 	while (f) {
 		struct ucimap_fixup *next = f->next;
-		ucimap_handle_fixup(map, f);
+		ucimap_handle_fixup(map, f->ref);
 		free(f);
 		f = next;
 	}
@@ -927,4 +1126,104 @@ ucimap_parse(struct uci_map *map, struct uci_package *pkg)
 		sd = next;
 	}
 	map->pending = NULL;
+
+	return added;
+}
+
+void
+ucimap_parse(struct uci_map *map, struct uci_package *pkg)
+{
+	ucimap_parse_package(map, pkg, false);
+}
+
+/*
+ * resolve the section references of an unchanged section again, if one of
+ * them points to a replaced section or new sections could satisfy one that
+ * had no match before
+ */
+static void
+ucimap_update_refs(struct uci_map *map, struct ucimap_section_data *sd, bool added)
+{
+	struct ucimap_ref *r;
+
+	for (r = sd->refs; r; r = r->next) {
+		if (r->target ? !ucimap_ptr_section(r->sm, r->target)->keep : added)
+			break;
+	}
+	if (!r)
+		return;
+
+	for (r = sd->refs; r; r = r->next) {
+		if (ucimap_is_list(r->type))
+			r->data->list->n_items = 0;
+	}
+
+	for (r = sd->refs; r; r = r->next) {
+		r->target = NULL;
+		if (!ucimap_handle_fixup(map, r) && ucimap_is_simple(r->type))
+			r->data->ptr = NULL;
+	}
+}
+
+void
+ucimap_parse_update(struct uci_map *map, struct uci_package *pkg)
+{
+	struct ucimap_section_data *sd, *next, *stale = NULL, **stale_tail = &stale;
+	struct uci_element *e;
+	bool added;
+
+	/* find the sections that did not change */
+	uci_foreach_element(&pkg->sections, e) {
+		struct uci_section *s = uci_to_section(e);
+		bool hashed = false;
+		uint32_t hash = 0;
+		unsigned int i;
+
+		for (i = 0; i < map->n_sections; i++) {
+			if (strcmp(s->type, map->sections[i]->type) != 0)
+				continue;
+
+			sd = ucimap_index_find(map, map->sections[i], s->e.name);
+			if (!sd || sd->keep)
+				continue;
+
+			if (!hashed) {
+				hash = ucimap_hash_section(s);
+				hashed = true;
+			}
+			if (sd->hash == hash)
+				sd->keep = true;
+		}
+	}
+
+	/* move all other sections out of the way */
+	sd = map->sdata;
+	map->sdata = NULL;
+	map->sdata_tail = &map->sdata;
+	for (; sd; sd = next) {
+		next = sd->next;
+		sd->next = NULL;
+		if (sd->keep) {
+			ucimap_add_section_list(map, sd);
+		} else {
+			ucimap_index_del(map, sd);
+			sd->ref = NULL;
+			*stale_tail = sd;
+			stale_tail = &sd->next;
+		}
+	}
+
+	added = ucimap_parse_package(map, pkg, true);
+
+	for (sd = map->sdata; sd; sd = sd->next) {
+		if (sd->keep)
+			ucimap_update_refs(map, sd, added);
+	}
+	for (sd = map->sdata; sd; sd = sd->next)
+		sd->keep = false;
+
+	for (sd = stale; sd; sd = next) {
+		next = sd->next;
+		ucimap_free_section(map, sd);
+	}
 }
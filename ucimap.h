@@ -109,6 +109,7 @@ struct uci_optmap;
 
 struct ucimap_list;
 struct ucimap_fixup;
+struct ucimap_ref;
 struct ucimap_alloc;
 struct ucimap_alloc_custom;
 struct ucimap_section_data;
@@ -125,6 +126,9 @@ struct uci_map {
 	struct ucimap_section_data *sdata;
 	struct ucimap_section_data *pending;
 	struct ucimap_section_data **sdata_tail;
+	struct ucimap_section_data **index;
+	unsigned int index_size;
+	unsigned int index_count;
 };
 
 enum ucimap_type {
@@ -171,6 +175,10 @@ struct ucimap_section_data {
 	struct ucimap_alloc_custom *alloc_custom;
 	unsigned int allocmap_len;
 	unsigned int alloc_custom_len;
+	struct ucimap_ref *refs;
+	struct ucimap_section_data *hnext;
+	uint32_t hash;
+	bool keep;
 };
 
 struct uci_sectionmap {
@@ -257,6 +265,18 @@ extern void ucimap_cleanup(struct uci_map *map);
  */
 extern void ucimap_parse(struct uci_map *map, struct uci_package *pkg);
 
+/**
+ * ucimap_parse_update: update the mapped data after a package was reloaded
+ * @map: ucimap data structure, filled from an earlier version of @pkg
+ * @pkg: uci package
+ *
+ * only new and changed sections are parsed again, changed and removed
+ * sections are freed. the data structures of unchanged sections stay valid,
+ * their section references are updated in place.
+ * @map must not contain sections of other packages
+ */
+extern void ucimap_parse_update(struct uci_map *map, struct uci_package *pkg);
+
 /**
  * ucimap_set_changed: mark a field in a custom data structure as changed
  * @sd: pointer to the ucimap section data
@@ -22,12 +22,12 @@
 #include <sys/file.h>
 #include <stdbool.h>
 #include <unistd.h>
-#include <ctype.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
+#include <time.h>
 
 #include "uci.h"
 #include "uci_internal.h"
@@ -63,6 +63,244 @@ __private char *uci_strdup(struct uci_context *ctx, const char *str)
 	return ptr;
 }
 
+__private void *uci_arena_alloc(struct uci_context *ctx, struct uci_arena **arena, size_t size)
+{
+	struct uci_arena *a = *arena;
+	size_t len = UCI_ARENA_CHUNK;
+	void *ptr;
+
+	size = (size + UCI_ARENA_ALIGN - 1) & ~(UCI_ARENA_ALIGN - 1);
+	if (!a || (a->used + size > a->size)) {
+		if (size > len)
+			len = size;
+
+		/* chunks are zeroed like all other uci allocations */
+		a = uci_malloc(ctx, sizeof(struct uci_arena) + len);
+		a->size = len;
+		a->next = *arena;
+		*arena = a;
+	}
+
+	ptr = &a->data[a->used];
+	a->used += size;
+
+	return ptr;
+}
+
+__private char *uci_arena_strdup(struct uci_context *ctx, struct uci_arena **arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+
+	return memcpy(uci_arena_alloc(ctx, arena, len), str, len);
+}
+
+__private void uci_arena_free(struct uci_arena **arena)
+{
+	struct uci_arena *a, *next;
+
+	for (a = *arena; a; a = next) {
+		next = a->next;
+		free(a);
+	}
+	*arena = NULL;
+}
+
+static struct uci_intern_entry *
+uci_intern_slot(struct uci_intern *t, unsigned int hash, const char *str)
+{
+	unsigned int mask = t->size - 1;
+	unsigned int i;
+
+	for (i = hash & mask; t->entries[i].str; i = (i + 1) & mask) {
+		if ((t->entries[i].hash == hash) && !strcmp(t->entries[i].str, str))
+			break;
+	}
+
+	return &t->entries[i];
+}
+
+static void uci_intern_grow(struct uci_context *ctx, struct uci_intern *t)
+{
+	struct uci_intern_entry *entries = t->entries;
+	unsigned int size = t->size;
+	unsigned int i;
+
+	t->entries = uci_malloc(ctx, size * 2 * sizeof(*entries));
+	t->size = size * 2;
+	for (i = 0; i < size; i++) {
+		if (entries[i].str)
+			*uci_intern_slot(t, entries[i].hash, entries[i].str) = entries[i];
+	}
+	free(entries);
+}
+
+/* look up the shared copy of a section type or option name, add it if needed */
+__private const char *uci_intern(struct uci_context *ctx, const char *str)
+{
+	struct uci_intern *t = ctx->intern;
+	struct uci_intern_entry *slot;
+	unsigned int hash = djbhash(~0U, str);
+
+	if (!t) {
+		t = calloc(1, sizeof(struct uci_intern));
+		if (t)
+			t->entries = calloc(UCI_INTERN_MIN, sizeof(*t->entries));
+		if (!t || !t->entries) {
+			free(t);
+			UCI_THROW(ctx, UCI_ERR_MEM);
+		}
+		t->size = UCI_INTERN_MIN;
+		ctx->intern = t;
+	}
+
+	slot = uci_intern_slot(t, hash, str);
+	if (slot->str)
+		return slot->str;
+
+	if ((t->count + 1) * 2 > t->size) {
+		uci_intern_grow(ctx, t);
+		slot = uci_intern_slot(t, hash, str);
+	}
+	slot->str = uci_arena_strdup(ctx, &t->arena, str);
+	slot->hash = hash;
+	t->count++;
+
+	return slot->str;
+}
+
+/* like uci_intern, but returns NULL instead of adding unknown strings */
+__private const char *uci_intern_find(struct uci_context *ctx, const char *str)
+{
+	struct uci_intern *t = ctx->intern;
+
+	if (!t)
+		return NULL;
+
+	return uci_intern_slot(t, djbhash(~0U, str), str)->str;
+}
+
+__private void uci_intern_free(struct uci_context *ctx)
+{
+	struct uci_intern *t = ctx->intern;
+
+	if (!t)
+		return;
+
+	uci_arena_free(&t->arena);
+	free(t->entries);
+	free(t);
+	ctx->intern = NULL;
+}
+
+__private void uci_buf_put(struct uci_context *ctx, struct uci_buf *buf, const void *data, size_t len)
+{
+	if (buf->len + len > buf->size) {
+		while (buf->len + len > buf->size)
+			buf->size = buf->size ? buf->size * 2 : 4096;
+		buf->data = uci_realloc(ctx, buf->data, buf->size);
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+__private void uci_buf_putc(struct uci_context *ctx, struct uci_buf *buf, int c)
+{
+	char ch = c;
+
+	uci_buf_put(ctx, buf, &ch, 1);
+}
+
+/* append a string with its single quotes escaped for the config syntax */
+__private void uci_buf_put_escaped(struct uci_context *ctx, struct uci_buf *buf, const char *str)
+{
+	const char *quote;
+
+	/* most strings have no quotes at all and are copied in one go */
+	while (*(quote = strchrnul(str, '\''))) {
+		uci_buf_put(ctx, buf, str, quote - str);
+		uci_buf_put(ctx, buf, "'\\''", 4);
+		str = quote + 1;
+	}
+	uci_buf_put(ctx, buf, str, quote - str);
+}
+
+/* write out the whole buffer, retrying on short writes */
+__private bool uci_buf_write(int fd, const struct uci_buf *buf)
+{
+	size_t ofs = 0;
+
+	while (ofs < buf->len) {
+		ssize_t len = write(fd, buf->data + ofs, buf->len - ofs);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		ofs += len;
+	}
+	return true;
+}
+
+/* pass the buffered data on to a stream and empty the buffer */
+__private bool uci_buf_flush(FILE *stream, struct uci_buf *buf)
+{
+	int fd = fileno(stream);
+	bool ret;
+
+	/* streams without a descriptor (e.g. memory streams) go through stdio */
+	if (fd < 0)
+		ret = (fwrite(buf->data, 1, buf->len, stream) == buf->len);
+	else
+		ret = !fflush(stream) && uci_buf_write(fd, buf);
+	buf->len = 0;
+
+	return ret;
+}
+
+__private const unsigned char uci_ctype[256] = {
+	[0] = UCI_CT_WORD | UCI_CT_DQUOTE | UCI_CT_SQUOTE,
+	['\t'] = UCI_CT_SPACE | UCI_CT_WORD,
+	['\n'] = UCI_CT_SPACE | UCI_CT_WORD,
+	['\v'] = UCI_CT_SPACE | UCI_CT_WORD,
+	['\f'] = UCI_CT_SPACE | UCI_CT_WORD,
+	['\r'] = UCI_CT_SPACE | UCI_CT_WORD,
+	[' '] = UCI_CT_SPACE | UCI_CT_WORD,
+	['"'] = UCI_CT_WORD | UCI_CT_DQUOTE,
+	['#'] = UCI_CT_WORD,
+	['\''] = UCI_CT_WORD | UCI_CT_SQUOTE,
+	[';'] = UCI_CT_WORD,
+	['\\'] = UCI_CT_WORD | UCI_CT_DQUOTE,
+	['_'] = UCI_CT_NAME,
+	['0' ... '9'] = UCI_CT_NAME,
+	['A' ... 'Z'] = UCI_CT_NAME,
+	['a' ... 'z'] = UCI_CT_NAME,
+};
+
+__private uint64_t uci_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+__private void uci_stats_merge(struct uci_stats *dst, const struct uci_stats *src)
+{
+	int i;
+
+	dst->parse_bytes += src->parse_bytes;
+	dst->parse_lines += src->parse_lines;
+	dst->lookups += src->lookups;
+	dst->compares += src->compares;
+	for (i = 0; i < UCI_STATS_DELTA_PATHS; i++)
+		dst->delta_lines[i] += src->delta_lines[i];
+	dst->delta_dropped += src->delta_dropped;
+	dst->lock_wait += src->lock_wait;
+	dst->fsync_time += src->fsync_time;
+	dst->rename_time += src->rename_time;
+}
+
 /*
  * validate strings for names and types, reject special characters
  * for names, only alphanum and _ is allowed (shell compatibility)
@@ -76,7 +314,7 @@ __private bool uci_validate_str(const char *str, bool name, bool package)
 	for (; *str; str++) {
 		unsigned char c = *str;
 
-		if (isalnum(c) || c == '_')
+		if (uci_ctype[c] & UCI_CT_NAME)
 			continue;
 
 		if (c == '-' && package)
@@ -106,15 +344,12 @@ __private void uci_alloc_parse_context(struct uci_context *ctx)
 	ctx->pctx = (struct uci_parse_context *) uci_malloc(ctx, sizeof(struct uci_parse_context));
 }
 
-int uci_parse_ptr(struct uci_context *ctx, struct uci_ptr *ptr, char *str)
+/* split a tuple string into ptr, without touching any context */
+__private bool uci_split_ptr(struct uci_ptr *ptr, char *str)
 {
 	char *last = NULL;
 	char *tmp;
 
-	UCI_HANDLE_ERR(ctx);
-	UCI_ASSERT(ctx, str);
-	UCI_ASSERT(ctx, ptr);
-
 	memset(ptr, 0, sizeof(struct uci_ptr));
 
 	/* value */
@@ -157,11 +392,23 @@ lastval:
 	if (ptr->value && !uci_validate_text(ptr->value))
 		goto error;
 
-	return 0;
+	return true;
 
 error:
 	memset(ptr, 0, sizeof(struct uci_ptr));
-	UCI_THROW(ctx, UCI_ERR_PARSE);
+	return false;
+}
+
+int uci_parse_ptr(struct uci_context *ctx, struct uci_ptr *ptr, char *str)
+{
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, str);
+	UCI_ASSERT(ctx, ptr);
+
+	if (!uci_split_ptr(ptr, str))
+		UCI_THROW(ctx, UCI_ERR_PARSE);
+
+	return 0;
 }
 
 
@@ -175,14 +422,57 @@ __private void uci_parse_error(struct uci_context *ctx, char *reason)
 }
 
 
+/*
+ * flock that gives up after ctx->lock_timeout milliseconds, failing with
+ * EWOULDBLOCK. the lock is polled with a growing delay of up to 32ms
+ */
+__private int uci_flock(struct uci_context *ctx, int fd, int op)
+{
+	struct timespec ts;
+	uint64_t start, now, deadline, delay = 1000000;
+	int ret;
+
+	if (ctx->lock_timeout < 0) {
+		start = uci_stats_clock(ctx);
+		ret = flock(fd, op);
+		uci_stats_time(ctx, &ctx->stats.lock_wait, start);
+		return ret;
+	}
+
+	start = uci_stats_now();
+	deadline = start + (uint64_t) ctx->lock_timeout * 1000000;
+	while (((ret = flock(fd, op | LOCK_NB)) < 0) && (errno == EWOULDBLOCK)) {
+		now = uci_stats_now();
+		if (now >= deadline)
+			break;
+
+		if (delay > deadline - now)
+			delay = deadline - now;
+		ts.tv_sec = delay / 1000000000;
+		ts.tv_nsec = delay % 1000000000;
+		nanosleep(&ts, NULL);
+		if (delay < 32000000)
+			delay *= 2;
+	}
+	uci_stats_time(ctx, &ctx->stats.lock_wait, start);
+	return ret;
+}
 
 /*
- * open a stream and go to the right position
- *
- * note: when opening for write and seeking to the beginning of
- * the stream, truncate the file
+ * commits rename a new config file over the one they locked. whoever waited
+ * for that lock got it on the old file and has to open the path again
  */
-__private FILE *uci_open_stream(struct uci_context *ctx, const char *filename, const char *origfilename, int pos, bool write, bool create)
+static bool uci_file_replaced(int fd, const char *filename)
+{
+	struct stat cur, locked;
+
+	if ((fstat(fd, &locked) < 0) || (stat(filename, &cur) < 0))
+		return false;
+
+	return (cur.st_dev != locked.st_dev) || (cur.st_ino != locked.st_ino);
+}
+
+static FILE *uci_open_file(struct uci_context *ctx, const char *filename, const char *origfilename, int pos, bool write, bool create, bool lock)
 {
 	struct stat statbuf;
 	FILE *file = NULL;
@@ -214,13 +504,20 @@ __private FILE *uci_open_stream(struct uci_context *ctx, const char *filename, c
 		UCI_THROW(ctx, UCI_ERR_NOTFOUND);
 	}
 
+retry:
 	fd = open(filename, flags, mode);
 	if (fd < 0)
 		goto error;
 
-	ret = flock(fd, (write ? LOCK_EX : LOCK_SH));
-	if ((ret < 0) && (errno != ENOSYS))
-		goto error_close;
+	if (lock) {
+		ret = uci_flock(ctx, fd, (write ? LOCK_EX : LOCK_SH));
+		if ((ret < 0) && (errno != ENOSYS))
+			goto error_close;
+		if (uci_file_replaced(fd, filename)) {
+			close(fd);
+			goto retry;
+		}
+	}
 
 	ret = lseek(fd, 0, pos);
 
@@ -241,6 +538,55 @@ done:
 	return file;
 }
 
+/*
+ * open a stream and go to the right position
+ *
+ * note: when opening for write and seeking to the beginning of
+ * the stream, truncate the file
+ */
+__private FILE *uci_open_stream(struct uci_context *ctx, const char *filename, const char *origfilename, int pos, bool write, bool create)
+{
+	return uci_open_file(ctx, filename, origfilename, pos, write, create, true);
+}
+
+/*
+ * open a config file for reading without locking it. commits only ever
+ * replace it by renaming a new file over it
+ */
+__private FILE *uci_open_config(struct uci_context *ctx, const char *filename)
+{
+	return uci_open_file(ctx, filename, NULL, SEEK_SET, false, false, false);
+}
+
+/*
+ * take the lock of a config file that commits hold until the new one is in
+ * place, so that changes to the savedir delta wait for them. readers never
+ * take it. returns -1 if the config file does not exist (yet)
+ */
+__private int uci_lock_config(struct uci_context *ctx, const char *filename)
+{
+	int fd;
+
+	if (!filename)
+		return -1;
+
+retry:
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if ((uci_flock(ctx, fd, LOCK_EX) < 0) && (errno != ENOSYS)) {
+		close(fd);
+		UCI_THROW(ctx, UCI_ERR_IO);
+	}
+	if (uci_file_replaced(fd, filename)) {
+		close(fd);
+		goto retry;
+	}
+
+	return fd;
+}
+
 __private void uci_close_stream(FILE *stream)
 {
 	int fd;